@@ -51,7 +51,6 @@ typedef struct {
   MD_RTF_DATA*  buf;
   size_t        cap;
   size_t        len;
-  size_t        brd;
 } MD2RTF_CTX;
 
 /**
@@ -60,9 +59,8 @@ typedef struct {
 static void md2rtf_ctx_init(MD2RTF_CTX* mdrtf)
 {
   mdrtf->buf = (MD_RTF_DATA*)malloc(4096);
-  mdrtf->cap = 4096;
+  mdrtf->cap = mdrtf->buf ? 4096 : 0;
   mdrtf->len = 0;
-  mdrtf->brd = 0;
 }
 
 /**
@@ -76,51 +74,66 @@ static void md2rtf_ctx_free(MD2RTF_CTX* mdrtf)
   }
   mdrtf->cap = 0;
   mdrtf->len = 0;
-  mdrtf->brd = 0;
 }
 
 /**
- * MD Parse / Render callback function
+ * MD Parse / Render output sink function, returns non-zero to stop render
+ * if memory is missing
  */
-static void md2rtf_write_cb(const MD_RTF_DATA* data, unsigned size, void* ptr)
+static int md2rtf_write_cb(const MD_RTF_DATA* data, MD_SIZE size, unsigned flags, void* ptr)
 {
   MD2RTF_CTX* mdrtf = (MD2RTF_CTX*)ptr;
 
+  /* flush hint, data is kept in memory anyway */
+  if(flags & MD_RTF_SINK_FLUSH)
+    return 0;
+
   if((mdrtf->len + size) > mdrtf->cap) {
 
-    if(mdrtf->cap > 0) {
+    if(mdrtf->cap == 0)
+      return -1;
 
-      size_t need = (mdrtf->len + size);
+    size_t need = (mdrtf->len + size);
+    size_t cap = mdrtf->cap;
 
-      while(mdrtf->cap < need)
-        mdrtf->cap *= 2;
+    while(cap < need)
+      cap *= 2;
 
-      mdrtf->buf = (MD_RTF_DATA*)realloc(mdrtf->buf, mdrtf->cap);
+    /* keep the previous buffer if realloc fails */
+    MD_RTF_DATA* buf = (MD_RTF_DATA*)realloc(mdrtf->buf, cap);
+    if(!buf)
+      return -1;
 
-    } else {
-      return;
-    }
+    mdrtf->buf = buf;
+    mdrtf->cap = cap;
   }
 
   memcpy(mdrtf->buf + mdrtf->len, data, size);
 
   mdrtf->len += size;
+
+  return 0;
 }
 
 /**
  * Parse and render text source to RTF data
  */
-static void md2rtf_parse_text(MD2RTF_CTX* mdrtf, const char* text, size_t size)
+static int md2rtf_parse_text(MD2RTF_CTX* mdrtf, const char* text, size_t size)
 {
   if(text == NULL)
-    return;
+    return -1;
 
   unsigned parser_flags = MD_FLAG_UNDERLINE|MD_FLAG_TABLES|MD_FLAG_PERMISSIVEAUTOLINKS;
   unsigned renderer_flags = MD_RTF_FLAG_DEBUG|MD_RTF_FLAG_SKIP_UTF8_BOM;
   unsigned font_size = 11;
   unsigned doc_width = 229;
 
-  md_rtf(text, size, md2rtf_write_cb, mdrtf, parser_flags, renderer_flags, font_size, doc_width);
+  MD_RTF_OPTS opts = { 0 };
+  opts.font_size = font_size;
+  opts.doc_width = doc_width;
+  opts.sink = md2rtf_write_cb;
+
+  return md_rtf_ex(text, size, NULL, mdrtf, parser_flags, renderer_flags, &opts);
 }
 
 /**
@@ -138,53 +151,48 @@ static size_t md2rtf_save_as_rtf(MD2RTF_CTX* mdrtf, const char* path)
 }
 
 /**
- * Rich Edit input stream callback function
+ * Rich Edit input stream callback function, RTF data is rendered as the
+ * control reads it
  */
 static DWORD CALLBACK EditStreamCallback(DWORD_PTR dwCookie, LPBYTE pbBuff, LONG cb, LONG* pcb)
 {
-  MD2RTF_CTX* mdrtf = (MD2RTF_CTX*)dwCookie;
-
-  if(mdrtf->len) {
-
-    if(cb <= mdrtf->len) {
+  MD_RTF_READER* reader = (MD_RTF_READER*)dwCookie;
+  MD_SIZE size;
 
-      memcpy(pbBuff, mdrtf->buf + mdrtf->brd, cb);
-
-      mdrtf->brd += cb;
-      mdrtf->len -= cb;
-
-      *pcb = cb;
-
-    } else {
-
-      memcpy(pbBuff, mdrtf->buf + mdrtf->brd, mdrtf->len);
-
-      *pcb = mdrtf->len;
-
-      mdrtf->brd += mdrtf->len;
-      mdrtf->len = 0;
-    }
+  int result = md_rtf_read(reader, pbBuff, cb, &size);
 
-  } else {
+  *pcb = size;
 
-    *pcb = 0;
-  }
-
-  return 0;
+  return result;
 }
 
 /**
- * Send RTF data to Rich Edit control
+ * Parse, render and send RTF data to Rich Edit control
  */
-static int md2rtf_stream_in_edit(MD2RTF_CTX* mdrtf, HWND hwnd)
+static int md2rtf_stream_in_edit(const char* text, size_t size, HWND hwnd)
 {
+  if(text == NULL)
+    return -1;
+
+  MD_RTF_OPTS opts = { 0 };
+  opts.font_size = 11;
+  opts.doc_width = 229;
+
+  MD_RTF_READER* reader = md_rtf_open(text, size,
+                                      MD_FLAG_UNDERLINE|MD_FLAG_TABLES|MD_FLAG_PERMISSIVEAUTOLINKS,
+                                      MD_RTF_FLAG_SKIP_UTF8_BOM, &opts);
+  if(!reader)
+    return -1;
+
   // send RTF data to Rich Edit
   EDITSTREAM es = { 0 };
   es.pfnCallback = EditStreamCallback;
-  es.dwCookie    = (DWORD_PTR)mdrtf;
+  es.dwCookie    = (DWORD_PTR)reader;
 
   SendMessage(hwnd, EM_STREAMIN, SF_RTF, (LPARAM)&es);
 
+  md_rtf_close(reader);
+
   return es.dwError;
 }
 
@@ -215,18 +223,18 @@ LRESULT CALLBACK WindowProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     /* initialize md2rtf custom context */
     md2rtf_ctx_init(&mdrtf);
 
-    /* parse and render text to RTF */
-    md2rtf_parse_text(&mdrtf, text, size);
-
-    /* save RTF data to file */
-    md2rtf_save_as_rtf(&mdrtf, "hello.rtf");
-
-    /* stream RTF data to Rich Edit */
-    md2rtf_stream_in_edit(&mdrtf, GetDlgItem(hWnd, IDC_RICH_EDIT));
+    /* parse and render text to RTF, then save RTF data to file */
+    if(md2rtf_parse_text(&mdrtf, text, size) == 0)
+      md2rtf_save_as_rtf(&mdrtf, "hello.rtf");
 
     /* free allocated data */
     md2rtf_ctx_free(&mdrtf);
 
+    /* render and stream RTF data to Rich Edit */
+    md2rtf_stream_in_edit(text, size, GetDlgItem(hWnd, IDC_RICH_EDIT));
+
+    free(text);
+
     break;
 
   case WM_SIZE:
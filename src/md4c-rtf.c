@@ -34,10 +34,22 @@
  * To get MD4C please visit MD4C github page:
  *    http://github.com/mity/md4c
  */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+    #define _POSIX_C_SOURCE 199309L   /* clock_gettime */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>     /* strtoul */
 #include <string.h>
 
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #define NOMINMAX
+    #include <windows.h>  /* QueryPerformanceCounter */
+#else
+    #include <time.h>     /* clock_gettime */
+#endif
+
 #include "md4c-rtf.h"
 #include "entity.h"
 
@@ -128,6 +140,8 @@ typedef struct MD_RTF_list {
   const MD_RTF_CHAR*  cw_li;  /* indentation space to apply */
   const MD_RTF_CHAR*  cw_sb;  /* space-before to apply */
   const MD_RTF_CHAR*  cw_sa;  /* space-after to apply */
+  unsigned            ls;     /* list override index, 0 if not in table */
+  unsigned            items;  /* item counter for plain text */
 } MD_RTF_LIST;
 
 #define MD_RTF_LIST_TYPE_UL   0x0
@@ -141,43 +155,183 @@ static const MD_RTF_CHAR* g_cw_list_delim[2] = {
   ".",
   ")"};
 
-typedef struct MD_RTF_tag {
-  void        (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*);
-  void*       userdata;
-  unsigned    flags;
-  char        escape_map[256];
+/* List definitions of list table, one per bullet and delimiter character,
+OL overrides follow the UL ones in list override table. Index of override
+cannot exceed 2000, lists beyond use paragraph numbering. */
+#define MD_RTF_LIST_ID_BULLT  1   /* and 2 for odd levels */
+#define MD_RTF_LIST_ID_DELIM  3   /* and 4 for closing parenthesis */
+#define MD_RTF_LIST_LS_MAX    2000
+
+/* Override of list table for an ordered list, with its start number */
+typedef struct MD_RTF_lsovr {
+  unsigned            id;     /* list definition id */
+  unsigned            start;  /* item start number */
+} MD_RTF_LSOVR;
+
+/* Growable data buffer used to capture rendered output */
+typedef struct MD_RTF_buff {
+  MD_RTF_DATA*  data;
+  MD_SIZE       size;
+  MD_SIZE       cap;
+} MD_RTF_BUFF;
+
+/* Theme compiled into document header and control words */
+struct MD_RTF_theme_tag {
   /* RTF document page sizes (twip) */
   unsigned    page_width;
   unsigned    page_height;
   unsigned    page_margin;
   /* Normal font base size (half-point) */
   unsigned    font_base;
+  /* whole document header, list table is inserted at head_list */
+  MD_RTF_CHAR head[1024];
+  MD_SIZE     head_size;
+  MD_SIZE     head_list;
+  /* header up to color table, with syntax colors */
+  MD_RTF_CHAR head_syn[1024];
+  MD_SIZE     head_syn_size;
+  /* fonts and colors tables entries, for minimal header */
+  MD_RTF_CHAR head_font[3][80];
+  MD_RTF_CHAR head_colr[11][32];
+  /* RTF control words with prebuilt values */
+  MD_RTF_CHAR cw_fs[2][8];
+  MD_RTF_CHAR cw_hf[6][24];
+  MD_RTF_CHAR cw_sa[2][16];
+  MD_RTF_CHAR cw_sb[2][16];
+  MD_RTF_CHAR cw_li[8][16];
+  MD_RTF_CHAR cw_tr[2][72];
+  MD_RTF_CHAR cw_fi[2][16];
+  MD_RTF_CHAR cw_cx[2][16];
+  MD_RTF_CHAR cw_ri[16];
+  MD_RTF_CHAR cw_pb[2][160];
+  /* hash of the above, used as cache key seed */
+  unsigned long long hash;
+};
+
+typedef struct MD_RTF_tag {
+  void        (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*);
+  void*       userdata;
+  unsigned    flags;
+  /* optional output sink with status, used instead of process_output */
+  MD_RTF_SINK sink;
+  unsigned    blk_dpth;       /* depth of blocks, document included */
+  /* first non-zero status, returned by sink or set when a limit is hit,
+  which is returned by all parser callbacks to stop the render */
+  int         status;
+  /* render limits, zero for no limit */
+  MD_SIZE     lim_out;        /* output size */
+  unsigned    lim_dpth;       /* nested lists and quotes depth */
+  unsigned    lim_cell;       /* cells per table */
+  unsigned long lim_step;     /* parser callbacks count */
+  unsigned    nest_dpth;      /* current lists and quotes depth */
+  unsigned    tabl_ncel;      /* current table cells count */
+  unsigned long step;         /* parser callbacks count so far */
+  /* preview, render ends after top-level blocks count or output size */
+  unsigned    prev_blks;      /* top-level blocks count, zero for all */
+  MD_SIZE     prev_out;       /* output size, zero for all */
+  unsigned    prev_count;     /* top-level blocks count so far */
+  unsigned    prev_stop;      /* preview is complete, parse is aborted */
+  /* optional plain text output */
+  void        (*text_output)(const MD_RTF_CHAR*, MD_SIZE, void*);
+  void*       text_userdata;
+  unsigned    plain_nl;       /* pending line feeds */
+  unsigned    plain_any;      /* some text was written */
+  unsigned    plain_bol;      /* at beginning of line */
+  unsigned    plain_mark;     /* list item marker to write */
+  unsigned    plain_cell;     /* current table cell index */
+  MD_TEXTTYPE plain_type;     /* type of text converted from wide chars */
+  /* optional copy of output, used to fill cache */
+  MD_RTF_BUFF* capt;
+  /* document is rendered as separated chunks */
+  unsigned    chunked;
+  /* output data size so far */
+  MD_SIZE     out_size;
+  /* whole source text, chunks and texts are within it */
+  const MD_CHAR* src;
+  MD_SIZE     src_size;
+  /* optional source to output offsets map */
+  MD_RTF_OFFSET_MAP* omap;
+  MD_OFFSET   omap_pos;       /* source offset after last text */
+  unsigned    omap_pend;      /* first entry without source offset */
+  /* optional events trace, with the callbacks it wraps */
+  MD_RTF_TRACE* trace;
+  MD_PARSER   trace_next;
+  char        escape_map[256];
+  /* theme given in options, or built for this render */
+  const MD_RTF_THEME* thm;
+  MD_RTF_THEME thm_own;
   /* list render process variables */
-  MD_RTF_LIST list[8];
+  MD_RTF_LIST* list;
+  unsigned    list_cap;
   int         list_dpth;
   unsigned    list_rset;
   unsigned    list_para;
+  /* list table, with overrides of ordered lists found by pre-scan */
+  unsigned    list_tabl;
+  unsigned    list_used;      /* bit mask of used list definitions */
+  MD_RTF_BUFF list_ovr;       /* MD_RTF_LSOVR of ordered lists */
+  unsigned    list_nols;      /* count of ordered lists overrides */
+  unsigned    list_next;      /* index of next ordered list */
+  /* fonts and colors declared in header, one bit per table index */
+  unsigned    head_font;
+  unsigned    head_colr;
   /* table render process variables */
   unsigned    tabl_cols;
   unsigned    tabl_head;
+  /* table layout process variables */
+  unsigned    tabl_layo;      /* columns layout mode */
+  MD_RTF_BUFF* tabl_buff;     /* held rows data, NULL when streaming */
+  MD_RTF_BUFF tabl_data;      /* storage for held rows data */
+  MD_RTF_BUFF tabl_rowv;      /* offsets of held rows in data */
+  MD_RTF_BUFF tabl_pfx[2];    /* row prefix for body and head rows */
+  unsigned    tabl_nhead;     /* count of head rows */
+  unsigned    tabl_nrow;      /* max count of held rows, 0 for no limit */
+  unsigned    tabl_omap;      /* first offset map entry of table */
+  unsigned long* tabl_wmin;   /* longest word width per column */
+  unsigned long* tabl_wmax;   /* longest text width per column */
+  unsigned    tabl_meas;      /* cell text is measured */
+  unsigned    tabl_cell;      /* current cell index */
+  unsigned long tabl_text;    /* current cell text width */
+  unsigned long tabl_word;    /* current word width */
+  unsigned long tabl_long;    /* current cell longest word width */
   /* do not end paragraph flag */
   unsigned    quot_blck;
-  /* block code must render LF flag */
+  /* depth of quotes drawn with paragraph borders */
+  unsigned    quot_dpth;
+  /* count of block code LF to render before next line */
   unsigned    code_lf;
-  /* RTF control words with prebuilt values */
-  MD_RTF_CHAR cw_fs[2][8];
-  MD_RTF_CHAR cw_hf[6][24];
-  MD_RTF_CHAR cw_sa[2][16];
-  MD_RTF_CHAR cw_sb[2][16];
-  MD_RTF_CHAR cw_li[8][16];
-  MD_RTF_CHAR cw_tr[2][72];
-  MD_RTF_CHAR cw_fi[2][16];
-  MD_RTF_CHAR cw_cx[2][16];
+  unsigned    code_blck;      /* within block code */
+  unsigned    code_tab;       /* tab stops, zero to keep tabs */
+  unsigned    code_col;       /* output column of current line */
+  unsigned    code_ind;       /* indentation of next line */
+  unsigned    code_rows;      /* max lines per row, zero for no limit */
+  unsigned    code_line;      /* line breaks in current row */
+  /* source range of block code lines not yet written */
+  const MD_CHAR* code_beg;
+  const MD_CHAR* code_end;
+  /* table of contents, document body is held until its end so the contents
+  built while headings are rendered can be written first */
+  unsigned    toc_hold;       /* body output is held */
+  unsigned    toc_head;       /* heading text is copied to contents */
+  unsigned    toc_text;       /* output goes to contents */
+  unsigned    toc_fail;       /* contents lost, out of memory */
+  unsigned    toc_count;      /* count of headings */
+  MD_SIZE     toc_beg;        /* output size at start of body */
+  MD_SIZE     toc_size;       /* size of written contents */
+  MD_RTF_BUFF toc;            /* contents entries */
+  MD_RTF_BUFF toc_body;       /* held body output */
+  /* syntax highlighting language and lexer state */
+  const struct MD_RTF_lang* code_lang;
+  unsigned    code_hl;
+  /* keywords hash table of language, index of keyword plus one */
+  const struct MD_RTF_lang* code_kw_lang;
+  unsigned char code_kw[256];
 } MD_RTF;
 
 #define NEED_RTF_ESC_FLAG   0x1
 #define NEED_URL_ESC_FLAG   0x2
 #define NEED_PRE_ESC_FLAG   0x4
+#define NEED_CODE_ESC_FLAG  0x8
 
 /******************************************
  ***   RTF rendering helper functions   ***
@@ -187,6 +341,9 @@ typedef struct MD_RTF_tag {
 #define ISLOWER(ch)     ('a' <= (ch) && (ch) <= 'z')
 #define ISUPPER(ch)     ('A' <= (ch) && (ch) <= 'Z')
 #define ISALNUM(ch)     (ISLOWER(ch) || ISUPPER(ch) || ISDIGIT(ch))
+#define ISXDIGIT(ch)    (ISDIGIT(ch) || ('a' <= (ch) && (ch) <= 'f') || ('A' <= (ch) && (ch) <= 'F'))
+#define ISBLANK(ch)     ((ch) == ' ' || (ch) == '\t')
+#define ISNEWLINE(ch)   ((ch) == '\r' || (ch) == '\n')
 
 #ifdef MD4C_USE_UTF16
 /* Function to convert WCHAR to UTF8 string then forward result to the
@@ -211,10 +368,132 @@ render_wchar(MD_RTF* r, const wchar_t* text, MD_SIZE size,
 #endif
 
 
+/* Append data to buffer, growing it as needed. Returns 0 on success or -1 if
+memory allocation failed, in which case buffer is left unchanged. */
+static int
+buff_append(MD_RTF_BUFF* b, const void* data, MD_SIZE size)
+{
+  if(b->size + size > b->cap) {
+
+    MD_SIZE cap = b->cap ? b->cap : 256;
+
+    while(cap < b->size + size)
+      cap *= 2;
+
+    MD_RTF_DATA* data_new = (MD_RTF_DATA*)realloc(b->data, cap);
+    if(!data_new)
+      return -1;
+
+    b->data = data_new;
+    b->cap = cap;
+  }
+
+  /* data may be NULL for an empty buffer */
+  if(size)
+    memcpy(b->data + b->size, data, size);
+  b->size += size;
+
+  return 0;
+}
+
+static void
+buff_free(MD_RTF_BUFF* b)
+{
+  free(b->data);
+  b->data = NULL;
+  b->size = 0;
+  b->cap = 0;
+}
+
+static void render_table_flush(MD_RTF* r);
+static void render_toc_release(MD_RTF* r);
+
+/* Render trace events kinds */
+#define TRACE_SETUP   0   /* render initialization and source scan */
+#define TRACE_BLOCK   1
+#define TRACE_SPAN    2
+#define TRACE_FLUSH   3   /* flush hint sent to sink */
+
+static void trace_event(MD_RTF_TRACE* t, unsigned kind, unsigned type,
+                        unsigned phase, MD_SIZE out);
+
+/* Stop the render with the given status, unless already stopped */
+static inline void
+render_stop(MD_RTF* r, int status)
+{
+  if(r->status == 0)
+    r->status = status;
+}
+
+static void
+render_output(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
+{
+  /* once stopped nothing more is sent, parser callbacks then return the
+  status to stop the render */
+  if(r->status != 0)
+    return;
+
+  /* body is held until table of contents is complete, if memory is missing
+  the contents is written with headings found so far */
+  if(r->toc_hold) {
+    if(buff_append(&r->toc_body, text, size) == 0)
+      return;
+    render_toc_release(r);
+  }
+
+  if(r->sink) {
+    r->status = r->sink((MD_RTF_DATA*)text, size, 0, r->userdata);
+  } else {
+    r->process_output((MD_RTF_DATA*)text, size, r->userdata);
+  }
+
+  /* keep a copy of output to be stored in cache */
+  if(r->capt) {
+    if(buff_append(r->capt, text, size) != 0) {
+      buff_free(r->capt);
+      r->capt = NULL;
+    }
+  }
+}
+
+/* Tell the sink this is a natural point to send output data, at end of top
+level blocks, unless data is held for a table layout */
+static void
+render_flush_hint(MD_RTF* r)
+{
+  if(r->sink && r->status == 0 && !r->tabl_buff && !r->toc_hold) {
+    if(r->trace)
+      trace_event(r->trace, TRACE_FLUSH, 0, 'i', r->out_size);
+    r->status = r->sink(NULL, 0, MD_RTF_SINK_FLUSH, r->userdata);
+  }
+}
+
 static inline void
 render_verbatim(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
 {
-  r->process_output((MD_RTF_DATA*)text, size, r->userdata);
+  /* heading text copied to table of contents */
+  if(r->toc_text) {
+    if(!r->toc_fail && buff_append(&r->toc, text, size) != 0)
+      r->toc_fail = 1;
+    return;
+  }
+
+  if(r->lim_out && r->out_size + size > r->lim_out) {
+    render_stop(r, MD_RTF_ERROR_OUTPUT_LIMIT);
+    return;
+  }
+
+  r->out_size += size;
+
+  /* table rows are held until columns widths are known, if memory is
+  missing we stop holding and compute widths with what we have */
+  if(r->tabl_buff) {
+    if(buff_append(r->tabl_buff, text, size) == 0)
+      return;
+    render_table_flush(r);
+  }
+
+  render_output(r, text, size);
 }
 
 /* Keep this as a macro. Most compiler should then be smart enough to replace
@@ -269,20 +548,64 @@ render_url_escaped(MD_RTF* r, const MD_RTF_CHAR* data, MD_SIZE size)
 }
 
 static inline void
-render_unicode(MD_RTF* r, unsigned u)
+render_cp1252(MD_RTF* r, unsigned u)
 {
-  MD_RTF_CHAR str_ucp[16];
-  render_verbatim(r, "\\u", 2);
-  RENDER_VERBATIM(r, ultostr(u, str_ucp, 10, ' ')); //< add space after number
+  MD_RTF_CHAR str_acp[16];
+  render_verbatim(r, "\\'", 2);
+  RENDER_VERBATIM(r, ultostr(u, str_acp, 16, 0)); //< add space after number
 }
 
+/* Unicode code points of CP1252 characters 0x80 to 0x9F which differ from
+Latin-1, sorted by code point, characters 0xA0 to 0xFF are the same */
+static const unsigned short g_cp1252_map[27][2] = {
+  {0x0152, 0x8C}, {0x0153, 0x9C}, {0x0160, 0x8A}, {0x0161, 0x9A},
+  {0x0178, 0x9F}, {0x017D, 0x8E}, {0x017E, 0x9E}, {0x0192, 0x83},
+  {0x02C6, 0x88}, {0x02DC, 0x98}, {0x2013, 0x96}, {0x2014, 0x97},
+  {0x2018, 0x91}, {0x2019, 0x92}, {0x201A, 0x82}, {0x201C, 0x93},
+  {0x201D, 0x94}, {0x201E, 0x84}, {0x2020, 0x86}, {0x2021, 0x87},
+  {0x2022, 0x95}, {0x2026, 0x85}, {0x2030, 0x89}, {0x2039, 0x8B},
+  {0x203A, 0x9B}, {0x20AC, 0x80}, {0x2122, 0x99}};
+
+/* Returns CP1252 character of the given code point, or 0 if none */
+static unsigned
+cp1252_from_unicode(unsigned u)
+{
+  if(u >= 0xA0 && u <= 0xFF)
+    return u;
+
+  if(u < 0x0152 || u > 0x2122)
+    return 0;
+
+  unsigned lo = 0, hi = 27;
+
+  while(lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    if(g_cp1252_map[mid][0] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return (lo < 27 && g_cp1252_map[lo][0] == u) ? g_cp1252_map[lo][1] : 0;
+}
 
 static inline void
-render_cp1252(MD_RTF* r, unsigned u)
+render_unicode(MD_RTF* r, unsigned u)
 {
-  MD_RTF_CHAR str_acp[16];
-  render_verbatim(r, "\\'", 2);
-  RENDER_VERBATIM(r, ultostr(u, str_acp, 16, 0)); //< add space after number
+  MD_RTF_CHAR str_ucp[16];
+
+  /* characters of document codepage have a shorter form */
+  if(r->flags & MD_RTF_FLAG_ANSI_CP1252) {
+    unsigned c = cp1252_from_unicode(u);
+    if(c) {
+      render_cp1252(r, c);
+      return;
+    }
+  }
+
+  render_verbatim(r, "\\u", 2);
+  RENDER_VERBATIM(r, ultostr(u, str_ucp, 10, ' ')); //< add space after number
 }
 
 static unsigned
@@ -391,1005 +714,5351 @@ render_rtf_escaped(MD_RTF* r, const MD_RTF_CHAR* data, MD_SIZE size)
   }
 }
 
-static void
-render_text_code(MD_RTF* r, const MD_RTF_CHAR* data, MD_SIZE size)
+static const MD_RTF_CHAR g_code_spaces[] = "                ";
+
+/* block code cell, enclosed in gray block */
+static const MD_RTF_CHAR g_cw_code_cell[] =
+                      "\\clbrdrt\\brdrs\\brdrw1\\brdrcf5"  /* invisible border */
+                      "\\clbrdrb\\brdrs\\brdrw1\\brdrcf5"  /* invisible border */
+                      "\\clbrdrl\\brdrs\\brdrw70\\brdrcf3"
+                      "\\clbrdrr\\brdrs\\brdrw1\\brdrcf2" /* invisible border */
+                      "\\clcbpat5";
+
+/* Count of spaces which expand a tab of block code at the given output
+column, to the next tab stop */
+static inline unsigned
+render_code_tab(MD_RTF* r, unsigned col)
 {
-  /* due to how MD4C parser works, a last LF '\n' is always emitted as last
-  text block before leaving the code block which produce a visible empty line
-  at the end of block. To avoid this, we need to handle line feeds manually
-  inside the block code.
+  return r->code_tab - (col % r->code_tab);
+}
 
-  To do so, we skip each input '\n' then rather manually put a line feed at
-  start of the next text block. This way, the last received LF is never
-  rendered. */
+/* Output gathered to be written at once */
+typedef struct MD_RTF_outb {
+  MD_RTF*             r;
+  MD_SIZE             size;
+  MD_RTF_CHAR         data[512];
+} MD_RTF_OUTB;
 
-  /* if input data is LF we ignore it and simply set the flag make a line
-  feed at start of the next text input */
-  if(data[0] == '\n' && size == 1) {
-    r->code_lf = 1;
-    return;
+static void
+outb_flush(MD_RTF_OUTB* o)
+{
+  if(o->size) {
+    render_verbatim(o->r, o->data, o->size);
+    o->size = 0;
   }
+}
 
-  /* previous input was LF, we now render the line feed */
-  if(r->code_lf) {
-    render_verbatim(r, "\\line1", 6);
-    r->code_lf = 0;
+static void
+outb_put(MD_RTF_OUTB* o, const MD_RTF_CHAR* data, MD_SIZE size)
+{
+  if(o->size + size > sizeof(o->data)) {
+    outb_flush(o);
+    if(size > sizeof(o->data)) {
+      render_verbatim(o->r, data, size);
+      return;
+    }
   }
 
-  /* render input text as normal text */
-  render_rtf_escaped(r, data, size);
+  memcpy(o->data + o->size, data, size);
+  o->size += size;
 }
 
-
-/* Translate entity to its UTF-8 equivalent, or output the verbatim one
- * if such entity is unknown (or if the translation is disabled). */
+/* Line break of block code. Long blocks may be split in consecutive table rows
+of at most code_rows lines, which viewers lay out faster than a single huge
+cell. Rows are joined without space after and before so no seam is visible,
+the last row keeps the space after of block. */
 static void
-render_entity(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
+outb_code_lf(MD_RTF_OUTB* o)
 {
-  if(r->flags & MD_RTF_FLAG_VERBATIM_ENTITIES) {
-    render_verbatim(r, text, size);
+  MD_RTF* r = o->r;
+
+  r->code_col = 0;
+
+  if(r->code_rows && ++r->code_line == r->code_rows) {
+    r->code_line = 0;
+    /* consecutive paragraphs with same borders are drawn as one */
+    if(r->flags & MD_RTF_FLAG_PARA_BORDERS) {
+      outb_put(o, "\\par\r\n", 6);
+      return;
+    }
+    outb_put(o, "\\sa0\\cell\\row\\trowd", 19);
+    outb_put(o, r->thm->cw_tr[0], (MD_SIZE)strlen(r->thm->cw_tr[0]));
+    outb_put(o, g_cw_code_cell, sizeof(g_cw_code_cell) - 1);
+    outb_put(o, r->thm->cw_cx[0], (MD_SIZE)strlen(r->thm->cw_cx[0]));
+    outb_put(o, "\\sb0", 4);
+    outb_put(o, r->thm->cw_sa[1], (MD_SIZE)strlen(r->thm->cw_sa[1]));
     return;
   }
 
-  /* We assume Unicode output is what is desired. */
-  if(size > 3 && text[1] == '#') {
-
-    unsigned u = 0;
+  outb_put(o, "\\line1", 6);
+}
 
-    if(text[2] == 'x' || text[2] == 'X') {
-      u = strtoul(text + 3, NULL, 16);
-    } else {
-      u = strtoul(text + 2, NULL, 10);
-    }
+/* Same as render_rtf_escaped() for block code text, which may span several
+lines: line feeds (LF, CR or CRLF) are written as line breaks and tabs are
+expanded if required. The output column is kept from a call to the next, it
+is only used to expand tabs. */
+static void
+outb_code(MD_RTF_OUTB* o, const MD_RTF_CHAR* data, MD_SIZE size)
+{
+  MD_RTF* r = o->r;
+  MD_OFFSET beg = 0;
+  MD_OFFSET off = 0;
+  MD_OFFSET col = 0;  /* offset of data at output column */
+  unsigned n;
 
-    render_unicode(r, u);
+  #define NEED_CODE_ESC(ch)   (r->escape_map[(unsigned char)(ch)] & NEED_CODE_ESC_FLAG)
 
-    return;
+  while(1) {
+    /* Optimization: Use some loop unrolling. */
+    while(off + 3 < size  &&  !NEED_CODE_ESC(data[off+0])  &&  !NEED_CODE_ESC(data[off+1])
+                          &&  !NEED_CODE_ESC(data[off+2])  &&  !NEED_CODE_ESC(data[off+3]))
+      off += 4;
 
-  } else {
-    #ifdef MD4C_ENTITY_H
-    /* Named entity (e.g. "&nbsp;"). */
-    const struct entity* ent;
+    while((off < size) && !NEED_CODE_ESC(data[off]))
+      off++;
 
-    ent = entity_lookup(text, size);
-    if(ent != NULL) {
+    outb_put(o, data + beg, off - beg);
 
-      /* we do not support > 4 bytes unicode for now */
-      if(!ent->codepoints[1])
-        render_unicode(r, ent->codepoints[0]);
+    if(off >= size)
+      break;
 
-      return;
+    if((unsigned char)data[off] > 0x7F) {
+      /* one column whatever its UTF-8 size */
+      outb_flush(o);
+      r->code_col += off - col + 1;
+      off += render_non_ascii(r, (unsigned char*)(data + off), size - off);
+      col = off;
+    } else {
+      switch(data[off]) {
+        case '\\': outb_put(o, "\\\\", 2); break;
+        case '{' : outb_put(o, "\\{", 2); break;
+        case '}' : outb_put(o, "\\}", 2); break;
+        case '\r':
+          /* CR of CRLF, which may also be split between two calls when
+          converted from wide chars */
+          if(off + 1 == size || data[off+1] == '\n')
+            break;
+          /* fall through */
+        case '\n':
+          outb_code_lf(o);
+          col = off + 1;
+          break;
+        case '\t':
+          r->code_col += off - col;
+          n = render_code_tab(r, r->code_col);
+          outb_put(o, g_code_spaces, n);
+          r->code_col += n;
+          col = off + 1;
+          break;
+      }
+      off++;
     }
-    #endif
+
+    beg = off;
   }
 
-  render_rtf_escaped(r, text, size);
+  r->code_col += size - col;
 }
 
-
 static void
-render_font_norm(MD_RTF* r)
+render_code_escaped(MD_RTF* r, const MD_RTF_CHAR* data, MD_SIZE size)
 {
-  /* change font style with the normal font (#0 : Calibri) */
+  MD_RTF_OUTB out;
 
-  render_verbatim(r, "\\f0", 3);
-  render_verbatim(r, r->cw_fs[0], 5);
+  out.r = r;
+  out.size = 0;
+
+  outb_code(&out, data, size);
+  outb_flush(&out);
 }
 
-static void
-render_font_mono(MD_RTF* r)
+
+/* Syntax highlighting of fenced code blocks. Each language is described by a
+keywords table and a few lexical flags, code text is scanned once from
+left to right and tokens are enclosed in groups with their own color, other
+text is written as is. Block comments and Python triple quoted strings may
+span several lines, the lexer state is kept between lines. */
+#define HL_BLOCK_CMT        0x01  /* C-like block comments */
+#define HL_TRIPLE_STR       0x02  /* Python triple quoted strings */
+#define HL_PREPROC          0x04  /* C preprocessor directives */
+#define HL_NOCASE           0x08  /* keywords are case insensitive */
+#define HL_SQ_STR           0x10  /* single quoted strings */
+#define HL_VAR              0x20  /* shell variables */
+#define HL_WORD_CMT         0x40  /* line comment must start a word */
+
+/* lexer state at end of line */
+#define HL_STATE_CODE       0
+#define HL_STATE_CMT        1     /* within block comment */
+#define HL_STATE_STR3D      2     /* within """ string */
+#define HL_STATE_STR3S      3     /* within ''' string */
+
+/* tokens colors, syntax colors of color table */
+#define HL_KEYWORD          0
+#define HL_STRING           1
+#define HL_COMMENT          2
+#define HL_NUMBER           3
+#define HL_PLAIN            4
+
+typedef struct MD_RTF_lang {
+  const char*         names[5]; /* fence language names, lowercase */
+  const char* const*  kw;       /* keywords */
+  unsigned            kw_count;
+  const char*         line_cmt; /* line comment start, or NULL */
+  unsigned            flags;    /* HL_XXX flags */
+} MD_RTF_LANG;
+
+static const char* g_hl_kw_c[59] = {
+  "alignas", "alignof", "auto", "bool", "break", "case",
+  "catch", "char", "class", "const", "constexpr", "continue",
+  "default", "delete", "do", "double", "else", "enum",
+  "explicit", "extern", "false", "float", "for", "friend",
+  "goto", "if", "inline", "int", "long", "namespace",
+  "new", "noexcept", "nullptr", "operator", "private", "protected",
+  "public", "register", "return", "short", "signed", "sizeof",
+  "static", "struct", "switch", "template", "this", "throw",
+  "true", "try", "typedef", "typename", "union", "unsigned",
+  "using", "virtual", "void", "volatile", "while"};
+
+static const char* g_hl_kw_py[35] = {
+  "False", "None", "True", "and", "as", "assert",
+  "async", "await", "break", "class", "continue", "def",
+  "del", "elif", "else", "except", "finally", "for",
+  "from", "global", "if", "import", "in", "is",
+  "lambda", "nonlocal", "not", "or", "pass", "raise",
+  "return", "try", "while", "with", "yield"};
+
+static const char* g_hl_kw_json[3] = {
+  "false", "null", "true"};
+
+static const char* g_hl_kw_sh[25] = {
+  "case", "cd", "do", "done", "echo", "elif",
+  "else", "esac", "exit", "export", "fi", "for",
+  "function", "if", "in", "local", "read", "return",
+  "set", "shift", "source", "then", "unset", "until",
+  "while"};
+
+static const char* g_hl_kw_sql[51] = {
+  "ADD", "ALL", "ALTER", "AND", "AS", "ASC",
+  "BETWEEN", "BY", "CASE", "CREATE", "DELETE", "DESC",
+  "DISTINCT", "DROP", "ELSE", "END", "EXISTS", "FROM",
+  "FULL", "GROUP", "HAVING", "IN", "INDEX", "INNER",
+  "INSERT", "INTO", "IS", "JOIN", "KEY", "LEFT",
+  "LIKE", "LIMIT", "NOT", "NULL", "ON", "OR",
+  "ORDER", "OUTER", "PRIMARY", "RIGHT", "SELECT", "SET",
+  "TABLE", "THEN", "UNION", "UPDATE", "VALUES", "VIEW",
+  "WHEN", "WHERE", "WITH"};
+
+static const MD_RTF_LANG g_hl_lang[5] = {
+  {{"c", "cpp", "c++", "h", "hpp"}, g_hl_kw_c, 59, "//",
+    HL_BLOCK_CMT|HL_PREPROC|HL_SQ_STR},
+  {{"python", "py"}, g_hl_kw_py, 35, "#",
+    HL_TRIPLE_STR|HL_SQ_STR},
+  {{"json"}, g_hl_kw_json, 3, NULL,
+    0},
+  {{"sh", "bash", "shell", "zsh"}, g_hl_kw_sh, 25, "#",
+    HL_SQ_STR|HL_VAR|HL_WORD_CMT},
+  {{"sql"}, g_hl_kw_sql, 51, "--",
+    HL_BLOCK_CMT|HL_NOCASE|HL_SQ_STR}};
+
+/* Class of ASCII characters, characters of class 0 cannot start a token and
+are skipped at once */
+#define HL_CC_IDENT         0x1   /* letter or underscore */
+#define HL_CC_DIGIT         0x2
+#define HL_CC_MARK          0x4   /* may start string, comment or variable */
+
+static const unsigned char g_hl_cc[128] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 4, 4, 4, 0, 0, 4, 0, 0, 0, 0, 0, 4, 0, 4,   /*  !"#$%&'()*+,-./ */
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 0, 0, 0, 0, 0,   /* 0123456789:;<=>? */
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,   /* @ABCDEFGHIJKLMNO */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,   /* PQRSTUVWXYZ[\]^_ */
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,   /* `abcdefghijklmno */
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};  /* pqrstuvwxyz{|}~  */
+
+#define HL_CC(ch)           (((unsigned char)(ch) < 128) ? g_hl_cc[(unsigned char)(ch)] : 0)
+
+/* Returns language of the given code block fence info, or NULL if unknown */
+static const MD_RTF_LANG*
+hl_lang_find(const MD_BLOCK_CODE_DETAIL* code)
 {
-  /* change paragraph style to monospace font (#1 :. Courrier New )
-  with its dedicated size, little smaller than the normal */
+  const MD_CHAR* text = code->lang.text;
+  MD_SIZE size = code->lang.size;
+  unsigned i, j;
+  MD_SIZE k;
+
+  if(text == NULL || size == 0 || size > 8)
+    return NULL;
+
+  for(i = 0; i < 5; ++i) {
+    for(j = 0; j < 5 && g_hl_lang[i].names[j]; ++j) {
+      const char* name = g_hl_lang[i].names[j];
+      for(k = 0; k < size; ++k) {
+        MD_CHAR ch = text[k];
+        if(ISUPPER(ch)) ch += 'a' - 'A';
+        if(ch != (MD_CHAR)name[k])
+          break;
+      }
+      if(k == size && name[k] == 0)
+        return &g_hl_lang[i];
+    }
+  }
 
-  render_verbatim(r, "\\f1", 3);
-  render_verbatim(r, r->cw_fs[1], 5);
+  return NULL;
 }
 
-static inline void
-render_end_block(MD_RTF* r)
+#define HL_HASH(text, size)  ((((text)[0] | 0x20) * 31 + ((text)[(size)-1] | 0x20) * 7 + (size) * 17) & 255)
+
+/* Build keywords hash table of language, with linear probing, if not already
+built by a previous code block */
+static void
+hl_keyword_hash(MD_RTF* r, const MD_RTF_LANG* lang)
 {
-  /* this sequence is used to put standard paragraph space after a special
-  block such as list, quote or code, where space-after value is usually
-  changed or disabled. */
+  unsigned i, h;
 
-  /* reset to normal font font but without space after */
-  render_verbatim(r, "\\pard\\f0", 8);
-  render_verbatim(r, r->cw_fs[0], 5);
+  if(r->code_kw_lang == lang)
+    return;
 
-  /* end paragraph, notice that CRLF is here
-  only for readability of source data */
-  render_verbatim(r, "\\sb0\\sa0\\par\r\n", 14);
-}
+  memset(r->code_kw, 0, sizeof(r->code_kw));
 
-static inline void
-render_list_start(MD_RTF* r)
-{
-  MD_RTF_CHAR str_num[16];
+  for(i = 0; i < lang->kw_count; ++i) {
+    h = HL_HASH(lang->kw[i], strlen(lang->kw[i]));
+    while(r->code_kw[h])
+      h = (h + 1) & 255;
+    r->code_kw[h] = i + 1;
+  }
 
-  unsigned d = r->list_dpth;
+  r->code_kw_lang = lang;
+}
 
-  #ifdef _DEBUG
-  printf_tabs(2, d);
-  printf("++ render_list_start (%u)\n", r->list[d].count);
-  #endif
+/* Returns whether the given identifier is a keyword of language */
+static int
+hl_keyword(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
+{
+  const MD_RTF_LANG* lang = r->code_lang;
+  unsigned h = HL_HASH(text, size);
+  MD_SIZE k;
 
-  /* if this is a reset after nested list we end the last item paragraph */
-  if(r->list_rset)
-    render_verbatim(r, "\\par", 4);
+  while(r->code_kw[h]) {
 
-  render_verbatim(r, "\\pard", 5); /* reset paragraph */
-  render_verbatim(r, r->cw_fs[0], 5);  /* normal font size */
-  render_verbatim(r, "{\\pntext\\f0 ", 12);  /* normal font size */
+    const char* kw = lang->kw[r->code_kw[h] - 1];
 
-  if(r->list[d].type == MD_RTF_LIST_TYPE_OL) {  /* OL */
+    for(k = 0; k < size; ++k) {
+      MD_RTF_CHAR ch = text[k];
+      if((lang->flags & HL_NOCASE) && ISLOWER(ch))
+        ch -= 'a' - 'A';
+      if(ch != kw[k])
+        break;
+    }
 
-    /* we need to the start number added to item count because
-    this can be a list restart after the end of nested list */
-    ultostr(r->list[d].count + r->list[d].start, str_num, 10, 0);
+    if(k == size && kw[k] == 0)
+      return 1;
 
-    RENDER_VERBATIM(r, str_num);
-    render_verbatim(r, r->list[d].cw_tx, 1); /* delimiter character */
-    render_verbatim(r, "\\tab}{\\*\\pn\\pnlvlbody\\pnf0\\pnstart", 34);
-    RENDER_VERBATIM(r, str_num);
-    render_verbatim(r, "\\pndec{\\pntxta", 14);
-  } else {                                      /* UL */
-    render_verbatim(r, r->list[d].cw_tx, 7); /* bullet character */
-    render_verbatim(r, "\\tab}{\\*\\pn\\pnlvlblt\\pnf0{\\pntxtb", 33);
+    h = (h + 1) & 255;
   }
 
-  RENDER_VERBATIM(r, r->list[d].cw_tx); /* either delimiter or bullet char */
-  render_verbatim(r, "}}", 2);
-  RENDER_VERBATIM(r, r->list[d].cw_li); /* \liN */
-  RENDER_VERBATIM(r, r->list[d].cw_sb); /* \sbN */
-  RENDER_VERBATIM(r, r->list[d].cw_sa); /* \saN */
+  return 0;
+}
 
-  if(r->list[d].type == MD_RTF_LIST_TYPE_OL) {  /* OL */
-    RENDER_VERBATIM(r, r->cw_fi[1]); /* \fiN */
-  } else {                                      /* UL */
-    RENDER_VERBATIM(r, r->cw_fi[0]); /* \fiN */
+/* Returns end of the multi-line comment or string the lexer is in, searching
+from the given offset, and leaves this state if its end is found. */
+static MD_SIZE
+hl_state_end(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size, MD_SIZE off)
+{
+  MD_RTF_CHAR ch = (r->code_hl == HL_STATE_STR3D) ? '"' : '\'';
+  MD_SIZE i;
+
+  for(i = off; i + 1 < size; ++i) {
+    if(r->code_hl == HL_STATE_CMT) {
+      if(text[i] == '*' && text[i+1] == '/') {
+        r->code_hl = HL_STATE_CODE;
+        return i + 2;
+      }
+    } else if(i + 2 < size && text[i] == ch && text[i+1] == ch && text[i+2] == ch) {
+      r->code_hl = HL_STATE_CODE;
+      return i + 3;
+    }
   }
 
-  r->list_rset = 0;
+  return size;
 }
 
-static inline void
-render_list_item(MD_RTF* r)
+/* Returns end of the string starting at given offset, after its closing
+quote, or end of line if not closed */
+static MD_SIZE
+hl_string_end(const MD_RTF_CHAR* text, MD_SIZE size, MD_SIZE off)
 {
-  MD_RTF_CHAR str_num[16];
-
-  unsigned d = r->list_dpth;
-
-  #ifdef _DEBUG
-  printf_tabs(2, d);
-  printf("++ render_list_item (%u)\n", r->list[d].start);
-  #endif
-
-  /* reset paragraph */
-  render_verbatim(r, "\\par{\\pntext\\f0 ", 16);
-
-  if(r->list[d].type == MD_RTF_LIST_TYPE_OL) { /* OL */
-    ultostr(r->list[d].count + r->list[d].start, str_num, 10, 0);
-    RENDER_VERBATIM(r, str_num);
-    render_verbatim(r, r->list[d].cw_tx, 1); /* delimiter char */
-  } else {
-    render_verbatim(r, r->list[d].cw_tx, 7); /* bullet char */
+  MD_RTF_CHAR q = text[off];
+  MD_SIZE i;
+
+  for(i = off + 1; i < size; ++i) {
+    if(text[i] == '\\') {
+      i++;
+    } else if(text[i] == q) {
+      return i + 1;
+    }
   }
 
-  render_verbatim(r, "\\tab}", 5);
+  return size;
 }
 
 static void
-render_enter_block_doc(MD_RTF* r)
+hl_token(MD_RTF_OUTB* o, unsigned tok, const MD_RTF_CHAR* data, MD_SIZE size)
 {
-  MD_RTF_CHAR str_page[512];
-
-  RENDER_VERBATIM(r,  "{\\rtf1\\ansi\\ansicpg1252\\deff0"
-                        /* font table */
-                        "{\\fonttbl"
-                          "{\\f0\\fswiss Calibri;}"
-                          "{\\f1\\fmodern Consolas;}"
-                          "{\\f2\\fnil Symbol;}"
-                        "}"
-                        /* color table */
-                        "{\\colortbl;"
-                          "\\red0\\green0\\blue0;"        /* black */
-                          "\\red255\\green255\\blue255;"  /* white */
-                          "\\red180\\green180\\blue180;"  /* gray */
-                          "\\red0\\green102\\blue204;"    /* blue */
-                          "\\red240\\green240\\blue240;"  /* silver */
-                          "\\red90\\green90\\blue90;"     /* dark gray */
-                        "}"
-                        /* additional informations */
-                        "{\\*\\generator MD4C-RTF}\\viewkind5");
-
-
-                        /* document parameters */
-  sprintf(str_page,     "\\paperw%u\\paperh%u"
-                        "\\margl%u\\margr%u\\margt%u\\margb%u",
-                        r->page_width, r->page_height,
-                        r->page_margin, r->page_margin, r->page_margin, r->page_margin);
-
-  RENDER_VERBATIM(r, str_page);
-
-                        /* document initialization */
-  RENDER_VERBATIM(r, "\\uc0\r\n\\pard");
+  static const MD_RTF_CHAR* cw_cf[4] = {
+    "{\\cf7 ", "{\\cf8 ", "{\\cf9 ", "{\\cf10 "};
 
-  /* default space after and before */
-  render_verbatim(r, "\\sb0\\sa0 ", 9);
+  outb_put(o, cw_cf[tok], (tok < HL_NUMBER) ? 6 : 7);
+  outb_code(o, data, size);
+  outb_put(o, "}", 1);
 }
 
+/* Render a line of code with syntax highlighting */
 static void
-render_leave_block_doc(MD_RTF* r)
+render_code_hl(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
 {
-  render_verbatim(r, "}\0", 2);
-}
+  const MD_RTF_LANG* lang = r->code_lang;
+  const char* lc = lang->line_cmt;
+  MD_RTF_OUTB out;
+  MD_SIZE beg = 0;  /* start of text not yet written */
+  MD_SIZE i = 0;
+  MD_SIZE k;
+  MD_SIZE first;    /* first not blank character */
+  MD_RTF_CHAR ch;
+  unsigned tok;
+
+  out.r = r;
+  out.size = 0;
+
+  first = 0;
+  while(first < size && ISBLANK(text[first]))
+    first++;
+
+  /* comment or string continued from previous line, blank indentation given
+  apart from line is written as is */
+  if(r->code_hl != HL_STATE_CODE && first < size) {
+    tok = (r->code_hl == HL_STATE_CMT) ? HL_COMMENT : HL_STRING;
+    i = beg = hl_state_end(r, text, size, 0);
+    hl_token(&out, tok, text, i);
+  }
 
-static void
-render_enter_block_hr(MD_RTF* r)
-{
-  /* RTF does not allow (in simple way) to display an horizontal rule, on the
-  other hand, Rich Edit 4.1 (WordPad and WinAPI Rich Edit control) does not
-  properly handle paragraph borders and displays table borders in its own
-  specific way.
+  while(i < size) {
 
-  So, to display an horizontal rule equally on all viewer, we create a table
-  with the minimum size (font size defined to 0) with only the bottom border
-  visible. Other border are also visible but defined with the same color as
-  background, this way Rich Edit 4.1 don't display them in light gray. */
+    /* characters which cannot start a token */
+    while(i < size && HL_CC(text[i]) == 0)
+      i++;
 
-  render_verbatim(r, "\\pard\\f0\\fs0\\trowd\\trrh-1\\trftsWidth2\\trwWidth5000\\trautofit1" /* 61 bytes */
-                      "\\clbrdrt\\brdrs\\brdrw1\\brdrcf2" /* 29 bytes */
-                      "\\clbrdrb\\brdrs\\brdrw1\\brdrcf3"
-                      "\\clbrdrl\\brdrs\\brdrw1\\brdrcf2"
-                      "\\clbrdrr\\brdrs\\brdrw1\\brdrcf2", 177);
+    if(i == size)
+      break;
 
-  RENDER_VERBATIM(r, r->cw_cx[1]); // \cellxN
-  render_verbatim(r, "\\cell\\row", 9);
+    ch = text[i];
+    tok = HL_PLAIN;
+    k = i + 1;
+
+    if(HL_CC(ch) == HL_CC_IDENT) {
+      while(k < size && HL_CC(text[k]) & (HL_CC_IDENT|HL_CC_DIGIT))
+        k++;
+      if(hl_keyword(r, text + i, k - i))
+        tok = HL_KEYWORD;
+    } else if(HL_CC(ch) == HL_CC_DIGIT) {
+      while(k < size && (HL_CC(text[k]) & (HL_CC_IDENT|HL_CC_DIGIT) || text[k] == '.'))
+        k++;
+      tok = HL_NUMBER;
+    } else if(lc && ch == lc[0] && (lc[1] == 0 || (k < size && text[k] == lc[1])) &&
+              (!(lang->flags & HL_WORD_CMT) || i == 0 || ISBLANK(text[i-1]))) {
+      /* line comment */
+      tok = HL_COMMENT;
+      k = size;
+    } else if((lang->flags & HL_BLOCK_CMT) && ch == '/' && k < size && text[k] == '*') {
+      r->code_hl = HL_STATE_CMT;
+      tok = HL_COMMENT;
+      k = hl_state_end(r, text, size, i + 2);
+    } else if((lang->flags & HL_TRIPLE_STR) && (ch == '"' || ch == '\'') &&
+              i + 2 < size && text[i+1] == ch && text[i+2] == ch) {
+      r->code_hl = (ch == '"') ? HL_STATE_STR3D : HL_STATE_STR3S;
+      tok = HL_STRING;
+      k = hl_state_end(r, text, size, i + 3);
+    } else if(ch == '"' || (ch == '\'' && (lang->flags & HL_SQ_STR))) {
+      tok = HL_STRING;
+      k = hl_string_end(text, size, i);
+    } else if(ch == '#' && i == first && (lang->flags & HL_PREPROC)) {
+      /* preprocessor directive */
+      while(k < size && ISBLANK(text[k]))
+        k++;
+      while(k < size && HL_CC(text[k]) & (HL_CC_IDENT|HL_CC_DIGIT))
+        k++;
+      tok = HL_KEYWORD;
+    } else if(ch == '$' && (lang->flags & HL_VAR) && k < size) {
+      /* shell variable, as $name, ${name} or special one */
+      if(text[k] == '{') {
+        while(k < size && text[k] != '}')
+          k++;
+        if(k < size) k++;
+      } else if(HL_CC(text[k]) & (HL_CC_IDENT|HL_CC_DIGIT)) {
+        while(k < size && HL_CC(text[k]) & (HL_CC_IDENT|HL_CC_DIGIT))
+          k++;
+      } else if(!ISBLANK(text[k])) {
+        k++;
+      }
+      tok = HL_KEYWORD;
+    }
 
-  /* create proper space after paragraph */
-  render_end_block(r);
-}
+    if(tok != HL_PLAIN) {
+      outb_code(&out, text + beg, i - beg);
+      hl_token(&out, tok, text + i, k - i);
+      beg = k;
+    }
 
-static void
-render_enter_block_h(MD_RTF* r, const MD_BLOCK_H_DETAIL* h)
-{
-  RENDER_VERBATIM(r, r->cw_hf[h->level - 1]);
+    i = k;
+  }
+
+  outb_code(&out, text + beg, size - beg);
+  outb_flush(&out);
 }
 
 static void
-render_leave_block_h(MD_RTF* r, const MD_BLOCK_H_DETAIL* h)
+render_text_code(MD_RTF* r, const MD_RTF_CHAR* data, MD_SIZE size)
 {
-  if(h->level > 3) {
-    render_verbatim(r, "\\b0\\i0 \\par\r\n", 13);
+  /* due to how MD4C parser works, a last LF '\n' is always emitted as last
+  text block before leaving the code block which produce a visible empty line
+  at the end of block. To avoid this, we need to handle line feeds manually
+  inside the block code.
+
+  To do so, we skip each input '\n' then rather manually put a line feed at
+  start of the next text block. This way, the last received LF is never
+  rendered. */
+
+  /* if input data is LF we ignore it and simply count it to make a line
+  feed at start of the next text input */
+  if(data[0] == '\n' && size == 1) {
+    r->code_lf++;
+    return;
+  }
+
+  /* previous inputs were LF, we now render the line feeds */
+  if(r->code_lf) {
+    MD_RTF_OUTB out;
+    out.r = r;
+    out.size = 0;
+    for(; r->code_lf > 0; r->code_lf--)
+      outb_code_lf(&out);
+    outb_flush(&out);
+  }
+
+  /* render input text as normal text, or highlighted */
+  if(r->code_lang) {
+    render_code_hl(r, data, size);
   } else {
-    render_verbatim(r, "\\b0 \\par\r\n", 10);
+    render_rtf_escaped(r, data, size);
   }
 }
 
+/* Write the gathered source range of block code, then pending line feeds and
+indentation */
 static void
-render_enter_block_quote(MD_RTF* r)
+render_code_pending(MD_RTF* r)
 {
-  /* reset paragraph to normal font style */
-  render_verbatim(r, "\\pard\\f0", 8);
-  render_verbatim(r, r->cw_fs[0], 5);
+  if(r->code_end) {
+    #ifdef MD4C_USE_UTF16
+    render_wchar(r, r->code_beg, (MD_SIZE)(r->code_end - r->code_beg), render_code_escaped);
+    #else
+    render_code_escaped(r, r->code_beg, (MD_SIZE)(r->code_end - r->code_beg));
+    #endif
+    r->code_beg = NULL;
+    r->code_end = NULL;
+  }
 
-  /* start table row with proper parameters */
-  render_verbatim(r, "\\cf6\\i\\trowd", 12);
-  RENDER_VERBATIM(r, r->cw_tr[0]);
+  if(r->code_lf || r->code_ind) {
+    MD_RTF_OUTB out;
+    out.r = r;
+    out.size = 0;
 
-  /* quote is enclosed in a table with only the left border visible */
-  render_verbatim(r,  "\\clbrdrt\\brdrs\\brdrw1\\brdrcf2"   /* invisible border */
-                      "\\clbrdrb\\brdrs\\brdrw1\\brdrcf2"   /* invisible border */
-                      "\\clbrdrl\\brdrs\\brdrw70\\brdrcf3"
-                      "\\clbrdrr\\brdrs\\brdrw1\\brdrcf2", 117); /* invisible border */
+    for(; r->code_lf > 0; r->code_lf--)
+      outb_code_lf(&out);
 
-  /* cell width fixed to 90% of page width */
-  RENDER_VERBATIM(r, r->cw_cx[0]); /* \cellxN */
+    while(r->code_ind > 0) {
+      unsigned n = r->code_ind < 16 ? r->code_ind : 16;
+      outb_put(&out, g_code_spaces, n);
+      r->code_col += n;
+      r->code_ind -= n;
+    }
 
-  /* prevent space-after and line feed at end of paragraph */
-  r->quot_blck = 1;
+    outb_flush(&out);
+  }
 }
 
-static void
-render_leave_block_quote(MD_RTF* r)
+/* Whether the line text follows the gathered source range, that is, source
+in between is made of the pending line feeds and indentation */
+static int
+render_code_follows(MD_RTF* r, const MD_CHAR* text)
 {
-  render_verbatim(r, "\\intbl\\cell\\row\\i0\\cf1", 21);
+  const MD_CHAR* p = r->code_end;
+  unsigned n;
+
+  if(text < p || text >= r->src + r->src_size)
+    return 0;
+
+  for(n = 0; n < r->code_lf; n++) {
+    if(p < text && *p == '\r') {
+      p++;
+      if(p < text && *p == '\n')
+        p++;
+    } else if(p < text && *p == '\n') {
+      p++;
+    } else {
+      return 0;
+    }
+  }
 
-  /* create proper space after paragraph */
-  render_end_block(r);
+  if((MD_SIZE)(text - p) != r->code_ind)
+    return 0;
 
-  /* we can now treat paragraphs normally */
-  r->quot_blck = 0;
+  while(p < text && *p == ' ')
+    p++;
+
+  return p == text;
 }
 
+/* Block code text, given by parser as lines, indentation and line feeds.
+Lines which follow each other in source are gathered then written in one
+pass by render_code_pending(), as for render_text_code() the last line feed
+is never rendered. Syntax highlighted block code is written line by line
+through render_text_code(). */
 static void
-render_enter_block_code(MD_RTF* r)
+render_code_text(MD_RTF* r, const MD_CHAR* text, MD_SIZE size)
 {
-  /* reset paragraph to monospace font style */
-  render_verbatim(r, "\\pard\\f1", 8);
-  render_verbatim(r, r->cw_fs[1], 5);
-  /* add space before and space after to simulate padding*/
-  RENDER_VERBATIM(r, r->cw_sa[1]);
-  RENDER_VERBATIM(r, r->cw_sb[1]);
+  MD_SIZE i;
 
-  /* start table row with proper parameters */
-  render_verbatim(r, "\\trowd", 6);
-  RENDER_VERBATIM(r, r->cw_tr[0]);
+  if(size == 1 && text[0] == '\n') {
+    /* indentation of a blank line */
+    if(r->code_ind)
+      render_code_pending(r);
+    r->code_lf++;
+    return;
+  }
 
-  /* code is enclosed in gray block */
+  if(text >= r->src && text < r->src + r->src_size) {
 
-  render_verbatim(r,  "\\clbrdrt\\brdrs\\brdrw1\\brdrcf5"  /* invisible border */
-                      "\\clbrdrb\\brdrs\\brdrw1\\brdrcf5"  /* invisible border */
-                      "\\clbrdrl\\brdrs\\brdrw70\\brdrcf3"
-                      "\\clbrdrr\\brdrs\\brdrw1\\brdrcf2" /* invisible border */
-                      "\\clcbpat5", /*117*/ 126);
+    if(r->code_end && render_code_follows(r, text)) {
+      r->code_end = text + size;
+      r->code_lf = 0;
+      r->code_ind = 0;
+      return;
+    }
 
+    render_code_pending(r);
+    r->code_beg = text;
+    r->code_end = text + size;
+    return;
+  }
 
-  /* cell width fixed to 90% of page width */
-  RENDER_VERBATIM(r, r->cw_cx[0]); /* \cellxN */
-}
+  /* indentation is not within source, it is kept with the next line */
+  for(i = 0; i < size && text[i] == ' '; i++);
 
-static void
-render_leave_block_code(MD_RTF* r)
-{
-  render_verbatim(r, "\\cell\\row", 9);
+  if(i == size) {
+    r->code_ind += size;
+    return;
+  }
 
-  /* create proper space after paragraph */
-  render_end_block(r);
+  render_code_pending(r);
+  #ifdef MD4C_USE_UTF16
+  render_wchar(r, text, size, render_code_escaped);
+  #else
+  render_code_escaped(r, text, size);
+  #endif
 }
 
+
+/* Translate entity to its UTF-8 equivalent, or output the verbatim one
+ * if such entity is unknown (or if the translation is disabled). */
 static void
-render_enter_block_ul(MD_RTF* r, const MD_BLOCK_UL_DETAIL* ul)
+render_entity(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
 {
-  /* increment depth */
-  unsigned d = ++r->list_dpth;
+  if(r->flags & MD_RTF_FLAG_VERBATIM_ENTITIES) {
+    render_verbatim(r, text, size);
+    return;
+  }
 
-  #ifdef _DEBUG
-  printf_tabs(2, d);
-  printf("=> render_enter_block_ul\n");
-  #endif
+  /* We assume Unicode output is what is desired. */
+  if(size > 3 && text[1] == '#') {
 
-  /* nested list, we close the previous paragraph */
-  if(d > 0) render_verbatim(r, "\\par", 4);
+    unsigned u = 0;
 
-  /* do we need more than 8 levels of nested list ? */
-  if(d > 7) return;
+    if(text[2] == 'x' || text[2] == 'X') {
+      u = strtoul(text + 3, NULL, 16);
+    } else {
+      u = strtoul(text + 2, NULL, 10);
+    }
 
-  /* initialize list parameters */
-  r->list[d].type = MD_RTF_LIST_TYPE_UL;
-  /* current item count */
-  r->list[d].count = 0;
-  /* tight or lose list */
-  r->list[d].loose = !ul->is_tight;
-  /* bullet character */
-  r->list[d].cw_tx = g_cw_list_bullt[d % 2];
-  /* space-after \sbN to use */
-  r->list[d].cw_sb = ul->is_tight ? r->cw_sb[0] : r->cw_sb[1];
-  /* space-after \saN to use */
-  r->list[d].cw_sa = ul->is_tight ? r->cw_sa[0] : r->cw_sa[1];
-  /* left-indent \liN to use */
-  r->list[d].cw_li = r->cw_li[d];
+    render_unicode(r, u);
 
-  /* start new list paragraph */
-  render_list_start(r);
+    return;
+
+  } else {
+    #ifdef MD4C_ENTITY_H
+    /* Named entity (e.g. "&nbsp;"). */
+    const struct entity* ent;
+
+    ent = entity_lookup(text, size);
+    if(ent != NULL) {
+
+      /* we do not support > 4 bytes unicode for now */
+      if(!ent->codepoints[1])
+        render_unicode(r, ent->codepoints[0]);
+
+      return;
+    }
+    #endif
+  }
+
+  render_rtf_escaped(r, text, size);
 }
 
+
 static void
-render_leave_block_ul(MD_RTF* r)
+render_font_norm(MD_RTF* r)
 {
-  #ifdef _DEBUG
-  for(int i = 0; i < (r->list_dpth*2); ++i) putchar(' ');
-  printf("<= render_leave_block_ul\n");
-  #endif
-
-  if(r->list_dpth) {
-    /* nested list ended, we must setup block again */
-    r->list_rset = 1;
-  } else {
-    /* properly end the last item paragraph*/
-    render_verbatim(r, "\\par", 4);
-    /* all ended, create proper space after paragraph */
-    render_end_block(r);
-    /* properly reset parameters */
-    r->list_para = 0;
-    r->list_rset = 0;
-  }
+  /* change font style with the normal font (#0 : Calibri) */
 
-  /* decrement depth */
-  r->list_dpth--;
+  render_verbatim(r, "\\f0", 3);
+  render_verbatim(r, r->thm->cw_fs[0], 5);
 }
 
 static void
-render_enter_block_ol(MD_RTF* r, const MD_BLOCK_OL_DETAIL* ol)
+render_font_mono(MD_RTF* r)
 {
-  /* increment depth */
-  unsigned d = ++r->list_dpth;
+  /* change paragraph style to monospace font (#1 :. Courrier New )
+  with its dedicated size, little smaller than the normal */
 
-  #ifdef _DEBUG
-  printf_tabs(2, d);
-  printf("=> render_enter_block_ol\n");
-  #endif
+  render_verbatim(r, "\\f1", 3);
+  render_verbatim(r, r->thm->cw_fs[1], 5);
+}
 
-  /* nested list, we close the previous paragraph */
-  if(d > 0) render_verbatim(r, "\\par", 4);
+static inline void
+render_end_block(MD_RTF* r)
+{
+  /* this sequence is used to put standard paragraph space after a special
+  block such as list, quote or code, where space-after value is usually
+  changed or disabled. */
 
-  /* do we need more than 8 levels of nested list ? */
-  if(d > 7) return;
+  /* reset to normal font font but without space after */
+  render_verbatim(r, "\\pard\\f0", 8);
+  render_verbatim(r, r->thm->cw_fs[0], 5);
 
-  /* initialize list parameters */
-  r->list[d].type = MD_RTF_LIST_TYPE_OL;
-  /* current item count */
-  r->list[d].count = 0;
-  /* item start number */
-  r->list[d].start = ol->start;
-  /* tight or lose list */
-  r->list[d].loose = !ol->is_tight;
-  /* delimiter character */
-  r->list[d].cw_tx = (ol->mark_delimiter == ')')  ? g_cw_list_delim[1]
-                                                  : g_cw_list_delim[0];
-  /* space-after \sbN to use */
-  r->list[d].cw_sb = ol->is_tight ? r->cw_sb[0] : r->cw_sb[1];
-  /* space-after \saN to use */
-  r->list[d].cw_sa = ol->is_tight ? r->cw_sa[0] : r->cw_sa[1];
-  /* left-indent \liN to use */
-  r->list[d].cw_li = r->cw_li[d];
-
-  /* start new list paragraph */
-  render_list_start(r);
+  /* end paragraph, notice that CRLF is here
+  only for readability of source data */
+  render_verbatim(r, "\\sb0\\sa0\\par\r\n", 14);
 }
 
-static void
-render_leave_block_ol(MD_RTF* r)
+static inline void
+render_list_start(MD_RTF* r)
 {
+  MD_RTF_CHAR str_num[16];
+
+  unsigned d = r->list_dpth;
+
   #ifdef _DEBUG
-  printf_tabs(2, r->list_dpth);
-  printf("<= render_leave_block_ol\n");
+  printf_tabs(2, d);
+  printf("++ render_list_start (%u)\n", r->list[d].count);
   #endif
 
-  if(r->list_dpth) {
-    /* nested list ended, we must setup block again */
-    r->list_rset = 1;
-  } else {
-    /* properly end the last item paragraph*/
+  /* if this is a reset after nested list we end the last item paragraph */
+  if(r->list_rset)
     render_verbatim(r, "\\par", 4);
-    /* all ended, create proper space after paragraph */
-    render_end_block(r);
-    /* properly reset parameters */
-    r->list_para = 0;
-    r->list_rset = 0;
+
+  render_verbatim(r, "\\pard", 5); /* reset paragraph */
+  render_verbatim(r, r->thm->cw_fs[0], 5);  /* normal font size */
+
+  if(r->list[d].ls) {
+    /* numbering is defined in list table, paragraph only refers to it */
+    ultostr(r->list[d].ls, str_num, 10, 0);
+    render_verbatim(r, "\\ls", 3);
+    RENDER_VERBATIM(r, str_num);
+  } else if(r->list[d].type == MD_RTF_LIST_TYPE_OL) {  /* OL */
+    render_verbatim(r, "{\\pntext\\f0 ", 12);  /* normal font size */
+
+    /* we need to the start number added to item count because
+    this can be a list restart after the end of nested list */
+    ultostr(r->list[d].count + r->list[d].start, str_num, 10, 0);
+
+    RENDER_VERBATIM(r, str_num);
+    render_verbatim(r, r->list[d].cw_tx, 1); /* delimiter character */
+    render_verbatim(r, "\\tab}{\\*\\pn\\pnlvlbody\\pnf0\\pnstart", 34);
+    RENDER_VERBATIM(r, str_num);
+    render_verbatim(r, "\\pndec{\\pntxta", 14);
+    RENDER_VERBATIM(r, r->list[d].cw_tx); /* delimiter char */
+    render_verbatim(r, "}}", 2);
+  } else {                                      /* UL */
+    render_verbatim(r, "{\\pntext\\f0 ", 12);  /* normal font size */
+    render_verbatim(r, r->list[d].cw_tx, 7); /* bullet character */
+    render_verbatim(r, "\\tab}{\\*\\pn\\pnlvlblt\\pnf0{\\pntxtb", 33);
+    RENDER_VERBATIM(r, r->list[d].cw_tx); /* bullet char */
+    render_verbatim(r, "}}", 2);
   }
 
-  /* decrement depth */
-  r->list_dpth--;
+  RENDER_VERBATIM(r, r->list[d].cw_li); /* \liN */
+  RENDER_VERBATIM(r, r->list[d].cw_sb); /* \sbN */
+  RENDER_VERBATIM(r, r->list[d].cw_sa); /* \saN */
+
+  if(r->list[d].type == MD_RTF_LIST_TYPE_OL) {  /* OL */
+    RENDER_VERBATIM(r, r->thm->cw_fi[1]); /* \fiN */
+  } else {                                      /* UL */
+    RENDER_VERBATIM(r, r->thm->cw_fi[0]); /* \fiN */
+  }
+
+  r->list_rset = 0;
 }
 
-static void
-render_enter_block_li(MD_RTF* r, const MD_BLOCK_LI_DETAIL* li)
+static inline void
+render_list_item(MD_RTF* r)
 {
-  /* get depth */
+  MD_RTF_CHAR str_num[16];
+
   unsigned d = r->list_dpth;
 
   #ifdef _DEBUG
   printf_tabs(2, d);
-  printf("=> render_enter_block_li\n");
+  printf("++ render_list_item (%u)\n", r->list[d].start);
   #endif
 
-
-  /* reset paragraph counter */
-  r->list_para = 0;
-
-  /* if we just leave a nested list, we may need to start a new paragraph
-  with proper parameters */
-  if(r->list_rset) {
-    render_list_start(r);
+  /* new paragraph keeps list reference, numbering is automatic */
+  if(r->list[d].ls) {
+    render_verbatim(r, "\\par ", 5);
     return;
   }
 
-  /* if this is the fist item of list, proper data is already
-  written during pn block start */
-  if(r->list[d].count > 0)
-    render_list_item(r);
+  /* reset paragraph */
+  render_verbatim(r, "\\par{\\pntext\\f0 ", 16);
 
-  /* increment item count */
-  r->list[d].count++;
+  if(r->list[d].type == MD_RTF_LIST_TYPE_OL) { /* OL */
+    ultostr(r->list[d].count + r->list[d].start, str_num, 10, 0);
+    RENDER_VERBATIM(r, str_num);
+    render_verbatim(r, r->list[d].cw_tx, 1); /* delimiter char */
+  } else {
+    render_verbatim(r, r->list[d].cw_tx, 7); /* bullet char */
+  }
+
+  render_verbatim(r, "\\tab}", 5);
 }
 
-static void
-render_leave_block_li(MD_RTF* r)
+/* Make room in list stack for the given depth, which is at most one level
+deeper than the current stack. Returns -1 if memory allocation failed, in
+which case deeper levels cannot be allocated either. */
+static int
+render_list_grow(MD_RTF* r, unsigned d)
 {
-  #ifdef _DEBUG
-  printf_tabs(2, r->list_dpth);
-  printf("<= render_leave_block_li\n");
-  #endif
+  if(d < r->list_cap)
+    return 0;
 
-  /* Unlike HTML, RTF do not work with opened blocks which must be closed but
-  by ending a paragraph which automatically begins a new one, which produce
-  a line feed.
+  if(d > r->list_cap)
+    return -1;
 
-  considering this behavior, ending a paragraph each time a block is closed
-  would produce inconsistent line feeds. This is especially problematic with
-  nested lists where we can have cascading LI blocks closures.
+  unsigned cap = r->list_cap ? 2 * r->list_cap : 8;
 
-  To avoid this problem, we only end paragraph when entering a new item */
+  MD_RTF_LIST* list = (MD_RTF_LIST*)realloc(r->list, cap * sizeof(MD_RTF_LIST));
+  if(!list)
+    return -1;
+
+  r->list = list;
+  r->list_cap = cap;
+
+  return 0;
 }
 
+/* Write list table and list override table in document header. Lists are
+single level, nesting is done by paragraph indentation as for paragraph
+numbering, so there is no limit to levels count. */
 static void
-render_enter_block_table(MD_RTF* r, const MD_BLOCK_TABLE_DETAIL* tb)
+render_list_table(MD_RTF* r)
 {
-  /* we hold column count to calculate cell width */
-  r->tabl_cols = tb->col_count;
+  static const MD_RTF_CHAR* level[4] = {
+    "\\levelnfc23\\leveljc0\\levelfollow0\\levelstartat1"
+    "{\\leveltext\\'01\\u8226 ?;}{\\levelnumbers;}",
+    "\\levelnfc23\\leveljc0\\levelfollow0\\levelstartat1"
+    "{\\leveltext\\'01\\u9702 ?;}{\\levelnumbers;}",
+    "\\levelnfc0\\leveljc0\\levelfollow0\\levelstartat1"
+    "{\\leveltext\\'02\\'00.;}{\\levelnumbers\\'01;}",
+    "\\levelnfc0\\leveljc0\\levelfollow0\\levelstartat1"
+    "{\\leveltext\\'02\\'00);}{\\levelnumbers\\'01;}"};
+
+  const MD_RTF_LSOVR* ovr = (const MD_RTF_LSOVR*)r->list_ovr.data;
+  MD_RTF_CHAR str_num[16];
+  unsigned i;
 
-  /* start new table with smaller font and horizontal align to center */
-  render_verbatim(r, "\\pard\\f0", 8);
-  render_verbatim(r, r->cw_fs[1], 5);
+  RENDER_VERBATIM(r, "{\\*\\listtable");
+
+  for(i = 0; i < 4; ++i) {
+    if(r->list_used & (1 << i)) {
+      RENDER_VERBATIM(r, "{\\list\\listsimple1{\\listlevel");
+      RENDER_VERBATIM(r, level[i]);
+      RENDER_VERBATIM(r, "\\f0}\\listid");
+      RENDER_VERBATIM(r, ultostr(MD_RTF_LIST_ID_BULLT + i, str_num, 10, '}'));
+    }
+  }
+
+  RENDER_VERBATIM(r, "}{\\*\\listoverridetable");
+
+  /* bullet lists share the same override */
+  for(i = 0; i < 2; ++i) {
+    if(r->list_used & (1 << i)) {
+      ultostr(MD_RTF_LIST_ID_BULLT + i, str_num, 10, 0);
+      RENDER_VERBATIM(r, "{\\listoverride\\listid");
+      RENDER_VERBATIM(r, str_num);
+      RENDER_VERBATIM(r, "\\listoverridecount0\\ls");
+      RENDER_VERBATIM(r, str_num);
+      render_verbatim(r, "}", 1);
+    }
+  }
+
+  /* each ordered list restarts numbering with its own start number */
+  for(i = 0; i < r->list_nols; ++i) {
+    RENDER_VERBATIM(r, "{\\listoverride\\listid");
+    RENDER_VERBATIM(r, ultostr(ovr[i].id, str_num, 10, 0));
+    RENDER_VERBATIM(r, "\\listoverridecount1{\\lfolevel\\listoverridestartat\\levelstartat");
+    RENDER_VERBATIM(r, ultostr(ovr[i].start, str_num, 10, '}'));
+    render_verbatim(r, "\\ls", 3);
+    RENDER_VERBATIM(r, ultostr(MD_RTF_LIST_ID_BULLT + 2 + i, str_num, 10, '}'));
+  }
+
+  render_verbatim(r, "}", 1);
+
+  /* overrides are no longer needed */
+  buff_free(&r->list_ovr);
 }
 
-static inline void
-render_leave_block_table(MD_RTF* r)
+/* Fonts and colors used by blocks and spans, only the normal font (#0) is
+used by all documents */
+#define HEAD_FONT_ALL       0x07
+#define HEAD_FONT_MONO      (1 << 1)
+#define HEAD_COLR_ALL       0x7E
+#define HEAD_COLR_SYNTAX    0x780
+#define HEAD_COLR_HR        ((1 << 2)|(1 << 3))
+#define HEAD_COLR_QUOTE     ((1 << 1)|(1 << 2)|(1 << 3)|(1 << 6))
+#define HEAD_COLR_CODE      ((1 << 2)|(1 << 3)|(1 << 5))
+#define HEAD_COLR_TABLE     ((1 << 3)|(1 << 5))
+#define HEAD_COLR_URL       (1 << 4)
+
+static int
+scan_enter_block(MD_BLOCKTYPE type, void* detail, void* userdata)
 {
-  r->tabl_cols = 0;
+  MD_RTF* r = (MD_RTF*) userdata;
+  MD_RTF_LSOVR ovr;
 
-  /* all ended, create proper space after paragraph */
-  render_end_block(r);
+  switch(type) {
+    case MD_BLOCK_HR:     r->head_colr |= HEAD_COLR_HR; break;
+    case MD_BLOCK_QUOTE:  r->head_colr |= HEAD_COLR_QUOTE; break;
+    case MD_BLOCK_CODE:   r->head_colr |= HEAD_COLR_CODE;
+                          r->head_font |= HEAD_FONT_MONO;
+                          if((r->flags & MD_RTF_FLAG_HIGHLIGHT) &&
+                             hl_lang_find((const MD_BLOCK_CODE_DETAIL*)detail))
+                            r->head_colr |= HEAD_COLR_SYNTAX;
+                          break;
+    case MD_BLOCK_TABLE:  r->head_colr |= HEAD_COLR_TABLE; break;
+    default: break;
+  }
+
+  if(!(r->flags & MD_RTF_FLAG_LIST_TABLE))
+    return 0;
+
+  if(type == MD_BLOCK_UL) {
+    r->list_dpth++;
+    r->list_used |= 1 << (r->list_dpth % 2);
+  }
+
+  if(type == MD_BLOCK_OL) {
+    r->list_dpth++;
+    ovr.id = (((const MD_BLOCK_OL_DETAIL*)detail)->mark_delimiter == ')')
+              ? MD_RTF_LIST_ID_DELIM + 1 : MD_RTF_LIST_ID_DELIM;
+    ovr.start = ((const MD_BLOCK_OL_DETAIL*)detail)->start;
+    if(r->list_nols < MD_RTF_LIST_LS_MAX - 2) {
+      if(buff_append(&r->list_ovr, &ovr, sizeof(ovr)) != 0)
+        return -1;
+      r->list_used |= 1 << (ovr.id - MD_RTF_LIST_ID_BULLT);
+      r->list_nols++;
+    }
+  }
+
+  return 0;
 }
 
-static inline void
-render_enter_block_thead(MD_RTF* r)
+static int
+scan_leave_block(MD_BLOCKTYPE type, void* detail, void* userdata)
 {
-  /* simply set a flag to know we are in table head */
-  r->tabl_head = 1;
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  if(!(r->flags & MD_RTF_FLAG_LIST_TABLE))
+    return 0;
+
+  if(type == MD_BLOCK_UL || type == MD_BLOCK_OL)
+    r->list_dpth--;
+
+  return 0;
 }
 
-static inline void
-render_leave_block_thead(MD_RTF* r)
+static int
+scan_enter_span(MD_SPANTYPE type, void* detail, void* userdata)
 {
-  /* we are no longer in table head */
-  r->tabl_head = 0;
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  if(type == MD_SPAN_A)
+    r->head_colr |= HEAD_COLR_URL;
+
+  if(type == MD_SPAN_CODE)
+    r->head_font |= HEAD_FONT_MONO;
+
+  return 0;
 }
 
-static void
-render_enter_block_tr(MD_RTF* r)
+static int
+scan_leave_span(MD_SPANTYPE type, void* detail, void* userdata)
 {
-  MD_RTF_CHAR str_num[16];
+  return 0;
+}
 
-  /* create new raw with proper parameters */
-  render_verbatim(r, "\\trowd", 6);
-  RENDER_VERBATIM(r, r->cw_tr[1]);
+static int
+scan_text(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size, void* userdata)
+{
+  return 0;
+}
 
-  /* 9000 seem to be the average width of an RTF document */
-  float tw = 0.9f * r->page_width;
-  unsigned cw = tw / r->tabl_cols;
+/* Parse the whole document once to find lists and used fonts and colors
+before the document header is written, so the list table and the minimal
+fonts and colors tables can be written in header. If memory is missing lists
+are rendered with paragraph numbering and the full tables are written. */
+static void
+render_scan(MD_RTF* r, const MD_PARSER* parser, const MD_CHAR* text, MD_SIZE size)
+{
+  MD_PARSER scan = *parser;
+  unsigned head_font = r->head_font;
+  unsigned head_colr = r->head_colr;
+  int result;
+
+  scan.enter_block = scan_enter_block;
+  scan.leave_block = scan_leave_block;
+  scan.enter_span = scan_enter_span;
+  scan.leave_span = scan_leave_span;
+  scan.text = scan_text;
+
+  r->list_used = 0;
+  r->list_nols = 0;
+  r->list_next = 0;
+
+  if(r->flags & MD_RTF_FLAG_MINIMAL_HEADER) {
+    r->head_font = 1; /* normal font */
+    r->head_colr = 0;
+  }
 
-  /* we must first declare cells with their respecting properties */
-  for(unsigned i = 0; i < r->tabl_cols; ++i) {
+  result = md_parse(text, size, &scan, (void*)r);
 
-    render_verbatim(r,  "\\clvertalc" /* vertical-align center */
-                        "\\clbrdrt\\brdrs\\brdrw20\\brdrcf3" //< 30 bytes
-                        "\\clbrdrb\\brdrs\\brdrw20\\brdrcf3"
-                        "\\clbrdrl\\brdrs\\brdrw20\\brdrcf3"
-                        "\\clbrdrr\\brdrs\\brdrw20\\brdrcf3", 130);
+  r->list_tabl = (result == 0) && (r->flags & MD_RTF_FLAG_LIST_TABLE);
 
-    /* if we render a table head, we add a background to cells */
-    if(r->tabl_head) {
-      render_verbatim(r, "\\clcbpat5\\cellx", 15);
-      ultostr(cw * (i + 1), str_num, 10, 0);
-    } else {
-      render_verbatim(r, "\\cellx", 6);
-      ultostr(cw * (i + 1), str_num, 10, 0);
-    }
+  if(!r->list_tabl) {
+    buff_free(&r->list_ovr);
+    r->list_used = 0;
+    r->list_nols = 0;
+  }
 
-    RENDER_VERBATIM(r, str_num);
+  if(result != 0 || !(r->flags & MD_RTF_FLAG_MINIMAL_HEADER)) {
+    r->head_font = head_font;
+    r->head_colr = head_colr;
   }
-}
 
-static inline void
-render_leave_block_tr(MD_RTF* r)
-{
-  /* close the row */
-  render_verbatim(r, "\\row\r\n", 6);
+  r->list_dpth = -1;
 }
 
+/* Release list data, also used if render was aborted */
 static void
-render_enter_block_td(MD_RTF* r, const MD_BLOCK_TD_DETAIL* td)
+render_list_free(MD_RTF* r)
 {
-  switch(td->align) {
-    case MD_ALIGN_CENTER: render_verbatim(r, "\\qc ", 4); break;
-    case MD_ALIGN_RIGHT: render_verbatim(r, "\\qr ", 4); break;
-    default: render_verbatim(r, "\\ql ", 4); break;
-  }
+  buff_free(&r->list_ovr);
+  free(r->list);
+  r->list = NULL;
+  r->list_cap = 0;
 }
 
-static inline void
-render_leave_block_td(MD_RTF* r)
+static void
+render_toc_free(MD_RTF* r)
 {
-  render_verbatim(r, "\\intbl\\cell ", 12);
+  buff_free(&r->toc);
+  buff_free(&r->toc_body);
+  r->toc_hold = 0;
 }
 
 static void
-render_enter_block_th(MD_RTF* r, const MD_BLOCK_TD_DETAIL* td)
+render_enter_block_doc(MD_RTF* r)
 {
-  /* same as td but with bold text */
-  switch(td->align) {
-    case MD_ALIGN_CENTER: render_verbatim(r, "\\qc\\b ", 6); break;
-    case MD_ALIGN_RIGHT: render_verbatim(r, "\\qr\\b ", 6); break;
-    default: render_verbatim(r, "\\ql\\b ", 6); break;
+  const MD_RTF_THEME* t = r->thm;
+  unsigned i;
+
+  if(r->head_font == HEAD_FONT_ALL && r->head_colr == HEAD_COLR_ALL) {
+
+    /* prebuilt fonts and colors tables */
+    render_verbatim(r, t->head, t->head_list);
+
+  } else if(r->head_font == HEAD_FONT_ALL &&
+            r->head_colr == (HEAD_COLR_ALL|HEAD_COLR_SYNTAX)) {
+
+    /* prebuilt fonts and colors tables, with syntax colors */
+    render_verbatim(r, t->head_syn, t->head_syn_size);
+
+  } else {
+
+    RENDER_VERBATIM(r,  "{\\rtf1\\ansi\\ansicpg1252\\deff0");
+
+    /* font table, unused fonts are omitted */
+    RENDER_VERBATIM(r, "{\\fonttbl");
+    for(i = 0; i < 3; ++i) {
+      if(r->head_font & (1 << i))
+        RENDER_VERBATIM(r, t->head_font[i]);
+    }
+    render_verbatim(r, "}", 1);
+
+    /* color table, unused colors below the last used one are left empty so
+    indices are kept */
+    if(r->head_colr) {
+      RENDER_VERBATIM(r, "{\\colortbl;");
+      for(i = 1; (r->head_colr >> i) != 0; ++i)
+        RENDER_VERBATIM(r, t->head_colr[(r->head_colr & (1 << i)) ? i : 0]);
+      render_verbatim(r, "}", 1);
+    }
+  }
+
+  /* list table, if lists are numbered through it */
+  if(r->list_tabl)
+    render_list_table(r);
+
+  /* prebuilt document parameters and initialization */
+  render_verbatim(r, t->head + t->head_list, t->head_size - t->head_list);
+
+  /* body is held until table of contents is complete */
+  if(r->flags & MD_RTF_FLAG_TOC) {
+    r->toc_hold = 1;
+    r->toc_beg = r->out_size;
   }
 }
 
-static inline void
-render_leave_block_th(MD_RTF* r)
+static void
+render_leave_block_doc(MD_RTF* r)
 {
-  render_verbatim(r, "\\b0\\intbl\\cell ", 15);
+  if(r->toc_hold)
+    render_toc_release(r);
+
+  render_verbatim(r, "}\0", 2);
 }
 
-static inline void
-render_enter_block_p(MD_RTF* r)
+/* Paragraph properties of quote with paragraph borders, written again for each
+paragraph since other blocks within quote reset them */
+static void
+render_quote_para(MD_RTF* r)
 {
-  #ifdef _DEBUG
-  printf_tabs(2, r->list_dpth);
-  printf("=> render_enter_block_p\n");
-  #endif
+  unsigned d = r->quot_dpth;
 
-  /* special case if we are inside a list item */
-  if(r->list_dpth >= 0) {
+  render_verbatim(r, "\\pard\\cf6\\i", 11);
+  RENDER_VERBATIM(r, r->thm->cw_li[d < 8 ? d - 1 : 7]);
+  RENDER_VERBATIM(r, r->thm->cw_pb[0]);
+  render_verbatim(r, "\\sb0", 4);
+  RENDER_VERBATIM(r, r->thm->cw_sa[1]);
+}
 
-    /* if we have more than one paragraph inside list item we add line feed
-    at paragraph start */
-    if(r->list_para) {
-      render_verbatim(r, "\\line1\r\n", 8);
+static void
+render_enter_block_hr(MD_RTF* r)
+{
+  /* RTF does not allow (in simple way) to display an horizontal rule, on the
+  other hand, Rich Edit 4.1 (WordPad and WinAPI Rich Edit control) does not
+  properly handle paragraph borders and displays table borders in its own
+  specific way.
+
+  So, to display an horizontal rule equally on all viewer, we create a table
+  with the minimum size (font size defined to 0) with only the bottom border
+  visible. Other border are also visible but defined with the same color as
+  background, this way Rich Edit 4.1 don't display them in light gray. */
+
+  if(r->flags & MD_RTF_FLAG_PARA_BORDERS) {
+    /* empty paragraph with only the bottom border */
+    render_verbatim(r, "\\pard\\f0\\fs0\\brdrb\\brdrs\\brdrw1\\brdrcf3\\par", 43);
+    render_end_block(r);
+    return;
+  }
+
+  render_verbatim(r, "\\pard\\f0\\fs0\\trowd\\trrh-1\\trftsWidth2\\trwWidth5000\\trautofit1" /* 61 bytes */
+                      "\\clbrdrt\\brdrs\\brdrw1\\brdrcf2" /* 29 bytes */
+                      "\\clbrdrb\\brdrs\\brdrw1\\brdrcf3"
+                      "\\clbrdrl\\brdrs\\brdrw1\\brdrcf2"
+                      "\\clbrdrr\\brdrs\\brdrw1\\brdrcf2", 177);
+
+  RENDER_VERBATIM(r, r->thm->cw_cx[1]); // \cellxN
+  render_verbatim(r, "\\cell\\row", 9);
+
+  /* create proper space after paragraph */
+  render_end_block(r);
+}
+
+/* Table of contents. Each heading is enclosed in a bookmark and an entry with
+a link to it is added to contents, which is written between header and body
+once the whole body is rendered: only one parse is needed, at the cost of
+holding body output in memory. */
+static void
+render_toc_append(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
+{
+  if(!r->toc_fail && buff_append(&r->toc, text, size) != 0)
+    r->toc_fail = 1;
+}
+
+static void
+render_toc_enter(MD_RTF* r, unsigned level)
+{
+  MD_RTF_CHAR bk[80];
+
+  sprintf(bk, "{\\*\\bkmkstart _toc%u}", ++r->toc_count);
+  RENDER_VERBATIM(r, bk);
+
+  if(!r->toc_hold)
+    return;
+
+  /* first entry sets the normal font */
+  if(r->toc.size == 0) {
+    render_toc_append(r, "\\f0", 3);
+    render_toc_append(r, r->thm->cw_fs[0], 5);
+  }
+
+  /* entries indented by heading level */
+  render_toc_append(r, "\\pard", 5);
+  if(level > 1)
+    render_toc_append(r, r->thm->cw_li[level - 2], (MD_SIZE)strlen(r->thm->cw_li[level - 2]));
+
+  sprintf(bk, "\\sb0\\sa0 {\\field{\\*\\fldinst HYPERLINK \\\\l \"_toc%u\"}{\\fldrslt ", r->toc_count);
+  render_toc_append(r, bk, (MD_SIZE)strlen(bk));
+
+  r->toc_head = 1;
+}
+
+static void
+render_toc_leave(MD_RTF* r)
+{
+  MD_RTF_CHAR bk[32];
+
+  sprintf(bk, "{\\*\\bkmkend _toc%u}", r->toc_count);
+  RENDER_VERBATIM(r, bk);
+
+  if(r->toc_head) {
+    render_toc_append(r, "}}\\par\r\n", 8);
+    r->toc_head = 0;
+  }
+}
+
+/* Copy heading text to contents entry, without formatting */
+static void
+render_toc_text(MD_RTF* r, MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size)
+{
+  r->toc_text = 1;
+
+  switch(type) {
+    case MD_TEXT_NULLCHAR:  break;
+    case MD_TEXT_BR:
+    case MD_TEXT_SOFTBR:    render_verbatim(r, " ", 1); break;
+    #ifdef MD4C_USE_UTF16
+    case MD_TEXT_ENTITY:    render_wchar(r, text, size, render_entity); break;
+    default:                render_wchar(r, text, size, render_rtf_escaped); break;
+    #else
+    case MD_TEXT_ENTITY:    render_entity(r, text, size); break;
+    default:                render_rtf_escaped(r, text, size); break;
+    #endif
+  }
+
+  r->toc_text = 0;
+}
+
+/* Write contents then held body */
+static void
+render_toc_release(MD_RTF* r)
+{
+  static const MD_RTF_CHAR tail[] = "\\pard\\sb0\\sa0\\par\r\n";
+  MD_SIZE n = r->toc.size + sizeof(tail) - 1;
+  unsigned i;
+
+  r->toc_hold = 0;
+
+  if(r->toc.size && !r->toc_fail) {
+    if(r->lim_out && r->out_size + n > r->lim_out) {
+      render_stop(r, MD_RTF_ERROR_OUTPUT_LIMIT);
     } else {
-      /* enabled line feed for the next paragraph */
-      r->list_para = 1;
+      r->out_size += n;
+      r->toc_size = n;
+      render_output(r, (const MD_RTF_CHAR*)r->toc.data, r->toc.size);
+      render_output(r, tail, sizeof(tail) - 1);
+      /* body entries of offset map are moved after contents */
+      if(r->omap) {
+        for(i = 0; i < r->omap->count; ++i) {
+          if(r->omap->entries[i].rtf_off >= r->toc_beg)
+            r->omap->entries[i].rtf_off += n;
+        }
+      }
     }
+  }
 
-    /* we do not need further parameters */
+  render_output(r, (const MD_RTF_CHAR*)r->toc_body.data, r->toc_body.size);
+
+  buff_free(&r->toc);
+  buff_free(&r->toc_body);
+}
+
+static void
+render_enter_block_h(MD_RTF* r, const MD_BLOCK_H_DETAIL* h)
+{
+  if(r->quot_dpth)
+    render_quote_para(r);
+
+  RENDER_VERBATIM(r, r->thm->cw_hf[h->level - 1]);
+
+  if(r->flags & MD_RTF_FLAG_TOC)
+    render_toc_enter(r, h->level);
+}
+
+static void
+render_leave_block_h(MD_RTF* r, const MD_BLOCK_H_DETAIL* h)
+{
+  if(r->flags & MD_RTF_FLAG_TOC)
+    render_toc_leave(r);
+
+  if(h->level > 3) {
+    render_verbatim(r, "\\b0\\i0 \\par\r\n", 13);
+  } else {
+    render_verbatim(r, "\\b0 \\par\r\n", 10);
+  }
+}
+
+static void
+render_enter_block_quote(MD_RTF* r)
+{
+  /* nested quotes are flattened, each one more indented, paragraphs and
+  headings within set the quote properties */
+  if(r->flags & MD_RTF_FLAG_PARA_BORDERS) {
+    r->quot_dpth++;
     return;
   }
 
-  /* use normal font */
-  render_font_norm(r);
+  /* reset paragraph to normal font style */
+  render_verbatim(r, "\\pard\\f0", 8);
+  render_verbatim(r, r->thm->cw_fs[0], 5);
 
-  /* default space after and before */
-  render_verbatim(r, "\\sb0\\sa0 ", 9);
+  /* start table row with proper parameters */
+  render_verbatim(r, "\\cf6\\i\\trowd", 12);
+  RENDER_VERBATIM(r, r->thm->cw_tr[0]);
+
+  /* quote is enclosed in a table with only the left border visible */
+  render_verbatim(r,  "\\clbrdrt\\brdrs\\brdrw1\\brdrcf2"   /* invisible border */
+                      "\\clbrdrb\\brdrs\\brdrw1\\brdrcf2"   /* invisible border */
+                      "\\clbrdrl\\brdrs\\brdrw70\\brdrcf3"
+                      "\\clbrdrr\\brdrs\\brdrw1\\brdrcf2", 117); /* invisible border */
+
+  /* cell width fixed to 90% of page width */
+  RENDER_VERBATIM(r, r->thm->cw_cx[0]); /* \cellxN */
+
+  /* prevent space-after and line feed at end of paragraph */
+  r->quot_blck = 1;
 }
 
-static inline void
-render_leave_block_p(MD_RTF* r)
+static void
+render_leave_block_quote(MD_RTF* r)
 {
-  #ifdef _DEBUG
-  printf_tabs(2, r->list_dpth);
-  printf("<= render_leave_block_p\n");
-  #endif
+  if(r->flags & MD_RTF_FLAG_PARA_BORDERS) {
+    /* paragraphs of parent quote set their own properties */
+    if(--r->quot_dpth > 0)
+      return;
+    render_verbatim(r, "\\i0\\cf1", 7);
+    render_end_block(r);
+    return;
+  }
 
-  /* special case if within block quote or item list we ignore paragraph end */
-  if(r->quot_blck || (r->list_dpth >= 0))
+  render_verbatim(r, "\\intbl\\cell\\row\\i0\\cf1", 21);
+
+  /* create proper space after paragraph */
+  render_end_block(r);
+
+  /* we can now treat paragraphs normally */
+  r->quot_blck = 0;
+}
+
+static void
+render_enter_block_code(MD_RTF* r, const MD_BLOCK_CODE_DETAIL* code)
+{
+  r->code_lang = (r->flags & MD_RTF_FLAG_HIGHLIGHT) ? hl_lang_find(code) : NULL;
+  r->code_hl = HL_STATE_CODE;
+  if(r->code_lang)
+    hl_keyword_hash(r, r->code_lang);
+  r->code_blck = 1;
+  r->code_col = 0;
+  r->code_line = 0;
+
+  /* reset paragraph to monospace font style */
+  render_verbatim(r, "\\pard\\f1", 8);
+  render_verbatim(r, r->thm->cw_fs[1], 5);
+
+  /* shaded paragraph, padding is the borders spacing */
+  if(r->flags & MD_RTF_FLAG_PARA_BORDERS) {
+    if(r->quot_dpth)
+      RENDER_VERBATIM(r, r->thm->cw_li[r->quot_dpth < 8 ? r->quot_dpth - 1 : 7]);
+    RENDER_VERBATIM(r, r->thm->cw_ri);
+    RENDER_VERBATIM(r, r->thm->cw_pb[1]);
+    render_verbatim(r, "\\sb0\\sa0 ", 9);
     return;
+  }
 
-  /* standard end of paragraph */
-  render_verbatim(r, "\\line1\\par\r\n", 12);
+  /* add space before and space after to simulate padding*/
+  RENDER_VERBATIM(r, r->thm->cw_sa[1]);
+  RENDER_VERBATIM(r, r->thm->cw_sb[1]);
+
+  /* start table row with proper parameters */
+  render_verbatim(r, "\\trowd", 6);
+  RENDER_VERBATIM(r, r->thm->cw_tr[0]);
+
+  /* code is enclosed in gray block */
+  render_verbatim(r, g_cw_code_cell, sizeof(g_cw_code_cell) - 1);
+
+  /* cell width fixed to 90% of page width */
+  RENDER_VERBATIM(r, r->thm->cw_cx[0]); /* \cellxN */
 }
 
 static void
-render_enter_span_url(MD_RTF* r, const MD_SPAN_A_DETAIL* a)
+render_leave_block_code(MD_RTF* r)
 {
-  render_verbatim(r, "\\cf4\\ul {\\field{\\*\\fldinst HYPERLINK \"", 38);
-  #ifdef MD4C_USE_UTF16
-  render_wchar(r, a->href.text, a->href.size, render_url_escaped);
-  #else
-  render_url_escaped(r, a->href.text, a->href.size);
-  #endif
-  render_verbatim(r, "\"}{\\fldrslt ", 12);
+  /* the last line feed is never rendered, it must not remain pending */
+  r->code_lf = 0;
+  r->code_ind = 0;
+  render_code_pending(r);
+
+  if(r->flags & MD_RTF_FLAG_PARA_BORDERS) {
+    render_verbatim(r, "\\par", 4);
+  } else {
+    render_verbatim(r, "\\cell\\row", 9);
+  }
+
+  r->code_blck = 0;
+  r->code_lang = NULL;
+
+  /* create proper space after paragraph */
+  render_end_block(r);
+
+  render_flush_hint(r);
 }
 
-static inline void
-render_leave_span_url(MD_RTF* r)
+static void
+render_enter_block_ul(MD_RTF* r, const MD_BLOCK_UL_DETAIL* ul)
 {
-  render_verbatim(r, "}}\\ul0 \\cf0 ", 12);
+  /* increment depth */
+  unsigned d = ++r->list_dpth;
+
+  #ifdef _DEBUG
+  printf_tabs(2, d);
+  printf("=> render_enter_block_ul\n");
+  #endif
+
+  /* nested list, we close the previous paragraph */
+  if(d > 0) render_verbatim(r, "\\par", 4);
+
+  /* out of memory, this level is rendered as part of the parent item */
+  if(render_list_grow(r, d) != 0) return;
+
+  /* initialize list parameters */
+  r->list[d].type = MD_RTF_LIST_TYPE_UL;
+  /* current item count */
+  r->list[d].count = 0;
+  /* tight or lose list */
+  r->list[d].loose = !ul->is_tight;
+  /* bullet character */
+  r->list[d].cw_tx = g_cw_list_bullt[d % 2];
+  /* space-after \sbN to use */
+  r->list[d].cw_sb = ul->is_tight ? r->thm->cw_sb[0] : r->thm->cw_sb[1];
+  /* space-after \saN to use */
+  r->list[d].cw_sa = ul->is_tight ? r->thm->cw_sa[0] : r->thm->cw_sa[1];
+  /* left-indent \liN to use, deeper levels keep the last indentation */
+  r->list[d].cw_li = r->thm->cw_li[d < 8 ? d : 7];
+  /* bullet list override of list table */
+  r->list[d].ls = r->list_tabl ? MD_RTF_LIST_ID_BULLT + (d % 2) : 0;
+
+  /* start new list paragraph */
+  render_list_start(r);
 }
 
-static inline void
-render_enter_span_code(MD_RTF* r)
+static void
+render_leave_block_ul(MD_RTF* r)
 {
-  render_font_mono(r);
+  #ifdef _DEBUG
+  for(int i = 0; i < (r->list_dpth*2); ++i) putchar(' ');
+  printf("<= render_leave_block_ul\n");
+  #endif
+
+  if(r->list_dpth) {
+    /* nested list ended, we must setup block again */
+    r->list_rset = 1;
+  } else {
+    /* properly end the last item paragraph*/
+    render_verbatim(r, "\\par", 4);
+    /* all ended, create proper space after paragraph */
+    render_end_block(r);
+    /* properly reset parameters */
+    r->list_para = 0;
+    r->list_rset = 0;
+  }
+
+  /* decrement depth */
+  r->list_dpth--;
 }
 
+static void
+render_enter_block_ol(MD_RTF* r, const MD_BLOCK_OL_DETAIL* ol)
+{
+  /* increment depth */
+  unsigned d = ++r->list_dpth;
+
+  /* ordered lists are counted in the same order they were found by pre-scan,
+  each one has its own override of list table */
+  unsigned n = r->list_next++;
+
+  #ifdef _DEBUG
+  printf_tabs(2, d);
+  printf("=> render_enter_block_ol\n");
+  #endif
+
+  /* nested list, we close the previous paragraph */
+  if(d > 0) render_verbatim(r, "\\par", 4);
+
+  /* out of memory, this level is rendered as part of the parent item */
+  if(render_list_grow(r, d) != 0) return;
+
+  /* initialize list parameters */
+  r->list[d].type = MD_RTF_LIST_TYPE_OL;
+  /* current item count */
+  r->list[d].count = 0;
+  /* item start number */
+  r->list[d].start = ol->start;
+  /* tight or lose list */
+  r->list[d].loose = !ol->is_tight;
+  /* delimiter character */
+  r->list[d].cw_tx = (ol->mark_delimiter == ')')  ? g_cw_list_delim[1]
+                                                  : g_cw_list_delim[0];
+  /* space-after \sbN to use */
+  r->list[d].cw_sb = ol->is_tight ? r->thm->cw_sb[0] : r->thm->cw_sb[1];
+  /* space-after \saN to use */
+  r->list[d].cw_sa = ol->is_tight ? r->thm->cw_sa[0] : r->thm->cw_sa[1];
+  /* left-indent \liN to use, deeper levels keep the last indentation */
+  r->list[d].cw_li = r->thm->cw_li[d < 8 ? d : 7];
+  /* ordered list override of list table */
+  r->list[d].ls = (r->list_tabl && n < r->list_nols) ? MD_RTF_LIST_ID_BULLT + 2 + n : 0;
+
+  /* start new list paragraph */
+  render_list_start(r);
+}
+
+static void
+render_leave_block_ol(MD_RTF* r)
+{
+  #ifdef _DEBUG
+  printf_tabs(2, r->list_dpth);
+  printf("<= render_leave_block_ol\n");
+  #endif
+
+  if(r->list_dpth) {
+    /* nested list ended, we must setup block again */
+    r->list_rset = 1;
+  } else {
+    /* properly end the last item paragraph*/
+    render_verbatim(r, "\\par", 4);
+    /* all ended, create proper space after paragraph */
+    render_end_block(r);
+    /* properly reset parameters */
+    r->list_para = 0;
+    r->list_rset = 0;
+  }
+
+  /* decrement depth */
+  r->list_dpth--;
+}
+
+static void
+render_enter_block_li(MD_RTF* r, const MD_BLOCK_LI_DETAIL* li)
+{
+  /* get depth */
+  unsigned d = r->list_dpth;
+
+  #ifdef _DEBUG
+  printf_tabs(2, d);
+  printf("=> render_enter_block_li\n");
+  #endif
+
+
+  /* reset paragraph counter */
+  r->list_para = 0;
+
+  /* level not allocated, see render_list_grow() */
+  if(d >= r->list_cap)
+    return;
+
+  /* if we just leave a nested list, we may need to start a new paragraph
+  with proper parameters */
+  if(r->list_rset) {
+    render_list_start(r);
+    return;
+  }
+
+  /* if this is the fist item of list, proper data is already
+  written during pn block start */
+  if(r->list[d].count > 0)
+    render_list_item(r);
+
+  /* increment item count */
+  r->list[d].count++;
+}
+
+static void
+render_leave_block_li(MD_RTF* r)
+{
+  #ifdef _DEBUG
+  printf_tabs(2, r->list_dpth);
+  printf("<= render_leave_block_li\n");
+  #endif
+
+  /* Unlike HTML, RTF do not work with opened blocks which must be closed but
+  by ending a paragraph which automatically begins a new one, which produce
+  a line feed.
+
+  considering this behavior, ending a paragraph each time a block is closed
+  would produce inconsistent line feeds. This is especially problematic with
+  nested lists where we can have cascading LI blocks closures.
+
+  To avoid this problem, we only end paragraph when entering a new item */
+}
+
+/* Calibri characters advance width (1/1000 em) from space to tilde, used to
+measure table cells text, Consolas is monospace with 550 for all */
+static const unsigned short g_calibri_width[95] = {
+  226, 326, 401, 498, 507, 715, 682, 221, 303, 303, 498, 498, 250, 306, 252, 386,
+  507, 507, 507, 507, 507, 507, 507, 507, 507, 507, 268, 268, 498, 498, 498, 463,
+  894, 579, 544, 533, 615, 488, 459, 631, 623, 252, 319, 520, 420, 855, 646, 662,
+  517, 673, 543, 459, 487, 642, 567, 890, 519, 487, 468, 307, 386, 307, 498, 498,
+  291, 479, 525, 423, 525, 498, 305, 471, 525, 230, 239, 455, 230, 799, 525, 527,
+  525, 525, 349, 391, 335, 525, 452, 715, 433, 453, 395, 314, 460, 314, 498};
+
+#define MD_RTF_MONO_WIDTH   550
+#define MD_RTF_WIDE_WIDTH   600   /* non-ASCII, unknown glyph */
+#define MD_RTF_MEAS_MAX     100000000ul
+
+static void
+render_table_measure(MD_RTF* r, MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size)
+{
+  for(MD_SIZE i = 0; i < size; ++i) {
+
+    unsigned ch = (sizeof(MD_CHAR) == 1) ? (unsigned char)text[i] : (unsigned)text[i];
+    unsigned w;
+
+    if(ch == ' ' || ch == '\t' || ch == '\n' || type == MD_TEXT_BR || type == MD_TEXT_SOFTBR) {
+      /* word end */
+      if(r->tabl_word > r->tabl_long)
+        r->tabl_long = r->tabl_word;
+      r->tabl_word = 0;
+      r->tabl_text += g_calibri_width[0];
+      continue;
+    }
+
+    /* UTF-8 continuation bytes have no width */
+    if(sizeof(MD_CHAR) == 1 && (ch & 0xC0) == 0x80)
+      continue;
+
+    if(type == MD_TEXT_CODE) {
+      w = MD_RTF_MONO_WIDTH;
+    } else if(ch > 0x20 && ch < 0x7F) {
+      w = g_calibri_width[ch - 0x20];
+    } else {
+      w = MD_RTF_WIDE_WIDTH;
+    }
+
+    /* entity is rendered as a single character */
+    if(type == MD_TEXT_ENTITY)
+      i = size;
+
+    r->tabl_word += w;
+    r->tabl_text += w;
+  }
+
+  if(r->tabl_text > MD_RTF_MEAS_MAX) r->tabl_text = MD_RTF_MEAS_MAX;
+  if(r->tabl_word > MD_RTF_MEAS_MAX) r->tabl_word = MD_RTF_MEAS_MAX;
+}
+
+/* Store measured widths of the cell which ends */
+static void
+render_table_cell_end(MD_RTF* r)
+{
+  unsigned c = r->tabl_cell++;
+
+  if(!r->tabl_meas)
+    return;
+
+  r->tabl_meas = 0;
+
+  if(r->tabl_word > r->tabl_long)
+    r->tabl_long = r->tabl_word;
+
+  /* head cells are bold, slightly wider */
+  if(r->tabl_head) {
+    r->tabl_text += r->tabl_text / 16;
+    r->tabl_long += r->tabl_long / 16;
+  }
+
+  if(c < r->tabl_cols) {
+    if(r->tabl_text > r->tabl_wmax[c]) r->tabl_wmax[c] = r->tabl_text;
+    if(r->tabl_long > r->tabl_wmin[c]) r->tabl_wmin[c] = r->tabl_long;
+  }
+}
+
+/* Compute columns widths (twip) from measured widths (1/1000 em), as usual
+automatic table layout: each column gets at least its longest word, the
+remaining space is shared according the columns text widths. */
+static void
+render_table_layout(MD_RTF* r, unsigned* width)
+{
+  typedef unsigned long long ULL;
+
+  unsigned n = r->tabl_cols;
+  unsigned fs = (unsigned)(0.9f*r->thm->font_base);  /* half-points */
+  ULL tw = (ULL)(0.9f * r->thm->page_width);
+  ULL pad = 6*r->thm->font_base + 5*fs;  /* \trgaph on both sides + half em */
+  ULL smin = 0, smax = 0;
+  ULL wmin, wmax;
+  unsigned i;
+
+  for(i = 0; i < n; ++i) {
+    /* (1/1000 em) * (half-point * 10 twip) */
+    smin += (ULL)r->tabl_wmin[i] * fs / 100 + pad;
+    smax += (ULL)r->tabl_wmax[i] * fs / 100 + pad;
+  }
+
+  for(i = 0; i < n; ++i) {
+
+    wmin = (ULL)r->tabl_wmin[i] * fs / 100 + pad;
+    wmax = (ULL)r->tabl_wmax[i] * fs / 100 + pad;
+
+    if(smax <= tw) {
+      /* everything fit, extra space is shared according text width (or
+      equally if nothing was measured, as empty cells with null font size) */
+      width[i] = smax ? (unsigned)(wmax + (tw - smax) * wmax / smax)
+                      : (unsigned)(tw / n);
+    } else if(smin >= tw) {
+      /* even words do not fit, shrink according words width */
+      width[i] = smin ? (unsigned)(tw * wmin / smin) : (unsigned)(tw / n);
+    } else {
+      /* words fit, remaining space is shared according text overflow */
+      width[i] = (unsigned)(wmin + (tw - smin) * (wmax - wmin) / (smax - smin));
+    }
+
+    if(width[i] == 0)
+      width[i] = 1;
+  }
+}
+
+/* Build row prefixes for body and head rows from columns widths */
+static int
+render_table_prefix(MD_RTF* r, const unsigned* width)
+{
+  MD_RTF_CHAR str_cw[96];
+  unsigned long x = 0;
+  unsigned long tw = 0;
+  unsigned h, i;
+
+  for(i = 0; i < r->tabl_cols; ++i)
+    tw += width[i];
+
+  for(h = 0; h < 2; ++h) {
+
+    MD_RTF_BUFF* b = &r->tabl_pfx[h];
+
+    /* fixed table width, without viewer auto-fit */
+    sprintf(str_cw, "\\trowd\\trgaph%u\\trrh%u\\trftsWidth3\\trwWidth%lu ",
+            3*r->thm->font_base, 16*r->thm->font_base, tw);
+    if(buff_append(b, str_cw, (MD_SIZE)strlen(str_cw)) != 0)
+      return -1;
+
+    x = 0;
+    for(i = 0; i < r->tabl_cols; ++i) {
+
+      x += width[i];
+
+      if(buff_append(b,   "\\clvertalc" /* vertical-align center */
+                          "\\clbrdrt\\brdrs\\brdrw20\\brdrcf3" //< 30 bytes
+                          "\\clbrdrb\\brdrs\\brdrw20\\brdrcf3"
+                          "\\clbrdrl\\brdrs\\brdrw20\\brdrcf3"
+                          "\\clbrdrr\\brdrs\\brdrw20\\brdrcf3", 130) != 0)
+        return -1;
+
+      /* head cells have background */
+      sprintf(str_cw, "\\clftsWidth3\\clwWidth%u%s\\cellx%lu",
+              width[i], h ? "\\clcbpat5" : "", x);
+      if(buff_append(b, str_cw, (MD_SIZE)strlen(str_cw)) != 0)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Build row prefixes for body and head rows with columns of equal width, so
+each row prefix is written at once */
+static int
+render_table_prefix_equal(MD_RTF* r)
+{
+  MD_RTF_CHAR str_num[16];
+  unsigned h, i;
+
+  /* 9000 seem to be the average width of an RTF document */
+  float tw = 0.9f * r->thm->page_width;
+  unsigned cw = tw / r->tabl_cols;
+
+  for(h = 0; h < 2; ++h) {
+
+    MD_RTF_BUFF* b = &r->tabl_pfx[h];
+
+    /* create new raw with proper parameters */
+    if(buff_append(b, "\\trowd", 6) != 0 ||
+       buff_append(b, r->thm->cw_tr[1], (MD_SIZE)strlen(r->thm->cw_tr[1])) != 0)
+      return -1;
+
+    /* we must first declare cells with their respecting properties */
+    for(i = 0; i < r->tabl_cols; ++i) {
+
+      if(buff_append(b,   "\\clvertalc" /* vertical-align center */
+                          "\\clbrdrt\\brdrs\\brdrw20\\brdrcf3" //< 30 bytes
+                          "\\clbrdrb\\brdrs\\brdrw20\\brdrcf3"
+                          "\\clbrdrl\\brdrs\\brdrw20\\brdrcf3"
+                          "\\clbrdrr\\brdrs\\brdrw20\\brdrcf3", 130) != 0)
+        return -1;
+
+      /* if we render a table head, we add a background to cells */
+      if(h) {
+        if(buff_append(b, "\\clcbpat5\\cellx", 15) != 0)
+          return -1;
+      } else {
+        if(buff_append(b, "\\cellx", 6) != 0)
+          return -1;
+      }
+
+      ultostr(cw * (i + 1), str_num, 10, 0);
+      if(buff_append(b, str_num, (MD_SIZE)strlen(str_num)) != 0)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Write row prefix with columns of equal width */
+static void
+render_table_row_equal(MD_RTF* r, unsigned head)
+{
+  MD_RTF_CHAR str_num[16];
+
+  /* create new raw with proper parameters */
+  render_verbatim(r, "\\trowd", 6);
+  RENDER_VERBATIM(r, r->thm->cw_tr[1]);
+
+  /* 9000 seem to be the average width of an RTF document */
+  float tw = 0.9f * r->thm->page_width;
+  unsigned cw = tw / r->tabl_cols;
+
+  /* we must first declare cells with their respecting properties */
+  for(unsigned i = 0; i < r->tabl_cols; ++i) {
+
+    render_verbatim(r,  "\\clvertalc" /* vertical-align center */
+                        "\\clbrdrt\\brdrs\\brdrw20\\brdrcf3" //< 30 bytes
+                        "\\clbrdrb\\brdrs\\brdrw20\\brdrcf3"
+                        "\\clbrdrl\\brdrs\\brdrw20\\brdrcf3"
+                        "\\clbrdrr\\brdrs\\brdrw20\\brdrcf3", 130);
+
+    /* if we render a table head, we add a background to cells */
+    if(head) {
+      render_verbatim(r, "\\clcbpat5\\cellx", 15);
+      ultostr(cw * (i + 1), str_num, 10, 0);
+    } else {
+      render_verbatim(r, "\\cellx", 6);
+      ultostr(cw * (i + 1), str_num, 10, 0);
+    }
+
+    RENDER_VERBATIM(r, str_num);
+  }
+}
+
+/* Compute columns widths from measures done so far and write held rows with
+their prefix, following rows are then written directly. */
+static void
+render_table_flush(MD_RTF* r)
+{
+  MD_RTF_BUFF* data = r->tabl_buff;
+  const MD_SIZE* rows = (const MD_SIZE*)r->tabl_rowv.data;
+  unsigned nrow = r->tabl_rowv.size / sizeof(MD_SIZE);
+  MD_SIZE psize[2] = { 0, 0 };
+  unsigned* width;
+  unsigned i;
+
+  if(!data)
+    return;
+
+  /* stop holding and measuring */
+  r->tabl_buff = NULL;
+  r->tabl_meas = 0;
+
+  width = (unsigned*)malloc(r->tabl_cols * sizeof(unsigned));
+
+  if(width) {
+    render_table_layout(r, width);
+    if(render_table_prefix(r, width) != 0) {
+      buff_free(&r->tabl_pfx[0]);
+      buff_free(&r->tabl_pfx[1]);
+    }
+    free(width);
+  }
+
+  for(i = 0; i < nrow; ++i) {
+
+    MD_SIZE beg = rows[i];
+    MD_SIZE end = (i + 1 < nrow) ? rows[i+1] : data->size;
+    unsigned head = (i < r->tabl_nhead);
+    MD_SIZE out_size = r->out_size;
+
+    /* without prefix (out of memory), rows are written in the usual way */
+    if(r->tabl_pfx[0].size) {
+      render_verbatim(r, (const MD_RTF_CHAR*)r->tabl_pfx[head].data,
+                      r->tabl_pfx[head].size);
+    } else {
+      render_table_row_equal(r, head);
+    }
+
+    psize[head] = r->out_size - out_size;
+
+    render_output(r, (const MD_RTF_CHAR*)data->data + beg, end - beg);
+  }
+
+  /* offset map entries within held rows must be shifted by the size of
+  prefixes inserted before them */
+  if(r->omap) {
+    MD_SIZE shift = 0;
+    unsigned k = 0;
+    for(i = r->tabl_omap; i < r->omap->count; ++i) {
+      MD_RTF_OFFSET* e = &r->omap->entries[i];
+      e->rtf_off += shift;
+      if(e->type == MD_BLOCK_TR && e->kind == MD_RTF_OFFSET_BLOCK)
+        shift += psize[k++ < r->tabl_nhead];
+    }
+  }
+
+  buff_free(data);
+  buff_free(&r->tabl_rowv);
+}
+
+/* Release table layout data, also used if render was aborted within table */
+static void
+render_table_free(MD_RTF* r)
+{
+  r->tabl_buff = NULL;
+  r->tabl_meas = 0;
+  buff_free(&r->tabl_data);
+  buff_free(&r->tabl_rowv);
+  buff_free(&r->tabl_pfx[0]);
+  buff_free(&r->tabl_pfx[1]);
+  free(r->tabl_wmin);
+  r->tabl_wmin = NULL;
+  r->tabl_wmax = NULL;
+}
+
+static void
+render_enter_block_table(MD_RTF* r, const MD_BLOCK_TABLE_DETAIL* tb)
+{
+  /* we hold column count to calculate cell width */
+  r->tabl_cols = tb->col_count;
+
+  /* start new table with smaller font and horizontal align to center */
+  render_verbatim(r, "\\pard\\f0", 8);
+  render_verbatim(r, r->thm->cw_fs[1], 5);
+
+  if(r->tabl_cols == 0)
+    return;
+
+  /* row prefix is known, if memory is missing rows write it piece by piece */
+  if(r->tabl_layo == MD_RTF_TABLE_EQUAL) {
+    if(render_table_prefix_equal(r) != 0) {
+      buff_free(&r->tabl_pfx[0]);
+      buff_free(&r->tabl_pfx[1]);
+    }
+    return;
+  }
+
+  /* rows are held and cells text measured until end of table */
+  r->tabl_wmin = (unsigned long*)calloc(2 * r->tabl_cols, sizeof(unsigned long));
+  if(!r->tabl_wmin)
+    return;
+
+  r->tabl_wmax = r->tabl_wmin + r->tabl_cols;
+  r->tabl_nhead = 0;
+  r->tabl_omap = r->omap ? r->omap->count : 0;
+  r->tabl_buff = &r->tabl_data;
+}
+
+static inline void
+render_leave_block_table(MD_RTF* r)
+{
+  /* write held rows */
+  render_table_flush(r);
+  render_table_free(r);
+
+  r->tabl_cols = 0;
+
+  /* all ended, create proper space after paragraph */
+  render_end_block(r);
+}
+
+static inline void
+render_enter_block_thead(MD_RTF* r)
+{
+  /* simply set a flag to know we are in table head */
+  r->tabl_head = 1;
+}
+
+static inline void
+render_leave_block_thead(MD_RTF* r)
+{
+  /* we are no longer in table head */
+  r->tabl_head = 0;
+}
+
+static void
+render_enter_block_tr(MD_RTF* r)
+{
+  r->tabl_cell = 0;
+
+  /* sample is complete, widths are computed and held rows written */
+  if(r->tabl_buff && r->tabl_nrow &&
+     r->tabl_rowv.size / sizeof(MD_SIZE) >= r->tabl_nrow)
+    render_table_flush(r);
+
+  /* held row, prefix is written once widths are known */
+  if(r->tabl_buff) {
+    MD_SIZE off = r->tabl_buff->size;
+    if(buff_append(&r->tabl_rowv, &off, sizeof(off)) == 0) {
+      if(r->tabl_head) r->tabl_nhead++;
+      return;
+    }
+    render_table_flush(r);
+  }
+
+  /* widths are known, row prefix is ready */
+  if(r->tabl_pfx[0].size) {
+    MD_RTF_BUFF* pfx = &r->tabl_pfx[r->tabl_head ? 1 : 0];
+    render_verbatim(r, (const MD_RTF_CHAR*)pfx->data, pfx->size);
+    return;
+  }
+
+  render_table_row_equal(r, r->tabl_head);
+}
+
+static inline void
+render_leave_block_tr(MD_RTF* r)
+{
+  /* close the row */
+  render_verbatim(r, "\\row\r\n", 6);
+}
+
+/* Start measuring cell text if columns widths are not known yet */
+static inline void
+render_table_cell_start(MD_RTF* r)
+{
+  if(r->tabl_buff) {
+    r->tabl_meas = 1;
+    r->tabl_text = 0;
+    r->tabl_word = 0;
+    r->tabl_long = 0;
+  }
+}
+
+static void
+render_enter_block_td(MD_RTF* r, const MD_BLOCK_TD_DETAIL* td)
+{
+  render_table_cell_start(r);
+
+  switch(td->align) {
+    case MD_ALIGN_CENTER: render_verbatim(r, "\\qc ", 4); break;
+    case MD_ALIGN_RIGHT: render_verbatim(r, "\\qr ", 4); break;
+    default: render_verbatim(r, "\\ql ", 4); break;
+  }
+}
+
+static inline void
+render_leave_block_td(MD_RTF* r)
+{
+  render_table_cell_end(r);
+
+  render_verbatim(r, "\\intbl\\cell ", 12);
+}
+
+static void
+render_enter_block_th(MD_RTF* r, const MD_BLOCK_TD_DETAIL* td)
+{
+  render_table_cell_start(r);
+
+  /* same as td but with bold text */
+  switch(td->align) {
+    case MD_ALIGN_CENTER: render_verbatim(r, "\\qc\\b ", 6); break;
+    case MD_ALIGN_RIGHT: render_verbatim(r, "\\qr\\b ", 6); break;
+    default: render_verbatim(r, "\\ql\\b ", 6); break;
+  }
+}
+
+static inline void
+render_leave_block_th(MD_RTF* r)
+{
+  render_table_cell_end(r);
+
+  render_verbatim(r, "\\b0\\intbl\\cell ", 15);
+}
+
+static inline void
+render_enter_block_p(MD_RTF* r)
+{
+  #ifdef _DEBUG
+  printf_tabs(2, r->list_dpth);
+  printf("=> render_enter_block_p\n");
+  #endif
+
+  /* special case if we are inside a list item */
+  if(r->list_dpth >= 0) {
+
+    /* if we have more than one paragraph inside list item we add line feed
+    at paragraph start */
+    if(r->list_para) {
+      render_verbatim(r, "\\line1\r\n", 8);
+    } else {
+      /* enabled line feed for the next paragraph */
+      r->list_para = 1;
+    }
+
+    /* we do not need further parameters */
+    return;
+  }
+
+  /* use normal font */
+  render_font_norm(r);
+
+  /* paragraph of quote with paragraph borders */
+  if(r->quot_dpth) {
+    render_quote_para(r);
+    return;
+  }
+
+  /* default space after and before */
+  render_verbatim(r, "\\sb0\\sa0 ", 9);
+}
+
+static inline void
+render_leave_block_p(MD_RTF* r)
+{
+  #ifdef _DEBUG
+  printf_tabs(2, r->list_dpth);
+  printf("<= render_leave_block_p\n");
+  #endif
+
+  /* special case if within block quote or item list we ignore paragraph end */
+  if(r->quot_blck || (r->list_dpth >= 0))
+    return;
+
+  /* within quote with paragraph borders, the space after is a property of
+  paragraph, so it stays outside of the border after the last one */
+  if(r->quot_dpth) {
+    render_verbatim(r, "\\par\r\n", 6);
+    return;
+  }
+
+  /* standard end of paragraph */
+  render_verbatim(r, "\\line1\\par\r\n", 12);
+}
+
+static void
+render_enter_span_url(MD_RTF* r, const MD_SPAN_A_DETAIL* a)
+{
+  render_verbatim(r, "\\cf4\\ul {\\field{\\*\\fldinst HYPERLINK \"", 38);
+  #ifdef MD4C_USE_UTF16
+  render_wchar(r, a->href.text, a->href.size, render_url_escaped);
+  #else
+  render_url_escaped(r, a->href.text, a->href.size);
+  #endif
+  render_verbatim(r, "\"}{\\fldrslt ", 12);
+}
+
+static inline void
+render_leave_span_url(MD_RTF* r)
+{
+  render_verbatim(r, "}}\\ul0 \\cf0 ", 12);
+}
+
+static inline void
+render_enter_span_code(MD_RTF* r)
+{
+  render_font_mono(r);
+}
+
+static inline void
+render_leave_span_code(MD_RTF* r)
+{
+  render_font_norm(r);
+
+  /* parser eat space after code span, we add it */
+  render_verbatim(r, " ", 1);
+}
+
+
+
+
+
+/******************************************
+ ***        Plain text rendering        ***
+ ******************************************/
+
+/* Plain text is rendered from the same parser callbacks when a text output
+is given. Blocks are separated by blank lines, list items are written with
+their marker and indented by depth, table cells are separated by tabs and
+rows by line feeds. Line feeds are CRLF, text is UTF-8. */
+
+static inline void
+plain_write(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
+{
+  r->text_output(text, size, r->text_userdata);
+}
+
+/* Ask for at least the given count of line feeds before the next text */
+static inline void
+plain_break(MD_RTF* r, unsigned nl)
+{
+  if(r->plain_nl < nl)
+    r->plain_nl = nl;
+}
+
+/* Write pending line feeds, then indentation and list item marker at
+beginning of line */
+static void
+plain_flush(MD_RTF* r)
+{
+  MD_RTF_CHAR str_num[16];
+
+  if(r->plain_any) {
+    while(r->plain_nl) {
+      plain_write(r, "\r\n", 2);
+      r->plain_bol = 1;
+      r->plain_nl--;
+    }
+  }
+
+  r->plain_nl = 0;
+  r->plain_any = 1;
+
+  if(!r->plain_bol)
+    return;
+
+  r->plain_bol = 0;
+
+  if(r->list_dpth < 0)
+    return;
+
+  unsigned d = r->list_dpth;
+
+  /* item content is indented after marker of each level, up to 8 levels as
+  for RTF output, so deeply nested lists do not make output grow as square
+  of depth */
+  for(unsigned i = r->plain_mark ? 1 : 0; i <= d && i < 8; ++i)
+    plain_write(r, "  ", 2);
+
+  if(r->plain_mark && d < r->list_cap) {
+    if(r->list[d].type == MD_RTF_LIST_TYPE_OL) {
+      ultostr(r->list[d].start + r->list[d].items - 1, str_num, 10, r->list[d].cw_tx[0]);
+      plain_write(r, str_num, strlen(str_num));
+      plain_write(r, " ", 1);
+    } else {
+      plain_write(r, "- ", 2);
+    }
+  }
+
+  r->plain_mark = 0;
+}
+
+static void
+plain_unicode(MD_RTF* r, unsigned u)
+{
+  MD_RTF_CHAR utf8[4];
+
+  if(u == 0 || u > 0x10FFFF)
+    u = 0xFFFD;
+
+  if(u < 0x80) {
+    utf8[0] = (MD_RTF_CHAR)u;
+    plain_write(r, utf8, 1);
+  } else if(u < 0x800) {
+    utf8[0] = (MD_RTF_CHAR)(0xC0 | (u >> 6));
+    utf8[1] = (MD_RTF_CHAR)(0x80 | (u & 0x3F));
+    plain_write(r, utf8, 2);
+  } else if(u < 0x10000) {
+    utf8[0] = (MD_RTF_CHAR)(0xE0 | (u >> 12));
+    utf8[1] = (MD_RTF_CHAR)(0x80 | ((u >> 6) & 0x3F));
+    utf8[2] = (MD_RTF_CHAR)(0x80 | (u & 0x3F));
+    plain_write(r, utf8, 3);
+  } else {
+    utf8[0] = (MD_RTF_CHAR)(0xF0 | (u >> 18));
+    utf8[1] = (MD_RTF_CHAR)(0x80 | ((u >> 12) & 0x3F));
+    utf8[2] = (MD_RTF_CHAR)(0x80 | ((u >> 6) & 0x3F));
+    utf8[3] = (MD_RTF_CHAR)(0x80 | (u & 0x3F));
+    plain_write(r, utf8, 4);
+  }
+}
+
+static void
+plain_entity(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
+{
+  if(!(r->flags & MD_RTF_FLAG_VERBATIM_ENTITIES)) {
+
+    if(size > 3 && text[1] == '#') {
+      if(text[2] == 'x' || text[2] == 'X') {
+        plain_unicode(r, strtoul(text + 3, NULL, 16));
+      } else {
+        plain_unicode(r, strtoul(text + 2, NULL, 10));
+      }
+      return;
+    }
+
+    #ifdef MD4C_ENTITY_H
+    const struct entity* ent = entity_lookup(text, size);
+    if(ent != NULL) {
+      plain_unicode(r, ent->codepoints[0]);
+      if(ent->codepoints[1])
+        plain_unicode(r, ent->codepoints[1]);
+      return;
+    }
+    #endif
+  }
+
+  plain_write(r, text, size);
+}
+
+static void
+plain_text(MD_RTF* r, MD_TEXTTYPE type, const MD_RTF_CHAR* text, MD_SIZE size)
+{
+  /* line feeds of code blocks are kept as pending, so the last one is not
+  written and lines of code within lists are indented */
+  if(type == MD_TEXT_BR || (type == MD_TEXT_CODE && size == 1 && text[0] == '\n')) {
+    r->plain_nl++;
+    return;
+  }
+
+  plain_flush(r);
+
+  switch(type) {
+      case MD_TEXT_NULLCHAR:  plain_unicode(r, 0xFFFD); break;
+      case MD_TEXT_SOFTBR:    plain_write(r, " ", 1); break;
+      case MD_TEXT_ENTITY:    plain_entity(r, text, size); break;
+      default:                plain_write(r, text, size); break;
+  }
+}
+
+#ifdef MD4C_USE_UTF16
+static void
+plain_text_utf8(MD_RTF* r, const MD_RTF_CHAR* text, MD_SIZE size)
+{
+  plain_text(r, r->plain_type, text, size);
+}
+#endif
+
+static void
+plain_enter_block(MD_RTF* r, MD_BLOCKTYPE type)
+{
+  unsigned d = r->list_dpth;
+
+  switch(type) {
+      case MD_BLOCK_UL:
+      case MD_BLOCK_OL:
+        if(d < r->list_cap) r->list[d].items = 0;
+        plain_break(r, 1);
+        break;
+      case MD_BLOCK_LI:
+        if(d < r->list_cap) r->list[d].items++;
+        plain_break(r, 1);
+        r->plain_mark = 1;
+        break;
+      case MD_BLOCK_HR:
+        plain_break(r, 2);
+        break;
+      case MD_BLOCK_TR:
+        plain_break(r, 1);
+        r->plain_cell = 0;
+        break;
+      case MD_BLOCK_TH:
+      case MD_BLOCK_TD:
+        /* written at once, so empty cells keep their place */
+        if(r->plain_cell++ > 0) {
+          plain_flush(r);
+          plain_write(r, "\t", 1);
+        }
+        break;
+      default:
+        break;
+  }
+}
+
+static void
+plain_leave_block(MD_RTF* r, MD_BLOCKTYPE type)
+{
+  switch(type) {
+      case MD_BLOCK_P:
+      case MD_BLOCK_H:
+      case MD_BLOCK_CODE:
+      case MD_BLOCK_QUOTE:
+      case MD_BLOCK_TABLE:
+      case MD_BLOCK_UL:
+      case MD_BLOCK_OL:
+        /* blocks within list items are not separated by blank lines */
+        plain_break(r, (r->list_dpth >= 0) ? 1 : 2);
+        break;
+      default:
+        break;
+  }
+}
+
+
+/***************************************
+ ***   RTF renderer implementation   ***
+ ***************************************/
+
+/* Count a parser callback, the render is stopped once the steps budget is
+exhausted. Returns the render status. */
+static inline int
+render_limit_step(MD_RTF* r)
+{
+  if(r->lim_step && ++r->step > r->lim_step)
+    render_stop(r, MD_RTF_ERROR_STEPS_LIMIT);
+
+  return r->status;
+}
+
+/* Count a top-level block, once the preview is complete the parse is aborted
+by returning non-zero, all blocks being closed at this point. Returns the
+render status, or 1 to end the preview. */
+static int
+render_preview_check(MD_RTF* r)
+{
+  if(r->status == 0 && (r->prev_blks || r->prev_out)) {
+    if((r->prev_blks && ++r->prev_count >= r->prev_blks) ||
+       (r->prev_out && r->out_size >= r->prev_out))
+      r->prev_stop = 1;
+  }
+
+  return r->status ? r->status : (int)r->prev_stop;
+}
+
+static int
+enter_block_callback(MD_BLOCKTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  r->blk_dpth++;
+
+  if(render_limit_step(r) != 0)
+    return r->status;
+
+  switch(type) {
+      case MD_BLOCK_QUOTE:
+      case MD_BLOCK_UL:
+      case MD_BLOCK_OL:
+        if(r->lim_dpth && ++r->nest_dpth > r->lim_dpth) {
+          render_stop(r, MD_RTF_ERROR_DEPTH_LIMIT);
+          return r->status;
+        }
+        break;
+      case MD_BLOCK_TABLE:
+        r->tabl_ncel = 0;
+        break;
+      case MD_BLOCK_TH:
+      case MD_BLOCK_TD:
+        if(r->lim_cell && ++r->tabl_ncel > r->lim_cell) {
+          render_stop(r, MD_RTF_ERROR_CELLS_LIMIT);
+          return r->status;
+        }
+        break;
+      default:
+        break;
+  }
+
+  switch(type) {
+      case MD_BLOCK_DOC:      if(!r->chunked) render_enter_block_doc(r); break;
+      case MD_BLOCK_QUOTE:    render_enter_block_quote(r); break;
+      case MD_BLOCK_UL:       render_enter_block_ul(r, (const MD_BLOCK_UL_DETAIL*)detail); break;
+      case MD_BLOCK_OL:       render_enter_block_ol(r, (const MD_BLOCK_OL_DETAIL*)detail); break;
+      case MD_BLOCK_LI:       render_enter_block_li(r, (const MD_BLOCK_LI_DETAIL*)detail); break;
+      case MD_BLOCK_HR:       render_enter_block_hr(r); break;
+      case MD_BLOCK_H:        render_enter_block_h(r, (const MD_BLOCK_H_DETAIL*)detail); break;
+      case MD_BLOCK_CODE:     render_enter_block_code(r, (const MD_BLOCK_CODE_DETAIL*)detail); break;
+      case MD_BLOCK_P:        render_enter_block_p(r); break;
+      case MD_BLOCK_HTML:     /* noop */ break;
+      case MD_BLOCK_TABLE:    render_enter_block_table(r, (const MD_BLOCK_TABLE_DETAIL*)detail); break;
+      case MD_BLOCK_THEAD:    render_enter_block_thead(r); break;
+      case MD_BLOCK_TBODY:    /* noop */ break;
+      case MD_BLOCK_TR:       render_enter_block_tr(r); break;
+      case MD_BLOCK_TH:       render_enter_block_th(r,(const MD_BLOCK_TD_DETAIL*)detail); break;
+      case MD_BLOCK_TD:       render_enter_block_td(r,(const MD_BLOCK_TD_DETAIL*)detail); break;
+  }
+
+  if(r->text_output)
+    plain_enter_block(r, type);
+
+  return r->status;
+}
+
+static int
+leave_block_callback(MD_BLOCKTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  if(r->lim_dpth && (type == MD_BLOCK_QUOTE || type == MD_BLOCK_UL || type == MD_BLOCK_OL))
+    r->nest_dpth--;
+
+  switch(type) {
+      case MD_BLOCK_DOC:      if(!r->chunked) render_leave_block_doc(r); break;
+      case MD_BLOCK_QUOTE:    render_leave_block_quote(r); break;
+      case MD_BLOCK_UL:       render_leave_block_ul(r); break;
+      case MD_BLOCK_OL:       render_leave_block_ol(r); break;
+      case MD_BLOCK_LI:       render_leave_block_li(r); break;
+      case MD_BLOCK_HR:       /*noop*/ break;
+      case MD_BLOCK_H:        render_leave_block_h(r, (const MD_BLOCK_H_DETAIL*)detail); break;
+      case MD_BLOCK_CODE:     render_leave_block_code(r); break;
+      case MD_BLOCK_P:        render_leave_block_p(r); break;
+      case MD_BLOCK_HTML:     /* noop */ break;
+      case MD_BLOCK_TABLE:    render_leave_block_table(r); break;
+      case MD_BLOCK_THEAD:    render_leave_block_thead(r); break;
+      case MD_BLOCK_TBODY:    /* noop */ break;
+      case MD_BLOCK_TR:       render_leave_block_tr(r); break;
+      case MD_BLOCK_TH:       render_leave_block_th(r); break;
+      case MD_BLOCK_TD:       render_leave_block_td(r); break;
+  }
+
+  if(r->text_output)
+    plain_leave_block(r, type);
+
+  /* top-level block ended */
+  if(--r->blk_dpth == 1) {
+    render_flush_hint(r);
+    return render_preview_check(r);
+  }
+
+  return r->status;
+}
+
+static int
+enter_span_callback(MD_SPANTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  if(render_limit_step(r) != 0)
+    return r->status;
+
+  switch(type) {
+      case MD_SPAN_EM:                render_verbatim(r, "\\i ", 3); break;
+      case MD_SPAN_STRONG:            render_verbatim(r, "\\b ", 3); break;
+      case MD_SPAN_U:                 render_verbatim(r, "\\ul ", 4); break;
+      case MD_SPAN_DEL:               render_verbatim(r, "\\strike ", 8); break;
+      case MD_SPAN_A:                 render_enter_span_url(r, (MD_SPAN_A_DETAIL*) detail); break;
+      case MD_SPAN_CODE:              render_enter_span_code(r); break;
+      //case MD_SPAN_IMG:               render_open_img_span(r, (MD_SPAN_IMG_DETAIL*) detail); break;
+      //case MD_SPAN_LATEXMATH:         RENDER_VERBATIM(r, "<x-equation>"); break;
+      //case MD_SPAN_LATEXMATH_DISPLAY: RENDER_VERBATIM(r, "<x-equation type=\"display\">"); break;
+      //case MD_SPAN_WIKILINK:          render_open_wikilink_span(r, (MD_SPAN_WIKILINK_DETAIL*) detail); break;
+  }
+
+  return r->status;
+}
+
+static int
+leave_span_callback(MD_SPANTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  switch(type) {
+      case MD_SPAN_EM:                render_verbatim(r, "\\i0 ", 4); break;
+      case MD_SPAN_STRONG:            render_verbatim(r, "\\b0 ", 4); break;
+      case MD_SPAN_U:                 render_verbatim(r, "\\ul0 ", 5); break;
+      case MD_SPAN_DEL:               render_verbatim(r, "\\strike0 ", 9); break;
+      case MD_SPAN_A:                 render_leave_span_url(r); break;
+      case MD_SPAN_CODE:              render_leave_span_code(r); break;
+      //case MD_SPAN_IMG:               /*noop, handled above*/ break;
+      //case MD_SPAN_LATEXMATH:         /*fall through*/
+      //case MD_SPAN_LATEXMATH_DISPLAY: RENDER_VERBATIM(r, "</x-equation>"); break;
+      //case MD_SPAN_WIKILINK:          RENDER_VERBATIM(r, "</x-wikilink>"); break;
+  }
+
+  return r->status;
+}
+
+#ifdef MD4C_USE_UTF16
+static int
+text_callback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  #ifdef _DEBUG
+  printf_tabs(2, r->list_dpth);
+  printf("++ text_callback (");
+  switch(type) {
+    case MD_TEXT_NULLCHAR: printf("MD_TEXT_NULLCHAR)\n"); break;
+    case MD_TEXT_BR:  printf("MD_TEXT_BR)\n"); break;
+    case MD_TEXT_SOFTBR:  printf("MD_TEXT_SOFTBR)\n"); break;
+    case MD_TEXT_CODE: printf("MD_TEXT_CODE)\n"); break;
+    case MD_TEXT_HTML:  printf("MD_TEXT_HTML)\n"); break;
+    case MD_TEXT_ENTITY: printf("MD_TEXT_ENTITY)\n"); break;
+    default: printf("NORMAL)\n"); break;
+  }
+  #endif
+
+  if(render_limit_step(r) != 0)
+    return r->status;
+
+  /* table cell text is measured to compute columns widths */
+  if(r->tabl_meas)
+    render_table_measure(r, type, text, size);
+
+  /* gathered block code comes before any output which bypasses it */
+  if(r->code_blck && type == MD_TEXT_NULLCHAR)
+    render_code_pending(r);
+
+  switch(type) {
+      case MD_TEXT_NULLCHAR:  render_verbatim(r, "\0", 1); break;
+      case MD_TEXT_BR:        render_verbatim(r, "\\line1", 6); break;
+      case MD_TEXT_SOFTBR:    render_verbatim(r, " ", 1); break;
+      case MD_TEXT_CODE:
+        if(r->code_blck && !r->code_lang)
+          render_code_text(r, text, size);
+        else
+          render_wchar(r, text, size, render_text_code);
+        break;
+      case MD_TEXT_HTML:      render_wchar(r, text, size, render_rtf_escaped); break;
+      case MD_TEXT_ENTITY:    render_wchar(r, text, size, render_entity); break;
+      default:                render_wchar(r, text, size, render_rtf_escaped); break;
+  }
+
+  if(r->toc_head)
+    render_toc_text(r, type, text, size);
+
+  if(r->text_output) {
+    r->plain_type = type;
+    render_wchar(r, text, size, plain_text_utf8);
+  }
+
+  return r->status;
+}
+#else
+static int
+text_callback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  #ifdef _DEBUG
+  printf_tabs(2, r->list_dpth);
+  printf("++ text_callback (");
+  switch(type) {
+    case MD_TEXT_NULLCHAR: printf("MD_TEXT_NULLCHAR)\n"); break;
+    case MD_TEXT_BR:  printf("MD_TEXT_BR)\n"); break;
+    case MD_TEXT_SOFTBR:  printf("MD_TEXT_SOFTBR)\n"); break;
+    case MD_TEXT_CODE: printf("MD_TEXT_CODE)\n"); break;
+    case MD_TEXT_HTML:  printf("MD_TEXT_HTML)\n"); break;
+    case MD_TEXT_ENTITY: printf("MD_TEXT_ENTITY)\n"); break;
+    default: printf("NORMAL)\n"); break;
+  }
+  #endif
+
+  if(render_limit_step(r) != 0)
+    return r->status;
+
+  /* table cell text is measured to compute columns widths */
+  if(r->tabl_meas)
+    render_table_measure(r, type, text, size);
+
+  /* gathered block code comes before any output which bypasses it */
+  if(r->code_blck && type == MD_TEXT_NULLCHAR)
+    render_code_pending(r);
+
+  switch(type) {
+      case MD_TEXT_NULLCHAR:  render_verbatim(r, "\0", 1); break;
+      case MD_TEXT_BR:        render_verbatim(r, "\\line1", 6); break;
+      case MD_TEXT_SOFTBR:    render_verbatim(r, " ", 1); break;
+      case MD_TEXT_CODE:
+        if(r->code_blck && !r->code_lang)
+          render_code_text(r, text, size);
+        else
+          render_text_code(r, text, size);
+        break;
+      case MD_TEXT_HTML:      render_rtf_escaped(r, text, size); break;
+      case MD_TEXT_ENTITY:    render_entity(r, text, size); break;
+      default:                render_rtf_escaped(r, text, size); break;
+  }
+
+  if(r->toc_head)
+    render_toc_text(r, type, text, size);
+
+  if(r->text_output)
+    plain_text(r, type, text, size);
+
+  return r->status;
+}
+#endif
+
+static void
+debug_log_callback(const char* msg, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+  if(r->flags & MD_RTF_FLAG_DEBUG)
+      fprintf(stderr, "MD4C: %s\n", msg);
+}
+
+
+/******************************************
+ ***        Source offsets map          ***
+ ******************************************/
+
+/* These callbacks wrap the renderer ones and are only given to the parser
+when an offset map must be filled, so the usual render has no overhead. The
+source offset of an entered block or span is not known until its first text,
+such entries are left pending and set by the next text callback. */
+
+static int
+omap_push(MD_RTF* r, unsigned type, unsigned kind)
+{
+  MD_RTF_OFFSET_MAP* map = r->omap;
+
+  if(map->count == map->cap) {
+
+    unsigned cap = map->cap ? map->cap * 2 : 256;
+    MD_RTF_OFFSET* entries = (MD_RTF_OFFSET*)realloc(map->entries, cap * sizeof(MD_RTF_OFFSET));
+    if(!entries)
+      return -1;
+
+    map->entries = entries;
+    map->cap = cap;
+  }
+
+  map->entries[map->count].md_off = r->omap_pos;
+  map->entries[map->count].rtf_off = r->out_size;
+  map->entries[map->count].type = (unsigned short)type;
+  map->entries[map->count].kind = (unsigned short)kind;
+  map->count++;
+
+  return 0;
+}
+
+/* Set source offset of pending entries */
+static inline void
+omap_resolve(MD_RTF* r, MD_OFFSET off)
+{
+  while(r->omap_pend < r->omap->count)
+    r->omap->entries[r->omap_pend++].md_off = off;
+}
+
+static int
+omap_enter_block_callback(MD_BLOCKTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  if(type != MD_BLOCK_DOC && omap_push(r, type, MD_RTF_OFFSET_BLOCK) != 0)
+    return -1;
+
+  return enter_block_callback(type, detail, userdata);
+}
+
+static int
+omap_leave_block_callback(MD_BLOCKTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  int result = leave_block_callback(type, detail, userdata);
+
+  /* block without any text */
+  omap_resolve(r, r->omap_pos);
+
+  if(type != MD_BLOCK_DOC) {
+    if(omap_push(r, type, MD_RTF_OFFSET_BLOCK|MD_RTF_OFFSET_LEAVE) != 0)
+      return -1;
+    r->omap_pend = r->omap->count;
+  }
+
+  return result;
+}
+
+static int
+omap_enter_span_callback(MD_SPANTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  if(omap_push(r, type, MD_RTF_OFFSET_SPAN) != 0)
+    return -1;
+
+  return enter_span_callback(type, detail, userdata);
+}
+
+static int
+omap_leave_span_callback(MD_SPANTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  int result = leave_span_callback(type, detail, userdata);
+
+  omap_resolve(r, r->omap_pos);
+
+  if(omap_push(r, type, MD_RTF_OFFSET_SPAN|MD_RTF_OFFSET_LEAVE) != 0)
+    return -1;
+  r->omap_pend = r->omap->count;
+
+  return result;
+}
+
+static int
+omap_text_callback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  /* some text (e.g. line breaks) are not within source */
+  if(text >= r->src && text < r->src + r->src_size) {
+    omap_resolve(r, (MD_OFFSET)(text - r->src));
+    r->omap_pos = (MD_OFFSET)(text - r->src) + size;
+  }
+
+  return text_callback(type, text, size, userdata);
+}
+
+void
+md_rtf_offset_map_free(MD_RTF_OFFSET_MAP* map)
+{
+  free(map->entries);
+  map->entries = NULL;
+  map->count = 0;
+  map->cap = 0;
+}
+
+
+/******************************************
+ ***            Render trace            ***
+ ******************************************/
+
+/* Events are stored in a ring buffer allocated at trace creation, so adding
+an event is a clock read and a store. Like the offset map ones, the trace
+callbacks wrap the renderer ones and are only given to the parser when a
+trace is given, the usual render is not slowed down. */
+
+typedef struct MD_RTF_tevent_tag {
+  unsigned long long  time;   /* nanoseconds since trace creation */
+  MD_SIZE             out;    /* output size at event */
+  unsigned char       phase;  /* 'B' begin, 'E' end or 'i' instant */
+  unsigned char       kind;   /* TRACE_XXX */
+  unsigned short      type;   /* block or span type */
+} MD_RTF_TEVENT;
+
+struct MD_RTF_trace_tag {
+  MD_RTF_TEVENT*      events;
+  unsigned            cap;
+  unsigned            next;   /* index of next event to write */
+  unsigned long       count;  /* events recorded, overwritten included */
+  unsigned long long  orig;   /* clock at creation */
+  #ifdef _WIN32
+  unsigned long long  freq;   /* performance counter frequency */
+  #endif
+};
+
+static const char* g_trace_block_names[] = {
+  "doc", "quote", "ul", "ol", "li", "hr", "h", "code", "html", "p",
+  "table", "thead", "tbody", "tr", "th", "td"};
+
+static const char* g_trace_span_names[] = {
+  "em", "strong", "a", "img", "code", "del", "latexmath",
+  "latexmath_display", "wikilink", "u"};
+
+/* Monotonic clock in nanoseconds */
+static unsigned long long
+trace_clock(const MD_RTF_TRACE* t)
+{
+  #ifdef _WIN32
+  LARGE_INTEGER c;
+  QueryPerformanceCounter(&c);
+  return (unsigned long long)(c.QuadPart / t->freq) * 1000000000ULL +
+         (unsigned long long)(c.QuadPart % t->freq) * 1000000000ULL / t->freq;
+  #else
+  struct timespec ts;
+  (void)t;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  #endif
+}
+
+static void
+trace_event(MD_RTF_TRACE* t, unsigned kind, unsigned type, unsigned phase,
+            MD_SIZE out)
+{
+  MD_RTF_TEVENT* e = &t->events[t->next];
+
+  e->time = trace_clock(t) - t->orig;
+  e->out = out;
+  e->phase = (unsigned char)phase;
+  e->kind = (unsigned char)kind;
+  e->type = (unsigned short)type;
+
+  if(++t->next == t->cap)
+    t->next = 0;
+  t->count++;
+}
+
+static int
+trace_enter_block_callback(MD_BLOCKTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  trace_event(r->trace, TRACE_BLOCK, type, 'B', r->out_size);
+
+  return r->trace_next.enter_block(type, detail, userdata);
+}
+
+static int
+trace_leave_block_callback(MD_BLOCKTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  int result = r->trace_next.leave_block(type, detail, userdata);
+
+  trace_event(r->trace, TRACE_BLOCK, type, 'E', r->out_size);
+
+  return result;
+}
+
+static int
+trace_enter_span_callback(MD_SPANTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  trace_event(r->trace, TRACE_SPAN, type, 'B', r->out_size);
+
+  return r->trace_next.enter_span(type, detail, userdata);
+}
+
+static int
+trace_leave_span_callback(MD_SPANTYPE type, void* detail, void* userdata)
+{
+  MD_RTF* r = (MD_RTF*) userdata;
+
+  int result = r->trace_next.leave_span(type, detail, userdata);
+
+  trace_event(r->trace, TRACE_SPAN, type, 'E', r->out_size);
+
+  return result;
+}
+
+MD_RTF_TRACE*
+md_rtf_trace_new(unsigned capacity)
+{
+  if(capacity == 0)
+    return NULL;
+
+  MD_RTF_TRACE* t = (MD_RTF_TRACE*)malloc(sizeof(MD_RTF_TRACE));
+  if(!t)
+    return NULL;
+
+  t->events = (MD_RTF_TEVENT*)malloc(capacity * sizeof(MD_RTF_TEVENT));
+  if(!t->events) {
+    free(t);
+    return NULL;
+  }
+
+  t->cap = capacity;
+  t->next = 0;
+  t->count = 0;
+
+  #ifdef _WIN32
+  LARGE_INTEGER f;
+  QueryPerformanceFrequency(&f);
+  t->freq = (unsigned long long)f.QuadPart;
+  #endif
+
+  t->orig = 0;
+  t->orig = trace_clock(t);
+
+  return t;
+}
+
+void
+md_rtf_trace_free(MD_RTF_TRACE* trace)
+{
+  if(!trace)
+    return;
+
+  free(trace->events);
+  free(trace);
+}
+
+void
+md_rtf_trace_clear(MD_RTF_TRACE* trace)
+{
+  trace->next = 0;
+  trace->count = 0;
+  trace->orig = trace_clock(trace);
+}
+
+int
+md_rtf_trace_export(const MD_RTF_TRACE* trace,
+                    void (*process_output)(const MD_RTF_CHAR*, MD_SIZE, void*),
+                    void* userdata)
+{
+  static const MD_RTF_CHAR head[] = "{\"traceEvents\":[\n";
+  static const MD_RTF_CHAR tail[] = "\n]}\n";
+  MD_RTF_CHAR buf[192];
+  unsigned i, n, beg;
+
+  /* oldest event is the next one to be overwritten once the ring is full */
+  n = trace->count < trace->cap ? (unsigned)trace->count : trace->cap;
+  beg = trace->count < trace->cap ? 0 : trace->next;
+
+  process_output(head, sizeof(head) - 1, userdata);
+
+  for(i = 0; i < n; ++i) {
+
+    const MD_RTF_TEVENT* e = &trace->events[(beg + i) % trace->cap];
+    const char* name;
+    const char* cat;
+
+    switch(e->kind) {
+      case TRACE_SETUP: name = "setup"; cat = "render"; break;
+      case TRACE_BLOCK: name = g_trace_block_names[e->type]; cat = "block"; break;
+      case TRACE_SPAN:  name = g_trace_span_names[e->type]; cat = "span"; break;
+      default:          name = "flush"; cat = "sink"; break;
+    }
+
+    /* timestamps are microseconds, instant events are thread scoped */
+    int len = sprintf(buf, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",%s"
+                      "\"ts\":%lu.%03u,\"pid\":1,\"tid\":1,\"args\":{\"out\":%lu}}",
+                      i ? ",\n" : "", name, cat, e->phase, e->phase == 'i' ? "\"s\":\"t\"," : "",
+                      (unsigned long)(e->time / 1000), (unsigned)(e->time % 1000),
+                      (unsigned long)e->out);
+
+    process_output(buf, (MD_SIZE)len, userdata);
+  }
+
+  process_output(tail, sizeof(tail) - 1, userdata);
+
+  return 0;
+}
+
+
+/******************************************
+ ***     Top-level chunks splitting     ***
+ ******************************************/
+
+/* To allow caching, the input is cut into chunks which can be parsed and
+rendered separately while producing exactly the same output as a parse of the
+whole document. A chunk boundary is a non-blank line which follows a blank
+line and which cannot be the continuation of an open block: it is not indented
+(no list item or indented code continuation), it is not a list marker (no
+loose list continuation) and it is not within a fenced code block or within a
+kind of HTML block which does not end at blank line. */
+
+
+/* Case-insensitive compare of input with an ASCII lowercase pattern */
+static int
+chunk_match(const MD_CHAR* text, MD_SIZE size, const char* pat)
+{
+  MD_SIZE i;
+
+  for(i = 0; pat[i]; ++i) {
+    if(i >= size)
+      return 0;
+    MD_CHAR ch = text[i];
+    if(ISUPPER(ch)) ch += 'a' - 'A';
+    if(ch != (MD_CHAR)pat[i])
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Search an ASCII lowercase pattern within the given line */
+static int
+chunk_find(const MD_CHAR* text, MD_SIZE size, const char* pat)
+{
+  MD_SIZE i;
+
+  for(i = 0; i < size; ++i) {
+    if(chunk_match(text + i, size - i, pat))
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Returns type (1 to 5) of the HTML block which starts at given line, if this
+kind of block is only ended by a specific end marker, otherwise returns 0. */
+static int
+chunk_html_start(const MD_CHAR* text, MD_SIZE size)
+{
+  static const char* tags[4] = { "<script", "<pre", "<style", "<textarea" };
+  unsigned i;
+
+  if(chunk_match(text, size, "<![cdata[")) return 5;
+  if(chunk_match(text, size, "<!--")) return 2;
+  if(chunk_match(text, size, "<?")) return 3;
+  if(size > 2 && text[1] == '!' && ISUPPER(text[2])) return 4;
+
+  for(i = 0; i < 4; ++i) {
+    MD_SIZE n = (MD_SIZE)strlen(tags[i]);
+    if(chunk_match(text, size, tags[i])) {
+      if(n == size || ISBLANK(text[n]) || ISNEWLINE(text[n]) || text[n] == '>')
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Returns whether the given line contains end marker of the HTML block type */
+static int
+chunk_html_end(const MD_CHAR* text, MD_SIZE size, int type)
+{
+  switch(type) {
+    case 1: return chunk_find(text, size, "</script>") ||
+                   chunk_find(text, size, "</pre>") ||
+                   chunk_find(text, size, "</style>") ||
+                   chunk_find(text, size, "</textarea>");
+    case 2: return chunk_find(text, size, "-->");
+    case 3: return chunk_find(text, size, "?>");
+    case 4: return chunk_find(text, size, ">");
+    case 5: return chunk_find(text, size, "]]>");
+  }
+
+  return 1;
+}
+
+/* Returns whether the given (not indented) line starts with a list marker */
+static int
+chunk_list_mark(const MD_CHAR* text, MD_SIZE size)
+{
+  MD_SIZE i = 0;
+
+  if(text[0] == '-' || text[0] == '+' || text[0] == '*') {
+    i = 1;
+  } else {
+    while(i < size && i < 10 && ISDIGIT(text[i]))
+      i++;
+    if(i == 0 || i == 10 || i >= size || (text[i] != '.' && text[i] != ')'))
+      return 0;
+    i++;
+  }
+
+  return (i == size || ISBLANK(text[i]) || ISNEWLINE(text[i]));
+}
+
+/* Returns the content indentation (from the marker) of the list item which
+starts at the given line, or 0 if the line does not start a list item. The
+empty flag is set if the item has no content on its first line, the interrupt
+flag is set if the item can interrupt a paragraph. */
+static unsigned
+chunk_list_item(const MD_CHAR* text, MD_SIZE size, int* empty, int* interrupt)
+{
+  MD_SIZE i = 0;
+  MD_SIZE k;
+
+  if(!chunk_list_mark(text, size))
+    return 0;
+
+  if(ISDIGIT(text[0])) {
+    while(ISDIGIT(text[i]))
+      i++;
+    *interrupt = (i == 1 && text[0] == '1');
+  } else {
+    *interrupt = 1;
+  }
+  i++;
+
+  k = i;
+  while(k < size && ISBLANK(text[k]))
+    k++;
+
+  *empty = (k == size);
+  if(*empty)
+    *interrupt = 0;
+
+  /* content indented by 5 or more is an indented code within the item */
+  return (*empty || k - i > 4) ? (unsigned)i + 1 : (unsigned)k;
+}
+
+/* Returns whether the given line opens a code fence, and sets the fence
+character and length */
+static int
+chunk_fence_open(const MD_CHAR* text, MD_SIZE size, MD_CHAR* ch, MD_SIZE* n)
+{
+  MD_SIZE i = 0;
+
+  if(size < 3 || (text[0] != '`' && text[0] != '~'))
+    return 0;
+
+  while(i < size && text[i] == text[0])
+    i++;
+
+  if(i < 3)
+    return 0;
+
+  *n = i;
+
+  /* backtick fence info string cannot contain backtick */
+  if(text[0] == '`') {
+    while(i < size) {
+      if(text[i++] == '`')
+        return 0;
+    }
+  }
+
+  *ch = text[0];
+
+  return 1;
+}
+
+/* Returns whether the given line closes a code fence of the given character
+and length */
+static int
+chunk_fence_close(const MD_CHAR* text, MD_SIZE size, MD_CHAR ch, MD_SIZE n)
+{
+  MD_SIZE i = 0;
+
+  while(i < size && text[i] == ch)
+    i++;
+
+  if(i < n)
+    return 0;
+
+  while(i < size && ISBLANK(text[i]))
+    i++;
+
+  return (i == size);
+}
+
+/* Returns whether the given (not blank) line is an ATX heading or a
+thematic break, which both are single line blocks */
+static int
+chunk_single_line(const MD_CHAR* text, MD_SIZE size)
+{
+  MD_SIZE i = 0;
+  unsigned n = 0;
+
+  if(text[0] == '#') {
+    while(i < size && i < 7 && text[i] == '#')
+      i++;
+    return (i < 7 && (i == size || ISBLANK(text[i])));
+  }
+
+  if(text[0] != '-' && text[0] != '*' && text[0] != '_')
+    return 0;
+
+  for(i = 0; i < size; ++i) {
+    if(text[i] == text[0]) {
+      n++;
+    } else if(!ISBLANK(text[i])) {
+      return 0;
+    }
+  }
+
+  return (n >= 3);
+}
+
+/* Returns whether the given (not blank) line, which follows a paragraph line,
+can be a lazy continuation of this paragraph */
+static int
+chunk_lazy(const MD_CHAR* text, MD_SIZE size)
+{
+  MD_CHAR ch;
+  MD_SIZE n;
+  int empty;
+  int interrupt = 0;
+
+  if(text[0] == '>' || chunk_single_line(text, size))
+    return 0;
+
+  if(chunk_fence_open(text, size, &ch, &n))
+    return 0;
+
+  if(text[0] == '<' && chunk_html_start(text, size))
+    return 0;
+
+  return !(chunk_list_item(text, size, &empty, &interrupt) && interrupt);
+}
+
+/* Link reference definitions are global to the document, chunks cannot be
+parsed separately if any may exist. We simply look for any "]:" sequence. */
+static int
+chunk_may_have_refs(const MD_CHAR* text, MD_SIZE size)
+{
+  MD_SIZE i;
+
+  for(i = 1; i < size; ++i) {
+    if(text[i] == ':' && text[i-1] == ']')
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Scan input from the given chunk start offset and returns offset of the
+next chunk start, or input size if no more boundary was found.
+
+Fenced code blocks and HTML blocks are only relevant at top-level, but a code
+fence indented within a list item belongs to the item, so the content
+indentation of the last list item is tracked to tell them apart. */
+static MD_OFFSET
+chunk_next(const MD_CHAR* text, MD_SIZE size, MD_OFFSET off)
+{
+  MD_OFFSET beg = off;
+  MD_OFFSET end;
+  MD_OFFSET i;
+  unsigned col;
+  MD_CHAR fence_ch = 0;
+  MD_SIZE fence_n = 0;
+  MD_CHAR item_ch = 0;
+  MD_SIZE item_n = 0;
+  unsigned item_w = 0;
+  int item_empty = 0;
+  int empty;
+  int interrupt;
+  int html = 0;
+  int blank = 0;
+  int para = 0;
+  int seen = 0;
+
+  while(beg < size) {
+
+    /* find end of line (without new line characters) and next line start,
+    lines end with LF, CRLF or a lone CR as for MD4C */
+    end = beg;
+    while(end < size && !ISNEWLINE(text[end]))
+      end++;
+
+    MD_OFFSET next = end;
+    if(next < size && text[next] == '\r')
+      next++;
+    if(next < size && text[next] == '\n')
+      next++;
+
+    /* indentation, in columns */
+    i = beg;
+    col = 0;
+    while(i < end && ISBLANK(text[i])) {
+      col = (text[i] == '\t') ? (col + 4) & ~3u : col + 1;
+      i++;
+    }
+
+    if(fence_ch) {
+
+      if(col < 4 && chunk_fence_close(text + i, end - i, fence_ch, fence_n))
+        fence_ch = 0;
+
+      goto next_line;
+    }
+
+    if(html) {
+
+      if(chunk_html_end(text + beg, end - beg, html))
+        html = 0;
+
+      goto next_line;
+    }
+
+    if(i == end) {
+      /* list item can begin with at most one blank line */
+      if(item_empty)
+        item_w = 0;
+      blank = 1;
+      para = 0;
+      beg = next;
+      continue;
+    }
+
+    if(item_w) {
+
+      if(col >= item_w) {
+
+        /* line within list item */
+        if(item_ch) {
+          if(col - item_w < 4 && chunk_fence_close(text + i, end - i, item_ch, item_n))
+            item_ch = 0;
+          para = 0;
+        } else if(col - item_w < 4) {
+          if(chunk_fence_open(text + i, end - i, &item_ch, &item_n)) {
+            para = 0;
+          } else {
+            para = !chunk_single_line(text + i, end - i);
+          }
+        }
+
+        item_empty = 0;
+        goto next_line;
+      }
+
+      /* lazy continuation line of paragraph within list item */
+      if(!blank && !item_ch && para && chunk_lazy(text + i, end - i))
+        goto next_line;
+
+      item_w = 0;
+      item_ch = 0;
+    }
+
+    /* safe boundary ? */
+    if(blank && seen && col == 0 && !chunk_list_mark(text + beg, end - beg))
+      return beg;
+
+    if(col < 4) {
+
+      /* opening code fence */
+      if(chunk_fence_open(text + i, end - i, &fence_ch, &fence_n)) {
+        para = 0;
+        goto next_line;
+      }
+
+      /* HTML block ended by specific marker */
+      if(text[i] == '<') {
+        html = chunk_html_start(text + i, end - i);
+        if(html) {
+          if(chunk_html_end(text + i + 2, end - i - 2, html))
+            html = 0;
+          para = 0;
+          goto next_line;
+        }
+      }
+
+      /* list item start, which may open a code fence */
+      interrupt = 0;
+      item_w = chunk_list_item(text + i, end - i, &empty, &interrupt);
+      if(item_w && (blank || !para || interrupt)) {
+        MD_OFFSET k = i + item_w;
+        item_w += col;
+        item_empty = empty;
+        para = 0;
+        if(!empty) {
+          while(k < end && ISBLANK(text[k]))
+            k++;
+          /* content is indented code if indented by 5 or more */
+          if(k - i - (item_w - col) < 4 &&
+              !chunk_fence_open(text + k, end - k, &item_ch, &item_n))
+            para = !chunk_single_line(text + k, end - k);
+        }
+        goto next_line;
+      }
+      item_w = 0;
+
+      para = !chunk_single_line(text + i, end - i);
+    }
+
+next_line:
+    blank = 0;
+    seen = 1;
+    beg = next;
+  }
+
+  return size;
+}
+
+/* Returns the chunk size without trailing blank lines and last new line,
+which do not have any effect on rendered output. */
+static MD_SIZE
+chunk_trim(const MD_CHAR* text, MD_SIZE size)
+{
+  MD_SIZE n = size;
+  MD_SIZE k;
+
+  while(n > 0) {
+
+    while(n > 0 && ISNEWLINE(text[n-1]))
+      n--;
+
+    /* trailing spaces of the last non-blank line are kept */
+    k = n;
+    while(k > 0 && ISBLANK(text[k-1]))
+      k--;
+
+    if(k > 0 && !ISNEWLINE(text[k-1]))
+      return n;
+
+    n = k;
+  }
+
+  return 0;
+}
+
+
+/******************************************
+ ***       Rendered chunks cache        ***
+ ******************************************/
+
+typedef struct MD_RTF_centry MD_RTF_CENTRY;
+
+/* Cache entry, allocated with chunk source text then rendered data */
+struct MD_RTF_centry {
+  MD_RTF_CENTRY*  next;       /* next entry in hash bucket */
+  MD_RTF_CENTRY*  lru_prev;   /* more recently used entry */
+  MD_RTF_CENTRY*  lru_next;   /* less recently used entry */
+  unsigned long long hash;
+  MD_SIZE         src_size;   /* source text size (MD_CHAR count) */
+  MD_SIZE         out_size;   /* rendered data size */
+  unsigned long   mem_size;   /* total allocated size */
+};
+
+struct MD_RTF_cache_tag {
+  MD_RTF_CENTRY** bucket;
+  unsigned long   bucket_count;  /* always a power of 2 */
+  MD_RTF_CENTRY*  lru_head;
+  MD_RTF_CENTRY*  lru_tail;
+  unsigned long   max_bytes;
+  MD_RTF_CACHE_STATS stats;
+};
+
+#define CENTRY_SRC(e)   ((const MD_CHAR*)((e) + 1))
+#define CENTRY_OUT(e)   ((const MD_RTF_DATA*)(CENTRY_SRC(e) + (e)->src_size))
+
+/* Fast 64-bit hash, processing input 8 bytes at once */
+static unsigned long long
+cache_hash(const void* data, size_t size, unsigned long long seed)
+{
+  const unsigned char* p = (const unsigned char*)data;
+  unsigned long long h = seed ^ (size * 0x9e3779b97f4a7c15ULL);
+  unsigned long long w;
+
+  #define HASH_MIX(h, w)  do { (h) ^= (w) * 0xff51afd7ed558ccdULL;          \
+                               (h) = ((h) << 31 | (h) >> 33);               \
+                               (h) *= 0xc4ceb9fe1a85ec53ULL; } while(0)
+
+  while(size >= 8) {
+    memcpy(&w, p, 8);
+    HASH_MIX(h, w);
+    p += 8;
+    size -= 8;
+  }
+
+  if(size) {
+    w = 0;
+    memcpy(&w, p, size);
+    HASH_MIX(h, w);
+  }
+
+  /* final avalanche */
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+static void
+cache_lru_unlink(MD_RTF_CACHE* c, MD_RTF_CENTRY* e)
+{
+  if(e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+  else c->lru_head = e->lru_next;
+  if(e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else c->lru_tail = e->lru_prev;
+}
+
+static void
+cache_lru_push(MD_RTF_CACHE* c, MD_RTF_CENTRY* e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = c->lru_head;
+  if(c->lru_head) c->lru_head->lru_prev = e;
+  else c->lru_tail = e;
+  c->lru_head = e;
+}
+
+static void
+cache_remove(MD_RTF_CACHE* c, MD_RTF_CENTRY* e)
+{
+  MD_RTF_CENTRY** pe = &c->bucket[e->hash & (c->bucket_count - 1)];
+
+  while(*pe != e)
+    pe = &(*pe)->next;
+  *pe = e->next;
+
+  cache_lru_unlink(c, e);
+
+  c->stats.entries--;
+  c->stats.bytes -= e->mem_size;
+
+  free(e);
+}
+
+static const MD_RTF_CENTRY*
+cache_lookup(MD_RTF_CACHE* c, unsigned long long hash,
+             const MD_CHAR* src, MD_SIZE src_size)
+{
+  MD_RTF_CENTRY* e = c->bucket[hash & (c->bucket_count - 1)];
+
+  while(e) {
+    if(e->hash == hash && e->src_size == src_size &&
+       memcmp(CENTRY_SRC(e), src, src_size * sizeof(MD_CHAR)) == 0) {
+      /* move to head of LRU list */
+      cache_lru_unlink(c, e);
+      cache_lru_push(c, e);
+      return e;
+    }
+    e = e->next;
+  }
+
+  return NULL;
+}
+
+static void
+cache_store(MD_RTF_CACHE* c, unsigned long long hash,
+            const MD_CHAR* src, MD_SIZE src_size,
+            const MD_RTF_DATA* out, MD_SIZE out_size)
+{
+  unsigned long mem_size = sizeof(MD_RTF_CENTRY) + src_size * sizeof(MD_CHAR) + out_size;
+
+  if(mem_size > c->max_bytes)
+    return;
+
+  /* evict least recently used entries to make room */
+  while(c->lru_tail && c->stats.bytes + mem_size > c->max_bytes) {
+    cache_remove(c, c->lru_tail);
+    c->stats.evictions++;
+  }
+
+  /* keep bucket count above entry count */
+  if(c->stats.entries >= c->bucket_count) {
+
+    unsigned long count = c->bucket_count * 2;
+    MD_RTF_CENTRY** bucket = (MD_RTF_CENTRY**)calloc(count, sizeof(MD_RTF_CENTRY*));
+
+    if(bucket) {
+      unsigned long i;
+      for(i = 0; i < c->bucket_count; ++i) {
+        MD_RTF_CENTRY* e = c->bucket[i];
+        while(e) {
+          MD_RTF_CENTRY* next = e->next;
+          e->next = bucket[e->hash & (count - 1)];
+          bucket[e->hash & (count - 1)] = e;
+          e = next;
+        }
+      }
+      free(c->bucket);
+      c->bucket = bucket;
+      c->bucket_count = count;
+    }
+  }
+
+  MD_RTF_CENTRY* e = (MD_RTF_CENTRY*)malloc(mem_size);
+  if(!e)
+    return;
+
+  e->hash = hash;
+  e->src_size = src_size;
+  e->out_size = out_size;
+  e->mem_size = mem_size;
+  memcpy((MD_CHAR*)(e + 1), src, src_size * sizeof(MD_CHAR));
+  if(out_size)
+    memcpy((MD_RTF_DATA*)CENTRY_OUT(e), out, out_size);
+
+  e->next = c->bucket[hash & (c->bucket_count - 1)];
+  c->bucket[hash & (c->bucket_count - 1)] = e;
+  cache_lru_push(c, e);
+
+  c->stats.entries++;
+  c->stats.bytes += mem_size;
+}
+
+MD_RTF_CACHE*
+md_rtf_cache_new(unsigned long max_bytes)
+{
+  MD_RTF_CACHE* c = (MD_RTF_CACHE*)calloc(1, sizeof(MD_RTF_CACHE));
+  if(!c)
+    return NULL;
+
+  c->bucket_count = 64;
+  c->bucket = (MD_RTF_CENTRY**)calloc(c->bucket_count, sizeof(MD_RTF_CENTRY*));
+  if(!c->bucket) {
+    free(c);
+    return NULL;
+  }
+
+  c->max_bytes = max_bytes;
+
+  return c;
+}
+
+void
+md_rtf_cache_free(MD_RTF_CACHE* cache)
+{
+  if(!cache)
+    return;
+
+  while(cache->lru_head)
+    cache_remove(cache, cache->lru_head);
+
+  free(cache->bucket);
+  free(cache);
+}
+
+void
+md_rtf_cache_stats(const MD_RTF_CACHE* cache, MD_RTF_CACHE_STATS* stats)
+{
+  *stats = cache->stats;
+}
+
+/* Render one chunk of document, copying it from cache when available. The
+last chunk of document is not trimmed since it may end within an unclosed
+code block, where trailing blank lines are part of content. */
+static int
+render_chunk(MD_RTF* r, const MD_PARSER* parser, MD_RTF_CACHE* c,
+             unsigned long long seed, const MD_CHAR* text, MD_SIZE size,
+             int last)
+{
+  int result;
+
+  if(!last)
+    size = chunk_trim(text, size);
+
+  if(size == 0)
+    return 0;
+
+  /* chunks copied from cache would miss offset map entries, plain text and
+  preview blocks count, and lists references to list table depend on previous
+  chunks */
+  if(!c || r->omap || r->text_output || r->list_tabl || r->prev_blks || r->prev_out ||
+     (r->flags & MD_RTF_FLAG_TOC))
+    return md_parse(text, size, parser, (void*)r);
+
+  unsigned long long hash = cache_hash(text, size * sizeof(MD_CHAR), seed);
+  const MD_RTF_CENTRY* e = cache_lookup(c, hash, text, size);
+
+  if(e) {
+    c->stats.hits++;
+    render_verbatim(r, (const MD_RTF_CHAR*)CENTRY_OUT(e), e->out_size);
+    render_flush_hint(r);
+    return r->status;
+  }
+
+  MD_RTF_BUFF capt = { NULL, 0, 0 };
+
+  c->stats.misses++;
+
+  r->capt = &capt;
+  result = md_parse(text, size, parser, (void*)r);
+
+  /* capture may have been dropped if memory allocation failed */
+  if(r->capt && result == 0)
+    cache_store(c, hash, text, size, capt.data, capt.size);
+
+  r->capt = NULL;
+  buff_free(&capt);
+
+  return result;
+}
+
+
+/******************************************
+ ***           Theme profiles           ***
+ ******************************************/
+
+/* Default colors, black, white, gray, blue, silver and dark gray */
+static const unsigned long g_theme_colors[MD_RTF_THEME_COLORS] = {
+  0x000000, 0xFFFFFF, 0xB4B4B4, 0x0066CC, 0xF0F0F0, 0x5A5A5A};
+
+/* Default syntax colors, dark blue, green, gray and blue */
+static const unsigned long g_theme_syntax_colors[MD_RTF_THEME_SYNTAX_COLORS] = {
+  0x0033B3, 0x067D17, 0x8C8C8C, 0x1750EB};
+
+/* Default headings font size factors, level 1 to 6 */
+static const float g_theme_head_scale[6] = {
+  2.2f, 1.7f, 1.4f, 1.2f, 1.1f, 1.0f};
+
+/* Write font table entry, skipping characters not allowed in font name */
+static void
+theme_font(MD_RTF_CHAR* dst, unsigned size, const char* cw, const char* name)
+{
+  unsigned n = sprintf(dst, "{%s ", cw);
+
+  for(; *name && n < size - 3; ++name) {
+    if(*name >= 0x20 && *name < 0x7F && strchr("\\{};", *name) == NULL)
+      dst[n++] = *name;
+  }
+
+  strcpy(dst + n, ";}");
+}
+
+static void
+theme_build(MD_RTF_THEME* t, const MD_RTF_THEME_DEF* def)
+{
+  const unsigned long* colr = def->colors ? def->colors : g_theme_colors;
+  const unsigned long* syn = def->syntax_colors ? def->syntax_colors : g_theme_syntax_colors;
+  const float* scale = def->head_scale ? def->head_scale : g_theme_head_scale;
+  float hs[6];
+  unsigned i;
+
+  memset(t, 0, sizeof(MD_RTF_THEME));
+
+  t->font_base = 2 * def->font_size; /* point to half-point */
+  t->page_width = 56.689f * def->doc_width; /* pixels to twips */
+  t->page_height = 1.41428f * t->page_width; /* ISO 216 ratio */
+  t->page_margin = 400; /* left and right margin */
+
+  /* fonts and colors tables entries */
+  theme_font(t->head_font[0], 80, "\\f0\\fswiss", def->font_norm ? def->font_norm : "Calibri");
+  theme_font(t->head_font[1], 80, "\\f1\\fmodern", def->font_mono ? def->font_mono : "Consolas");
+  theme_font(t->head_font[2], 80, "\\f2\\fnil", "Symbol");
+
+  strcpy(t->head_colr[0], ";"); /* auto */
+  for(i = 0; i < MD_RTF_THEME_COLORS + MD_RTF_THEME_SYNTAX_COLORS; ++i) {
+    unsigned long c = (i < MD_RTF_THEME_COLORS) ? colr[i] : syn[i - MD_RTF_THEME_COLORS];
+    sprintf(t->head_colr[i + 1], "\\red%u\\green%u\\blue%u;",
+            (unsigned)(c >> 16) & 0xFF, (unsigned)(c >> 8) & 0xFF, (unsigned)c & 0xFF);
+  }
+
+  /* whole document header, with all fonts and colors */
+  t->head_size = sprintf(t->head, "{\\rtf1\\ansi\\ansicpg1252\\deff0{\\fonttbl%s%s%s}",
+                         t->head_font[0], t->head_font[1], t->head_font[2]);
+
+  t->head_size += sprintf(t->head + t->head_size, "{\\colortbl;%s%s%s%s%s%s}",
+                          t->head_colr[1], t->head_colr[2], t->head_colr[3],
+                          t->head_colr[4], t->head_colr[5], t->head_colr[6]);
+
+  t->head_list = t->head_size;
+
+  /* same with syntax colors, color table closing brace is replaced */
+  memcpy(t->head_syn, t->head, t->head_list - 1);
+  t->head_syn_size = t->head_list - 1;
+  t->head_syn_size += sprintf(t->head_syn + t->head_syn_size, "%s%s%s%s}",
+                              t->head_colr[7], t->head_colr[8],
+                              t->head_colr[9], t->head_colr[10]);
+
+  t->head_size += sprintf(t->head + t->head_size,
+                          "{\\*\\generator MD4C-RTF}\\viewkind5"
+                          "\\paperw%u\\paperh%u"
+                          "\\margl%u\\margr%u\\margt%u\\margb%u"
+                          "\\uc0\r\n\\pard\\sb0\\sa0 ",
+                          t->page_width, t->page_height,
+                          t->page_margin, t->page_margin, t->page_margin, t->page_margin);
+
+  /* build preformated strings of control words with space and size
+  values according given font size and document width */
+
+  /* we clamp size in order to prevent buffer overflow due to large numbers
+  printed in template strings */
+  if(t->font_base > 98)
+    t->font_base = 98;
+
+  for(i = 0; i < 6; ++i) {
+    hs[i] = scale[i];
+    if(hs[i] < 0.5f) hs[i] = 0.5f;
+    if(hs[i] > 4.0f) hs[i] = 4.0f;
+  }
+
+  /* general font sizes */
+  sprintf(t->cw_fs[0], "\\fs%u ", t->font_base );
+  sprintf(t->cw_fs[1], "\\fs%u ", (unsigned)(0.9f*t->font_base) );
+
+  /* titles styles per level with font size and space-after values */
+  sprintf(t->cw_hf[0], "\\fs%u\\sa%u\\b ", (unsigned)(hs[0]*t->font_base), 8*t->font_base);
+  sprintf(t->cw_hf[1], "\\fs%u\\sa%u\\b ", (unsigned)(hs[1]*t->font_base), 8*t->font_base);
+  sprintf(t->cw_hf[2], "\\fs%u\\sa%u\\b ", (unsigned)(hs[2]*t->font_base), 8*t->font_base);
+  sprintf(t->cw_hf[3], "\\fs%u\\sa%u\\b\\i ", (unsigned)(hs[3]*t->font_base), 6*t->font_base);
+  sprintf(t->cw_hf[4], "\\fs%u\\sa%u\\b\\i ", (unsigned)(hs[4]*t->font_base), 6*t->font_base);
+  sprintf(t->cw_hf[5], "\\fs%u\\sa%u\\b\\i ", (unsigned)(hs[5]*t->font_base), 6*t->font_base);
+
+  /* space-before values */
+  sprintf(t->cw_sb[0], "\\sb%u ", 0*t->font_base);
+  sprintf(t->cw_sb[1], "\\sb%u ", 2*t->font_base);
+
+  /* space-after values */
+  sprintf(t->cw_sa[0], "\\sa%u ", 2*t->font_base);
+  sprintf(t->cw_sa[1], "\\sa%u ", 2*t->font_base);
+
+  /* left-ident values , up to 8 level */
+  for(i = 0; i < 8; ++i)
+    sprintf(t->cw_li[i], "\\li%u ", 20*(i+1)*t->font_base);
+
+  /* tables basic parameter and left margin */
+  unsigned g = 8*t->font_base;
+  if(g > 255) g = 255; //< \\tgrah value must be 0 to 255
+  sprintf(t->cw_tr[0], "\\trgaph%u\\trftsWidth2\\trwWidth4500\\trautofit1 ", g);
+  sprintf(t->cw_tr[1], "\\trgaph%u\\trrh%u\\trftsWidth2\\trwWidth4500\\trautofit1 ", 3*t->font_base, 16*t->font_base);
+
+  /* frist-line indent values, used for bulleted and numbered lists */
+  sprintf(t->cw_fi[0], "\\fi%i ", -10*(int)t->font_base);
+  sprintf(t->cw_fi[1], "\\fi%i ", -12*(int)t->font_base);
+
+  /* table cell width adjusted to given page width */
+  sprintf(t->cw_cx[0], "\\cellx%u ", (unsigned)(0.9f * t->page_width));
+  sprintf(t->cw_cx[1], "\\cellx%u ", t->page_width);
+
+  /* paragraph borders profile, right-indent to match width of cells */
+  sprintf(t->cw_ri, "\\ri%u ", t->page_width - (unsigned)(0.9f * t->page_width));
+
+  /* quote and block code paragraph borders, border spacing as cells gap */
+  sprintf(t->cw_pb[0], "\\brdrl\\brdrs\\brdrw70\\brdrcf3\\brsp%u ", g);
+  sprintf(t->cw_pb[1], "\\brdrt\\brdrs\\brdrw1\\brdrcf5\\brsp%u"  /* invisible border */
+                       "\\brdrb\\brdrs\\brdrw1\\brdrcf5\\brsp%u"  /* invisible border */
+                       "\\brdrl\\brdrs\\brdrw70\\brdrcf3\\brsp%u"
+                       "\\cbpat5 ", 2*t->font_base, 2*t->font_base, g);
+}
+
+MD_RTF_THEME*
+md_rtf_theme_new(const MD_RTF_THEME_DEF* def)
+{
+  MD_RTF_THEME* t = (MD_RTF_THEME*)malloc(sizeof(MD_RTF_THEME));
+  if(!t)
+    return NULL;
+
+  theme_build(t, def);
+
+  /* hash field is still zero */
+  t->hash = cache_hash(t, sizeof(MD_RTF_THEME), 1);
+
+  return t;
+}
+
+void
+md_rtf_theme_free(MD_RTF_THEME* theme)
+{
+  free(theme);
+}
+
+
+/******************************************
+ ***       Incremental rendering        ***
+ ******************************************/
+
+static int
+block_map_push(MD_RTF_BLOCK_MAP* map, MD_OFFSET src_off, MD_SIZE src_size,
+               MD_SIZE out_off, MD_SIZE out_size)
+{
+  if(map->count == map->cap) {
+
+    unsigned cap = map->cap ? map->cap * 2 : 64;
+    MD_RTF_BLOCK* blocks = (MD_RTF_BLOCK*)realloc(map->blocks, cap * sizeof(MD_RTF_BLOCK));
+    if(!blocks)
+      return -1;
+
+    map->blocks = blocks;
+    map->cap = cap;
+  }
+
+  map->blocks[map->count].src_off = src_off;
+  map->blocks[map->count].src_size = src_size;
+  map->blocks[map->count].out_off = out_off;
+  map->blocks[map->count].out_size = out_size;
+  map->count++;
+
+  return 0;
+}
+
+/* Move chunks from the given output offset, after data inserted before them */
+static void
+block_map_shift(MD_RTF_BLOCK_MAP* map, MD_SIZE out_off, MD_SIZE size)
+{
+  unsigned i;
+
+  if(size == 0)
+    return;
+
+  for(i = 0; i < map->count; ++i) {
+    if(map->blocks[i].out_off >= out_off)
+      map->blocks[i].out_off += size;
+  }
+}
+
+void
+md_rtf_block_map_free(MD_RTF_BLOCK_MAP* map)
+{
+  free(map->blocks);
+  map->blocks = NULL;
+  map->count = 0;
+  map->cap = 0;
+  map->out_size = 0;
+}
+
+/* Returns index of the block which contains the given source offset */
+static unsigned
+block_map_find(const MD_RTF_BLOCK_MAP* map, MD_OFFSET off)
+{
+  unsigned lo = 0;
+  unsigned hi = map->count;
+
+  /* binary search of the last block starting at or before offset */
+  while(hi - lo > 1) {
+    unsigned mid = (lo + hi) / 2;
+    if(map->blocks[mid].src_off <= off) lo = mid;
+    else hi = mid;
+  }
+
+  return lo;
+}
+
+/* Render input range chunk by chunk, filling the optional block map. If the
+range cannot be split it is rendered as a single chunk. */
+static int
+render_chunks(MD_RTF* r, const MD_PARSER* parser, const MD_RTF_OPTS* opts,
+              unsigned long long seed, const MD_CHAR* input,
+              MD_OFFSET beg, MD_OFFSET end, int split, MD_RTF_BLOCK_MAP* map)
+{
+  int result = 0;
+
+  while(beg < end) {
+
+    MD_OFFSET next = split ? chunk_next(input, end, beg) : end;
+    MD_SIZE out_off = r->out_size;
+
+    result = render_chunk(r, parser, opts->cache, seed, input + beg, next - beg,
+                          next == end);
+    if(result != 0)
+      break;
+
+    if(map && block_map_push(map, beg, next - beg, out_off, r->out_size - out_off) != 0)
+      return -1;
+
+    beg = next;
+  }
+
+  return result;
+}
+
+static void
+render_init(MD_RTF* r, MD_PARSER* parser,
+            void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
+            void* userdata, unsigned parser_flags, unsigned renderer_flags,
+            const MD_RTF_OPTS* opts)
+{
+  r->process_output = process_output;
+  r->userdata = userdata;
+  r->flags = renderer_flags;
+  r->sink = opts->sink;
+  r->status = 0;
+  r->blk_dpth = 0;
+  r->lim_out = opts->max_output;
+  r->lim_dpth = opts->max_depth;
+  r->lim_cell = opts->max_cells;
+  r->lim_step = opts->max_steps;
+  r->nest_dpth = 0;
+  r->tabl_ncel = 0;
+  r->step = 0;
+  r->prev_blks = opts->preview_blocks;
+  r->prev_out = opts->preview_output;
+  r->prev_count = 0;
+  r->prev_stop = 0;
+  r->text_output = opts->text_output;
+  r->text_userdata = opts->text_userdata;
+  r->plain_nl = 0;
+  r->plain_any = 0;
+  r->plain_bol = 1;
+  r->plain_mark = 0;
+  r->plain_cell = 0;
+  r->capt = NULL;
+  r->chunked = 0;
+  r->out_size = 0;
+  r->list = NULL;
+  r->list_cap = 0;
+  r->list_dpth = -1;
+ // r->list_stop = 0;
+  r->list_para = 0;
+  r->list_rset = 0;
+  r->list_tabl = 0;
+  r->list_used = 0;
+  memset(&r->list_ovr, 0, sizeof(MD_RTF_BUFF));
+  r->list_nols = 0;
+  r->list_next = 0;
+  r->head_font = HEAD_FONT_ALL;
+  r->head_colr = HEAD_COLR_ALL;
+  if(renderer_flags & MD_RTF_FLAG_HIGHLIGHT)
+    r->head_colr |= HEAD_COLR_SYNTAX;
+  r->code_lf = 0;
+  r->code_blck = 0;
+  r->code_tab = opts->tab_size < 16 ? opts->tab_size : 16;
+  r->code_col = 0;
+  r->code_ind = 0;
+  r->code_rows = opts->code_rows;
+  r->code_line = 0;
+  r->code_beg = NULL;
+  r->code_end = NULL;
+  r->code_lang = NULL;
+  r->code_hl = HL_STATE_CODE;
+  r->code_kw_lang = NULL;
+  r->quot_blck = 0;
+  r->quot_dpth = 0;
+  r->toc_hold = 0;
+  r->toc_head = 0;
+  r->toc_text = 0;
+  r->toc_fail = 0;
+  r->toc_count = 0;
+  r->toc_beg = 0;
+  r->toc_size = 0;
+  memset(&r->toc, 0, sizeof(MD_RTF_BUFF));
+  memset(&r->toc_body, 0, sizeof(MD_RTF_BUFF));
+  r->tabl_cols = 0;
+  r->tabl_head = 0;
+  r->tabl_layo = opts->table_layout;
+  r->tabl_nrow = 0;
+  if(r->tabl_layo == MD_RTF_TABLE_SAMPLE)
+    r->tabl_nrow = opts->table_sample ? opts->table_sample : MD_RTF_TABLE_SAMPLE_ROWS;
+  r->tabl_buff = NULL;
+  memset(&r->tabl_data, 0, sizeof(MD_RTF_BUFF));
+  memset(&r->tabl_rowv, 0, sizeof(MD_RTF_BUFF));
+  memset(r->tabl_pfx, 0, sizeof(r->tabl_pfx));
+  r->tabl_wmin = NULL;
+  r->tabl_wmax = NULL;
+  r->tabl_meas = 0;
+
+  r->src = NULL;
+  r->src_size = 0;
+  r->omap = opts->offset_map;
+  r->omap_pos = 0;
+  r->omap_pend = 0;
+  r->trace = opts->trace;
+
+  parser->abi_version = 0;
+  parser->flags = parser_flags;
+  parser->enter_block = enter_block_callback;
+  parser->leave_block = leave_block_callback;
+  parser->enter_span = enter_span_callback;
+  parser->leave_span = leave_span_callback;
+  parser->text = text_callback;
+  parser->debug_log = debug_log_callback;
+  parser->syntax = NULL;
+
+  if(r->omap) {
+    r->omap->count = 0;
+    parser->enter_block = omap_enter_block_callback;
+    parser->leave_block = omap_leave_block_callback;
+    parser->enter_span = omap_enter_span_callback;
+    parser->leave_span = omap_leave_span_callback;
+    parser->text = omap_text_callback;
+  }
+
+  if(r->trace) {
+    r->trace_next = *parser;
+    parser->enter_block = trace_enter_block_callback;
+    parser->leave_block = trace_leave_block_callback;
+    parser->enter_span = trace_enter_span_callback;
+    parser->leave_span = trace_leave_span_callback;
+  }
+
+  /* Build map of characters which need escaping. */
+  for(unsigned i = 0; i < 256; i++) {
+
+      unsigned char ch = (unsigned char)i;
+
+      r->escape_map[i] = 0;
+
+      if(strchr("\\{}\n", ch) != NULL || ch > 0x7F)
+          r->escape_map[i] |= NEED_RTF_ESC_FLAG|NEED_PRE_ESC_FLAG|NEED_CODE_ESC_FLAG;
+
+      /* block code may span several lines and expand tabs */
+      if(ch == '\r' || (ch == '\t' && r->code_tab))
+          r->escape_map[i] |= NEED_CODE_ESC_FLAG;
+
+      if(!ISALNUM(ch)  &&  strchr("~-_.+!*(),%#@?=;:/,+$", ch) == NULL)
+          r->escape_map[i] |= NEED_URL_ESC_FLAG;
+  }
+
+  /* prebuilt theme, or default one built for this render */
+  if(opts->theme) {
+    r->thm = opts->theme;
+  } else {
+    MD_RTF_THEME_DEF def;
+    memset(&def, 0, sizeof(def));
+    def.font_size = opts->font_size;
+    def.doc_width = opts->doc_width;
+    theme_build(&r->thm_own, &def);
+    r->thm = &r->thm_own;
+  }
+}
+
+/* Returns size of the UTF-8 byte order mark (BOM) to skip, if any. */
+static MD_SIZE
+render_bom_size(const MD_CHAR* input, MD_SIZE input_size, unsigned renderer_flags)
+{
+  if(renderer_flags & MD_RTF_FLAG_SKIP_UTF8_BOM && sizeof(MD_CHAR) == 1) {
+
+    static const MD_CHAR bom[3] = { 0xef, 0xbb, 0xbf };
+
+    if(input_size >= sizeof(bom)  &&  memcmp(input, bom, sizeof(bom)) == 0)
+      return sizeof(bom);
+  }
+
+  return 0;
+}
+
+/* Hash of rendering profile, used as cache key seed */
+static unsigned long long
+render_profile_hash(unsigned parser_flags, unsigned renderer_flags,
+                    const MD_RTF_OPTS* opts)
+{
+  unsigned prof[10];
+  prof[0] = parser_flags;
+  prof[1] = renderer_flags;
+  prof[2] = opts->font_size;
+  prof[3] = opts->doc_width;
+  prof[4] = opts->table_layout;
+  prof[5] = opts->table_sample;
+  /* chunks render may fail with these limits, not with output and steps
+  limits which apply to the whole document */
+  prof[6] = opts->max_depth;
+  prof[7] = opts->max_cells;
+  prof[8] = opts->tab_size;
+  prof[9] = opts->code_rows;
+
+  /* font size and document width are those of theme, if any */
+  return cache_hash(prof, sizeof(prof), opts->theme ? opts->theme->hash : 0);
+}
+
+/* Setup for render of a whole document, shared by all render paths: renderer
+state, UTF-8 byte order mark (BOM) skip, and scan of lists, fonts and colors
+unless scan is zero (then copied from another render). If split is given, it
+is set when the document can be rendered by chunks. Returns source offset of
+the first byte to parse. */
+static MD_OFFSET
+render_setup(MD_RTF* r, MD_PARSER* parser, const MD_CHAR* input, MD_SIZE input_size,
+             void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
+             void* userdata, unsigned parser_flags, unsigned renderer_flags,
+             const MD_RTF_OPTS* opts, int scan, int* split)
+{
+  if(opts->trace)
+    trace_event(opts->trace, TRACE_SETUP, 0, 'B', 0);
+
+  render_init(r, parser, process_output, userdata,
+              parser_flags, renderer_flags, opts);
+
+  r->src = input;
+  r->src_size = input_size;
+
+  if(opts->block_map)
+    opts->block_map->count = 0;
+
+  /* Consider skipping UTF-8 byte order mark (BOM). */
+  MD_OFFSET beg = render_bom_size(input, input_size, renderer_flags);
+
+  /* lists, fonts and colors must be known before header is written */
+  if(scan && (renderer_flags & (MD_RTF_FLAG_LIST_TABLE|MD_RTF_FLAG_MINIMAL_HEADER)))
+    render_scan(r, parser, input + beg, input_size - beg);
+
+  /* chunks can be rendered separately only if there is no link reference
+  definitions, otherwise the document is rendered as a single chunk */
+  if(split)
+    *split = !chunk_may_have_refs(input + beg, input_size - beg);
+
+  if(opts->trace)
+    trace_event(opts->trace, TRACE_SETUP, 0, 'E', 0);
+
+  return beg;
+}
+
+
+int md_rtf(const MD_CHAR* input, MD_SIZE input_size,
+            void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
+            void* userdata, unsigned parser_flags, unsigned renderer_flags,
+            unsigned font_size, unsigned doc_width)
+{
+  MD_RTF_OPTS opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.font_size = font_size;
+  opts.doc_width = doc_width;
+
+  return md_rtf_ex(input, input_size, process_output, userdata,
+                   parser_flags, renderer_flags, &opts);
+}
+
+int md_rtf_ex(const MD_CHAR* input, MD_SIZE input_size,
+              void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
+              void* userdata, unsigned parser_flags, unsigned renderer_flags,
+              const MD_RTF_OPTS* opts)
+{
+  MD_RTF render;
+  MD_PARSER parser;
+  int result;
+  int split;
+
+  /* simple case, the whole document is parsed at once, unless a preview is
+  asked so the parse of chunks stops with the preview */
+  int chunked = opts->cache || opts->block_map ||
+                opts->preview_blocks || opts->preview_output;
+
+  MD_OFFSET beg = render_setup(&render, &parser, input, input_size,
+                               process_output, userdata, parser_flags,
+                               renderer_flags, opts, 1, chunked ? &split : NULL);
+
+  if(!chunked) {
+    result = md_parse(input + beg, input_size - beg, &parser, (void*)&render);
+    render_table_free(&render);
+    render_list_free(&render);
+    render_toc_free(&render);
+    return result;
+  }
+
+  unsigned long long seed = render_profile_hash(parser_flags, renderer_flags, opts);
+
+  render_enter_block_doc(&render);
+
+  render.chunked = 1;
+  result = render_chunks(&render, &parser, opts, seed, input, beg, input_size,
+                         split, opts->block_map);
+  render.chunked = 0;
+
+  render_table_free(&render);
+  render_list_free(&render);
+
+  /* preview ends as a whole document */
+  if(render.prev_stop && render.status == 0)
+    result = 0;
+
+  if(result == 0) {
+    render_leave_block_doc(&render);
+    result = render.status;
+  }
+
+  render_toc_free(&render);
+
+  if(opts->block_map) {
+    /* chunks are after table of contents */
+    block_map_shift(opts->block_map, render.toc_beg, render.toc_size);
+    opts->block_map->out_size = render.out_size;
+    /* invalid map must not be used for update, nor partial map of preview */
+    if(result != 0 || render.prev_stop)
+      opts->block_map->count = 0;
+  }
+
+  return result;
+}
+
+int md_rtf_update(const MD_CHAR* input, MD_SIZE input_size,
+                  MD_OFFSET edit_off, MD_SIZE edit_old, MD_SIZE edit_new,
+                  void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
+                  void* userdata, unsigned parser_flags, unsigned renderer_flags,
+                  const MD_RTF_OPTS* opts, MD_RTF_SPLICE* splice)
+{
+  MD_RTF_BLOCK_MAP* map = opts->block_map;
+  MD_RTF_BLOCK_MAP part = { NULL, 0, 0, 0 };
+  MD_RTF render;
+  MD_PARSER parser;
+  int result;
+
+  if(!map)
+    return -1;
+
+  /* source size before edit */
+  MD_SIZE old_size = map->count ? map->blocks[map->count-1].src_off +
+                                  map->blocks[map->count-1].src_size : 0;
+
+  /* we need a valid map and an edit within the mapped source, offset map,
+  plain text, preview, list table, minimal header and table of contents can
+  only be produced by a whole render */
+  if(opts->offset_map || opts->text_output ||
+     opts->preview_blocks || opts->preview_output ||
+     (renderer_flags & (MD_RTF_FLAG_LIST_TABLE|MD_RTF_FLAG_MINIMAL_HEADER|MD_RTF_FLAG_TOC)) ||
+     map->count == 0 || edit_off < map->blocks[0].src_off ||
+     edit_off + edit_old > old_size ||
+     input_size + edit_old != old_size + edit_new)
+    goto full_render;
+
+  /* blocks which contain the edit, extended by one block on both sides so
+  the region boundaries are not modified by the edit */
+  unsigned a = block_map_find(map, edit_off);
+  unsigned b = block_map_find(map, edit_off + edit_old);
+
+  if(a > 0) a--;
+  if(b + 1 < map->count) b++;
+
+  MD_OFFSET beg = map->blocks[a].src_off;
+  MD_OFFSET end = map->blocks[b].src_off + map->blocks[b].src_size - edit_old + edit_new;
+
+  int split = !chunk_may_have_refs(input + beg, end - beg);
+
+  /* new link reference definitions affect the whole document */
+  if(!split && (a > 0 || b + 1 < map->count))
+    goto full_render;
+
+  render_init(&render, &parser, process_output, userdata,
+              parser_flags, renderer_flags, opts);
+
+  render.src = input;
+  render.src_size = input_size;
+
+  unsigned long long seed = render_profile_hash(parser_flags, renderer_flags, opts);
+
+  render.chunked = 1;
+  render.out_size = map->blocks[a].out_off;
+
+  result = 0;
+
+  while(beg < end) {
+
+    MD_OFFSET next = split ? chunk_next(input, input_size, beg) : end;
+
+    /* the edit may have removed a boundary (e.g. by opening a code fence),
+    following blocks are then included to the region */
+    while(next > end && b + 1 < map->count) {
+      b++;
+      end = map->blocks[b].src_off + map->blocks[b].src_size - edit_old + edit_new;
+    }
+
+    MD_SIZE out_off = render.out_size;
+
+    result = render_chunk(&render, &parser, opts->cache, seed, input + beg,
+                          next - beg, next == input_size);
+    if(result != 0)
+      break;
+
+    if(block_map_push(&part, beg, next - beg, out_off, render.out_size - out_off) != 0) {
+      result = -1;
+      break;
+    }
+
+    beg = next;
+  }
+
+  render_table_free(&render);
+  render_list_free(&render);
+
+  if(result != 0) {
+    md_rtf_block_map_free(&part);
+    map->count = 0;
+    return result;
+  }
+
+  /* replace updated blocks in map and shift the following ones */
+  MD_SIZE out_beg = map->blocks[a].out_off;
+  MD_SIZE out_end = map->blocks[b].out_off + map->blocks[b].out_size;
+  unsigned count = map->count - (b - a + 1) + part.count;
+
+  if(count > map->cap) {
+    MD_RTF_BLOCK* blocks = (MD_RTF_BLOCK*)realloc(map->blocks, count * sizeof(MD_RTF_BLOCK));
+    if(!blocks) {
+      md_rtf_block_map_free(&part);
+      map->count = 0;
+      return -1;
+    }
+    map->blocks = blocks;
+    map->cap = count;
+  }
+
+  memmove(map->blocks + a + part.count, map->blocks + b + 1,
+          (map->count - b - 1) * sizeof(MD_RTF_BLOCK));
+  if(part.count)
+    memcpy(map->blocks + a, part.blocks, part.count * sizeof(MD_RTF_BLOCK));
+
+  splice->offset = out_beg;
+  splice->removed = out_end - out_beg;
+  splice->inserted = render.out_size - out_beg;
+
+  for(unsigned i = a + part.count; i < count; ++i) {
+    map->blocks[i].src_off = map->blocks[i].src_off - edit_old + edit_new;
+    map->blocks[i].out_off = map->blocks[i].out_off - splice->removed + splice->inserted;
+  }
+
+  map->count = count;
+  map->out_size = map->out_size - splice->removed + splice->inserted;
+
+  md_rtf_block_map_free(&part);
+
+  return 0;
+
+full_render:
+
+  splice->offset = 0;
+  splice->removed = map->out_size;
+
+  result = md_rtf_ex(input, input_size, process_output, userdata,
+                     parser_flags, renderer_flags, opts);
+
+  splice->inserted = map->out_size;
+
+  return result;
+}
+
+
+/******************************************
+ ***          Pull rendering            ***
+ ******************************************/
+
+struct MD_RTF_reader_tag {
+  MD_RTF          render;
+  MD_PARSER       parser;
+  MD_RTF_OPTS     opts;
+  const MD_CHAR*  input;
+  MD_SIZE         input_size;
+  MD_OFFSET       beg;        /* source offset of next chunk */
+  int             split;      /* document can be split in chunks */
+  unsigned long long seed;    /* cache key seed */
+  MD_RTF_BUFF     pend;       /* rendered data not read yet */
+  MD_SIZE         pend_off;   /* offset of data to read in pend */
+  int             state;      /* MD_RTF_READER_XXX */
+  int             result;     /* render result, once ended */
+};
+
+#define MD_RTF_READER_HEAD    0   /* document header to render */
+#define MD_RTF_READER_BODY    1   /* chunks to render */
+#define MD_RTF_READER_DONE    2   /* whole document rendered */
+
+static void
+reader_output(const MD_RTF_DATA* data, MD_SIZE size, void* userdata)
+{
+  MD_RTF_READER* rd = (MD_RTF_READER*)userdata;
+
+  /* data is lost, render is stopped at end of current chunk */
+  if(buff_append(&rd->pend, data, size) != 0)
+    rd->result = -1;
+}
+
+/* Render the next step of document: header, one chunk or footer */
+static void
+reader_step(MD_RTF_READER* rd)
+{
+  MD_RTF* r = &rd->render;
+
+  /* output was lost, render cannot go on */
+  if(rd->result != 0) {
+    rd->state = MD_RTF_READER_DONE;
+    return;
+  }
+
+  if(rd->state == MD_RTF_READER_HEAD) {
+    render_enter_block_doc(r);
+    r->chunked = 1;
+    rd->state = MD_RTF_READER_BODY;
+    return;
+  }
+
+  if(rd->beg < rd->input_size) {
+
+    MD_OFFSET next = rd->split ? chunk_next(rd->input, rd->input_size, rd->beg)
+                               : rd->input_size;
+    MD_SIZE out_off = r->out_size;
+
+    int result = render_chunk(r, &rd->parser, rd->opts.cache, rd->seed,
+                              rd->input + rd->beg, next - rd->beg,
+                              next == rd->input_size);
+
+    /* preview complete, next step writes the footer */
+    if(r->prev_stop && r->status == 0) {
+      if(rd->opts.block_map)
+        rd->opts.block_map->count = 0;
+      rd->beg = rd->input_size;
+      return;
+    }
+
+    if(result != 0)
+      rd->result = result;
+
+    if(rd->opts.block_map && rd->result == 0 &&
+       block_map_push(rd->opts.block_map, rd->beg, next - rd->beg,
+                      out_off, r->out_size - out_off) != 0)
+      rd->result = -1;
+
+    rd->beg = next;
+
+    if(rd->result != 0) {
+      if(rd->opts.block_map)
+        rd->opts.block_map->count = 0;
+      rd->state = MD_RTF_READER_DONE;
+    }
+    return;
+  }
+
+  r->chunked = 0;
+  render_table_free(r);
+  render_leave_block_doc(r);
+
+  /* footer or table of contents may hit the output limit */
+  if(r->status != 0)
+    rd->result = r->status;
+
+  if(rd->opts.block_map) {
+    block_map_shift(rd->opts.block_map, r->toc_beg, r->toc_size);
+    rd->opts.block_map->out_size = r->out_size;
+    /* invalid map must not be used for update */
+    if(rd->result != 0)
+      rd->opts.block_map->count = 0;
+  }
+
+  rd->state = MD_RTF_READER_DONE;
+}
+
+MD_RTF_READER*
+md_rtf_open(const MD_CHAR* input, MD_SIZE input_size,
+            unsigned parser_flags, unsigned renderer_flags,
+            const MD_RTF_OPTS* opts)
+{
+  MD_RTF_READER* rd = (MD_RTF_READER*)malloc(sizeof(MD_RTF_READER));
+  if(!rd)
+    return NULL;
+
+  rd->opts = *opts;
+  rd->opts.sink = NULL; /* output is read, not sent */
+
+  rd->input = input;
+  rd->input_size = input_size;
+  rd->seed = render_profile_hash(parser_flags, renderer_flags, opts);
+
+  memset(&rd->pend, 0, sizeof(MD_RTF_BUFF));
+  rd->pend_off = 0;
+  rd->state = MD_RTF_READER_HEAD;
+  rd->result = 0;
+
+  rd->beg = render_setup(&rd->render, &rd->parser, input, input_size,
+                         reader_output, rd, parser_flags, renderer_flags,
+                         &rd->opts, 1, &rd->split);
+
+  return rd;
+}
+
+int
+md_rtf_read(MD_RTF_READER* rd, MD_RTF_DATA* buf, MD_SIZE cap, MD_SIZE* size)
+{
+  *size = 0;
+
+  while(*size < cap) {
+
+    /* render more only when all rendered data was read, so pending data
+    never exceeds the output of one chunk */
+    if(rd->pend_off == rd->pend.size) {
+
+      rd->pend.size = 0;
+      rd->pend_off = 0;
+
+      if(rd->state == MD_RTF_READER_DONE)
+        break;
+
+      reader_step(rd);
+      continue;
+    }
+
+    MD_SIZE n = rd->pend.size - rd->pend_off;
+    if(n > cap - *size)
+      n = cap - *size;
+
+    memcpy(buf + *size, rd->pend.data + rd->pend_off, n);
+    rd->pend_off += n;
+    *size += n;
+  }
+
+  /* remaining data of a failed render is still readable */
+  return (*size == 0) ? rd->result : 0;
+}
+
+void
+md_rtf_close(MD_RTF_READER* rd)
+{
+  if(!rd)
+    return;
+
+  render_table_free(&rd->render);
+  render_list_free(&rd->render);
+  render_toc_free(&rd->render);
+  buff_free(&rd->pend);
+  free(rd);
+}
+
+
+/******************************************
+ ***         Fan-out rendering          ***
+ ******************************************/
+
+typedef struct MD_RTF_fanout_tag {
+  MD_RTF          render;
+  MD_PARSER       parser;     /* renderer callbacks */
+  unsigned        done;       /* render stopped or preview complete */
+} MD_RTF_FANOUT;
+
+typedef struct MD_RTF_multi_tag {
+  MD_RTF_FANOUT*  fanout;
+  MD_RTF_TARGET*  targets;
+  unsigned        count;
+  unsigned        alive;      /* count of renders not stopped */
+  int             status;     /* status of the last stopped render */
+} MD_RTF_MULTI;
+
+/* Keep result of a render callback, a stopped render no longer receives
+callbacks and the parse is aborted once all renders are stopped. A render
+whose preview is complete is ended as a whole document, without error. */
 static inline void
-render_leave_span_code(MD_RTF* r)
+multi_result(MD_RTF_MULTI* m, unsigned i, int result)
 {
-  render_font_norm(r);
-
-  /* parser eat space after code span, we add it */
-  render_verbatim(r, " ", 1);
+  if(result != 0) {
+    MD_RTF* r = &m->fanout[i].render;
+    if(r->prev_stop && r->status == 0) {
+      render_leave_block_doc(r);
+      if(r->status != 0)
+        m->targets[i].result = r->status;
+    } else {
+      m->targets[i].result = result;
+    }
+    m->fanout[i].done = 1;
+    m->status = result;
+    m->alive--;
+  }
 }
 
+static int
+multi_enter_block(MD_BLOCKTYPE type, void* detail, void* userdata)
+{
+  MD_RTF_MULTI* m = (MD_RTF_MULTI*) userdata;
 
+  for(unsigned i = 0; i < m->count; ++i) {
+    if(!m->fanout[i].done) {
+      MD_RTF_FANOUT* f = &m->fanout[i];
+      multi_result(m, i, f->parser.enter_block(type, detail, &f->render));
+    }
+  }
 
-
-
-/***************************************
- ***   RTF renderer implementation   ***
- ***************************************/
+  return m->alive ? 0 : m->status;
+}
 
 static int
-enter_block_callback(MD_BLOCKTYPE type, void* detail, void* userdata)
+multi_leave_block(MD_BLOCKTYPE type, void* detail, void* userdata)
 {
-  MD_RTF* r = (MD_RTF*) userdata;
+  MD_RTF_MULTI* m = (MD_RTF_MULTI*) userdata;
 
-  switch(type) {
-      case MD_BLOCK_DOC:      render_enter_block_doc(r); break;
-      case MD_BLOCK_QUOTE:    render_enter_block_quote(r); break;
-      case MD_BLOCK_UL:       render_enter_block_ul(r, (const MD_BLOCK_UL_DETAIL*)detail); break;
-      case MD_BLOCK_OL:       render_enter_block_ol(r, (const MD_BLOCK_OL_DETAIL*)detail); break;
-      case MD_BLOCK_LI:       render_enter_block_li(r, (const MD_BLOCK_LI_DETAIL*)detail); break;
-      case MD_BLOCK_HR:       render_enter_block_hr(r); break;
-      case MD_BLOCK_H:        render_enter_block_h(r, (const MD_BLOCK_H_DETAIL*)detail); break;
-      case MD_BLOCK_CODE:     render_enter_block_code(r); break;
-      case MD_BLOCK_P:        render_enter_block_p(r); break;
-      case MD_BLOCK_HTML:     /* noop */ break;
-      case MD_BLOCK_TABLE:    render_enter_block_table(r, (const MD_BLOCK_TABLE_DETAIL*)detail); break;
-      case MD_BLOCK_THEAD:    render_enter_block_thead(r); break;
-      case MD_BLOCK_TBODY:    /* noop */ break;
-      case MD_BLOCK_TR:       render_enter_block_tr(r); break;
-      case MD_BLOCK_TH:       render_enter_block_th(r,(const MD_BLOCK_TD_DETAIL*)detail); break;
-      case MD_BLOCK_TD:       render_enter_block_td(r,(const MD_BLOCK_TD_DETAIL*)detail); break;
+  for(unsigned i = 0; i < m->count; ++i) {
+    if(!m->fanout[i].done) {
+      MD_RTF_FANOUT* f = &m->fanout[i];
+      multi_result(m, i, f->parser.leave_block(type, detail, &f->render));
+    }
   }
 
-  return 0;
+  return m->alive ? 0 : m->status;
 }
 
 static int
-leave_block_callback(MD_BLOCKTYPE type, void* detail, void* userdata)
+multi_enter_span(MD_SPANTYPE type, void* detail, void* userdata)
 {
-  MD_RTF* r = (MD_RTF*) userdata;
+  MD_RTF_MULTI* m = (MD_RTF_MULTI*) userdata;
 
-  switch(type) {
-      case MD_BLOCK_DOC:      render_leave_block_doc(r); break;
-      case MD_BLOCK_QUOTE:    render_leave_block_quote(r); break;
-      case MD_BLOCK_UL:       render_leave_block_ul(r); break;
-      case MD_BLOCK_OL:       render_leave_block_ol(r); break;
-      case MD_BLOCK_LI:       render_leave_block_li(r); break;
-      case MD_BLOCK_HR:       /*noop*/ break;
-      case MD_BLOCK_H:        render_leave_block_h(r, (const MD_BLOCK_H_DETAIL*)detail); break;
-      case MD_BLOCK_CODE:     render_leave_block_code(r); break;
-      case MD_BLOCK_P:        render_leave_block_p(r); break;
-      case MD_BLOCK_HTML:     /* noop */ break;
-      case MD_BLOCK_TABLE:    render_leave_block_table(r); break;
-      case MD_BLOCK_THEAD:    render_leave_block_thead(r); break;
-      case MD_BLOCK_TBODY:    /* noop */ break;
-      case MD_BLOCK_TR:       render_leave_block_tr(r); break;
-      case MD_BLOCK_TH:       render_leave_block_th(r); break;
-      case MD_BLOCK_TD:       render_leave_block_td(r); break;
+  for(unsigned i = 0; i < m->count; ++i) {
+    if(!m->fanout[i].done) {
+      MD_RTF_FANOUT* f = &m->fanout[i];
+      multi_result(m, i, f->parser.enter_span(type, detail, &f->render));
+    }
   }
 
-  return 0;
+  return m->alive ? 0 : m->status;
 }
 
 static int
-enter_span_callback(MD_SPANTYPE type, void* detail, void* userdata)
+multi_leave_span(MD_SPANTYPE type, void* detail, void* userdata)
 {
-  MD_RTF* r = (MD_RTF*) userdata;
+  MD_RTF_MULTI* m = (MD_RTF_MULTI*) userdata;
 
-  switch(type) {
-      case MD_SPAN_EM:                render_verbatim(r, "\\i ", 3); break;
-      case MD_SPAN_STRONG:            render_verbatim(r, "\\b ", 3); break;
-      case MD_SPAN_U:                 render_verbatim(r, "\\ul ", 4); break;
-      case MD_SPAN_DEL:               render_verbatim(r, "\\strike ", 8); break;
-      case MD_SPAN_A:                 render_enter_span_url(r, (MD_SPAN_A_DETAIL*) detail); break;
-      case MD_SPAN_CODE:              render_enter_span_code(r); break;
-      //case MD_SPAN_IMG:               render_open_img_span(r, (MD_SPAN_IMG_DETAIL*) detail); break;
-      //case MD_SPAN_LATEXMATH:         RENDER_VERBATIM(r, "<x-equation>"); break;
-      //case MD_SPAN_LATEXMATH_DISPLAY: RENDER_VERBATIM(r, "<x-equation type=\"display\">"); break;
-      //case MD_SPAN_WIKILINK:          render_open_wikilink_span(r, (MD_SPAN_WIKILINK_DETAIL*) detail); break;
+  for(unsigned i = 0; i < m->count; ++i) {
+    if(!m->fanout[i].done) {
+      MD_RTF_FANOUT* f = &m->fanout[i];
+      multi_result(m, i, f->parser.leave_span(type, detail, &f->render));
+    }
   }
 
-  return 0;
+  return m->alive ? 0 : m->status;
 }
 
 static int
-leave_span_callback(MD_SPANTYPE type, void* detail, void* userdata)
+multi_text(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size, void* userdata)
 {
-  MD_RTF* r = (MD_RTF*) userdata;
+  MD_RTF_MULTI* m = (MD_RTF_MULTI*) userdata;
 
-  switch(type) {
-      case MD_SPAN_EM:                render_verbatim(r, "\\i0 ", 4); break;
-      case MD_SPAN_STRONG:            render_verbatim(r, "\\b0 ", 4); break;
-      case MD_SPAN_U:                 render_verbatim(r, "\\ul0 ", 5); break;
-      case MD_SPAN_DEL:               render_verbatim(r, "\\strike0 ", 9); break;
-      case MD_SPAN_A:                 render_leave_span_url(r); break;
-      case MD_SPAN_CODE:              render_leave_span_code(r); break;
-      //case MD_SPAN_IMG:               /*noop, handled above*/ break;
-      //case MD_SPAN_LATEXMATH:         /*fall through*/
-      //case MD_SPAN_LATEXMATH_DISPLAY: RENDER_VERBATIM(r, "</x-equation>"); break;
-      //case MD_SPAN_WIKILINK:          RENDER_VERBATIM(r, "</x-wikilink>"); break;
+  for(unsigned i = 0; i < m->count; ++i) {
+    if(!m->fanout[i].done) {
+      MD_RTF_FANOUT* f = &m->fanout[i];
+      multi_result(m, i, f->parser.text(type, text, size, &f->render));
+    }
   }
 
-  return 0;
+  return m->alive ? 0 : m->status;
 }
 
-#ifdef MD4C_USE_UTF16
-static int
-text_callback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size, void* userdata)
+static void
+multi_debug_log(const char* msg, void* userdata)
 {
-  MD_RTF* r = (MD_RTF*) userdata;
+  MD_RTF_MULTI* m = (MD_RTF_MULTI*) userdata;
 
-  #ifdef _DEBUG
-  printf_tabs(2, r->list_dpth);
-  printf("++ text_callback (");
-  switch(type) {
-    case MD_TEXT_NULLCHAR: printf("MD_TEXT_NULLCHAR)\n"); break;
-    case MD_TEXT_BR:  printf("MD_TEXT_BR)\n"); break;
-    case MD_TEXT_SOFTBR:  printf("MD_TEXT_SOFTBR)\n"); break;
-    case MD_TEXT_CODE: printf("MD_TEXT_CODE)\n"); break;
-    case MD_TEXT_HTML:  printf("MD_TEXT_HTML)\n"); break;
-    case MD_TEXT_ENTITY: printf("MD_TEXT_ENTITY)\n"); break;
-    default: printf("NORMAL)\n"); break;
+  debug_log_callback(msg, &m->fanout[0].render);
+}
+
+int
+md_rtf_multi(const MD_CHAR* input, MD_SIZE input_size,
+             unsigned parser_flags, unsigned renderer_flags,
+             MD_RTF_TARGET* targets, unsigned count)
+{
+  MD_RTF_MULTI multi;
+  MD_PARSER parser;
+  unsigned i;
+
+  if(count == 0)
+    return 0;
+
+  multi.fanout = (MD_RTF_FANOUT*)malloc(count * sizeof(MD_RTF_FANOUT));
+  if(!multi.fanout)
+    return -1;
+
+  multi.targets = targets;
+  multi.count = count;
+  multi.alive = count;
+  multi.status = 0;
+
+  MD_OFFSET beg = 0;
+
+  /* the document is parsed once as a whole, lists, fonts and colors are
+  found by the first render, then given to others */
+  for(i = 0; i < count; ++i) {
+
+    beg = render_setup(&multi.fanout[i].render, &multi.fanout[i].parser,
+                       input, input_size, targets[i].process_output,
+                       targets[i].userdata, parser_flags, renderer_flags,
+                       targets[i].opts, i == 0, NULL);
+
+    multi.fanout[i].done = 0;
+    targets[i].result = 0;
   }
-  #endif
 
-  switch(type) {
-      case MD_TEXT_NULLCHAR:  render_verbatim(r, "\0", 1); break;
-      case MD_TEXT_BR:        render_verbatim(r, "\\line1", 6); break;
-      case MD_TEXT_SOFTBR:    render_verbatim(r, " ", 1); break;
-      case MD_TEXT_CODE:      render_wchar(r, text, size, render_text_code); break;
-      case MD_TEXT_HTML:      render_wchar(r, text, size, render_rtf_escaped); break;
-      case MD_TEXT_ENTITY:    render_wchar(r, text, size, render_entity); break;
-      default:                render_wchar(r, text, size, render_rtf_escaped); break;
+  if(renderer_flags & (MD_RTF_FLAG_LIST_TABLE|MD_RTF_FLAG_MINIMAL_HEADER)) {
+
+    MD_RTF* r0 = &multi.fanout[0].render;
+
+    for(i = 1; i < count; ++i) {
+      MD_RTF* r = &multi.fanout[i].render;
+      r->head_font = r0->head_font;
+      r->head_colr = r0->head_colr;
+      r->list_used = r0->list_used;
+      r->list_nols = r0->list_nols;
+      r->list_tabl = r0->list_tabl &&
+                     buff_append(&r->list_ovr, r0->list_ovr.data, r0->list_ovr.size) == 0;
+      if(!r->list_tabl) {
+        r->list_used = 0;
+        r->list_nols = 0;
+      }
+    }
+  }
+
+  parser = multi.fanout[0].parser;
+  parser.enter_block = multi_enter_block;
+  parser.leave_block = multi_leave_block;
+  parser.enter_span = multi_enter_span;
+  parser.leave_span = multi_leave_span;
+  parser.text = multi_text;
+  parser.debug_log = multi_debug_log;
+
+  int result = md_parse(input + beg, input_size - beg, &parser, (void*)&multi);
+
+  for(i = 0; i < count; ++i) {
+    /* parse failed by itself, not by a render */
+    if(result != 0 && !multi.fanout[i].done)
+      targets[i].result = result;
+    render_table_free(&multi.fanout[i].render);
+    render_list_free(&multi.fanout[i].render);
+    render_toc_free(&multi.fanout[i].render);
+  }
+
+  free(multi.fanout);
+
+  /* first failed render, if any */
+  for(i = 0; i < count; ++i) {
+    if(targets[i].result != 0)
+      return targets[i].result;
   }
+
   return 0;
 }
-#else
-static int
-text_callback(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size, void* userdata)
+
+
+/******************************************
+ ***          Output validation         ***
+ ******************************************/
+
+/* Streaming check of RTF structure, data is given in pieces of any size and
+control words may be cut between them. Plain text is skipped eight bytes at
+a time, control words found whole in data are read by a tight loop and only
+those cut at end of data go through the state machine. Control words are
+only compared when their length and first letter match a checked one.
+
+Table rows repeat the same row definition, most of table output: the last
+checked one is kept, and a row definition of the same bytes is only compared
+to it, its words being then known as valid with the same \cellx count. */
+
+#define VALID_TEXT    0   /* plain text */
+#define VALID_ESC     1   /* after backslash */
+#define VALID_WORD    2   /* control word letters */
+#define VALID_SIGN    3   /* control word parameter sign */
+#define VALID_PARM    4   /* control word parameter digits */
+#define VALID_HEX1    5   /* first hex digit of \'xx */
+#define VALID_HEX2    6   /* second hex digit of \'xx */
+#define VALID_BIN     7   /* binary data of \binN */
+#define VALID_DONE    8   /* after document group */
+
+#define VALID_WORD_MAX    32  /* max control word letters */
+#define VALID_PARM_MAX    10  /* max control word parameter digits */
+#define VALID_ROWD_MAX    4096 /* max kept row definition size */
+
+/* Next parameter value with the given digit, saturated */
+#define VALID_PARM_NEXT(parm, ch) \
+  (((parm) < 0x10000000UL) ? (parm) * 10 + ((ch) - '0') : 0xFFFFFFFFUL)
+
+/* First letters of checked control words, by word length */
+#define VALID_FIRST(ch)     (1UL << ((ch) - 'a'))
+
+static const unsigned long g_valid_first[6] = {
+  0,
+  VALID_FIRST('u'),                     /* u */
+  0,
+  VALID_FIRST('r') | VALID_FIRST('b'),  /* row, bin */
+  VALID_FIRST('c'),                     /* cell */
+  VALID_FIRST('c') | VALID_FIRST('t')}; /* cellx, trowd */
+
+struct MD_RTF_validator_tag {
+  void            (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*);
+  void*           userdata;
+  int             status;     /* first error, MD_RTF_INVALID_XXX */
+  MD_SIZE         error_off;  /* output offset of first error */
+  MD_SIZE         off;        /* output offset of data being checked */
+  unsigned long   depth;      /* groups depth */
+  unsigned        started;    /* first control word was seen */
+  unsigned        state;      /* VALID_XXX */
+  char            word[8];    /* first letters of current control word */
+  unsigned        word_len;
+  unsigned        parm_len;   /* parameter digits count */
+  unsigned        parm_neg;   /* parameter is negative */
+  unsigned long   parm;       /* parameter value, saturated */
+  unsigned long   bin;        /* binary data bytes left */
+  unsigned        cellx;      /* cells of current row definition */
+  unsigned        cell;       /* cells written in current row */
+  unsigned        rowd_len;   /* size of last row definition, 0 if none */
+  unsigned        rowd_cellx; /* its \cellx count */
+  unsigned        rowd_spc;   /* it ends by a space delimiter */
+  char            rowd_next;  /* otherwise, byte which ended it */
+  char            rowd[VALID_ROWD_MAX];
+};
+
+/* Class of ASCII characters */
+#define VALID_CC_STOP       0x1   /* ends plain text */
+#define VALID_CC_ALPHA      0x2
+#define VALID_CC_DIGIT      0x4
+
+static const unsigned char g_valid_cc[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,   /*  !"#$%&'()*+,-./ */
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0,   /* 0123456789:;<=>? */
+  0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,   /* @ABCDEFGHIJKLMNO */
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 0, 1, 0, 0, 0,   /* PQRSTUVWXYZ[\]^_ */
+  0, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,   /* `abcdefghijklmno */
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 0, 1, 0, 0,   /* pqrstuvwxyz{|}~  */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+#define VALID_CC(ch)        g_valid_cc[(unsigned char)(ch)]
+
+/* Whether any byte of a 64-bit word equals the given byte */
+#define VALID_ONES          0x0101010101010101ULL
+#define VALID_HAS(x, ch)    ((((x) ^ (VALID_ONES * (ch))) - VALID_ONES) & \
+                             ~((x) ^ (VALID_ONES * (ch))) & (VALID_ONES << 7))
+
+/* Skip plain text, returns position of next byte which ends it or end */
+static inline const MD_RTF_DATA*
+valid_skip(const MD_RTF_DATA* p, const MD_RTF_DATA* end)
 {
-  MD_RTF* r = (MD_RTF*) userdata;
+  unsigned long long x;
 
-  #ifdef _DEBUG
-  printf_tabs(2, r->list_dpth);
-  printf("++ text_callback (");
-  switch(type) {
-    case MD_TEXT_NULLCHAR: printf("MD_TEXT_NULLCHAR)\n"); break;
-    case MD_TEXT_BR:  printf("MD_TEXT_BR)\n"); break;
-    case MD_TEXT_SOFTBR:  printf("MD_TEXT_SOFTBR)\n"); break;
-    case MD_TEXT_CODE: printf("MD_TEXT_CODE)\n"); break;
-    case MD_TEXT_HTML:  printf("MD_TEXT_HTML)\n"); break;
-    case MD_TEXT_ENTITY: printf("MD_TEXT_ENTITY)\n"); break;
-    default: printf("NORMAL)\n"); break;
+  /* control words often follow each other */
+  if(p < end && (VALID_CC(*p) & VALID_CC_STOP))
+    return p;
+
+  while(end - p >= 8) {
+    memcpy(&x, p, 8);
+    if(VALID_HAS(x, '\\') | VALID_HAS(x, '{') | VALID_HAS(x, '}'))
+      break;
+    p += 8;
   }
-  #endif
 
-  switch(type) {
-      case MD_TEXT_NULLCHAR:  render_verbatim(r, "\0", 1); break;
-      case MD_TEXT_BR:        render_verbatim(r, "\\line1", 6); break;
-      case MD_TEXT_SOFTBR:    render_verbatim(r, " ", 1); break;
-      case MD_TEXT_CODE:      render_text_code(r, text, size); break;
-      case MD_TEXT_HTML:      render_rtf_escaped(r, text, size); break;
-      case MD_TEXT_ENTITY:    render_entity(r, text, size); break;
-      default:                render_rtf_escaped(r, text, size); break;
+  while(p < end && !(VALID_CC(*p) & VALID_CC_STOP))
+    p++;
+
+  return p;
+}
+
+static inline void
+valid_fail(MD_RTF_VALIDATOR* v, int status, MD_SIZE off)
+{
+  if(v->status == 0) {
+    v->status = status;
+    v->error_off = off;
   }
-  return 0;
 }
-#endif
 
+/* Check the control word just ended, of given letters and parameter */
 static void
-debug_log_callback(const char* msg, void* userdata)
+valid_word(MD_RTF_VALIDATOR* v, const char* w, unsigned len,
+           unsigned long parm, unsigned parm_len, unsigned parm_neg, MD_SIZE off)
 {
-  MD_RTF* r = (MD_RTF*) userdata;
-  if(r->flags & MD_RTF_FLAG_DEBUG)
-      fprintf(stderr, "MD4C: %s\n", msg);
+  /* document must start with {\rtfN */
+  if(!v->started) {
+    v->started = 1;
+    if(v->depth != 1 || len != 3 || memcmp(w, "rtf", 3) != 0)
+      valid_fail(v, MD_RTF_INVALID_GROUP, off);
+  }
+
+  /* row definition stays in effect for following rows until next \trowd */
+  switch(len) {
+    case 1:
+      /* signed 16-bit values, or code points written as is */
+      if(w[0] == 'u' && (parm_len == 0 || (parm_neg ? parm > 32768 : parm > 0x10FFFF)))
+        valid_fail(v, MD_RTF_INVALID_UNICODE, off);
+      break;
+    case 3:
+      if(w[0] == 'r' && w[1] == 'o' && w[2] == 'w') {
+        if(v->cell == 0 || v->cell != v->cellx)
+          valid_fail(v, MD_RTF_INVALID_TABLE, off);
+        v->cell = 0;
+      } else if(w[0] == 'b' && w[1] == 'i' && w[2] == 'n') {
+        v->bin = parm_neg ? 0 : parm;
+      }
+      break;
+    case 4:
+      if(w[0] == 'c' && memcmp(w, "cell", 4) == 0 && ++v->cell > v->cellx)
+        valid_fail(v, MD_RTF_INVALID_TABLE, off);
+      break;
+    case 5:
+      if(w[0] == 'c' && memcmp(w, "cellx", 5) == 0)
+        v->cellx++;
+      else if(w[0] == 't' && memcmp(w, "trowd", 5) == 0)
+        v->cellx = 0;
+      break;
+  }
 }
 
+/* Check the control word just ended, most words are none of the checked ones
+and are only filtered by length and first letter */
+static inline void
+valid_check(MD_RTF_VALIDATOR* v, const char* w, unsigned len,
+            unsigned long parm, unsigned parm_len, unsigned parm_neg, MD_SIZE off)
+{
+  if(v->started && (len >= sizeof(g_valid_first) / sizeof(g_valid_first[0]) ||
+     !(g_valid_first[len] & (1UL << (((unsigned char)w[0] - 'a') & 31)))))
+    return;
 
-int md_rtf(const MD_CHAR* input, MD_SIZE input_size,
-            void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
-            void* userdata, unsigned parser_flags, unsigned renderer_flags,
-            unsigned font_size, unsigned doc_width)
+  valid_word(v, w, len, parm, parm_len, parm_neg, off);
+}
+
+/* Check a control word found whole in data, from its first letter, returns
+the position after it or NULL if it reaches the end of data. Errors are found
+at the same offsets as by the state machine. */
+static inline const MD_RTF_DATA*
+valid_word_fast(MD_RTF_VALIDATOR* v, const MD_RTF_DATA* data,
+                const MD_RTF_DATA* p, const MD_RTF_DATA* end)
 {
-  MD_RTF render;
-  render.process_output = process_output;
-  render.userdata = userdata;
-  render.flags = renderer_flags;
-  render.font_base = 2 * font_size; /* point to half-point */
-  render.page_width = 56.689f * doc_width; /* pixels to twips */
-  render.page_height = 1.41428f * render.page_width; /* ISO 216 ratio */
-  render.page_margin = 400; /* left and right margin */
-  render.list_dpth = -1;
- // render.list_stop = 0;
-  render.list_para = 0;
-  render.list_rset = 0;
-  render.code_lf = 0;
-  render.quot_blck = 0;
-
-  MD_PARSER parser = {
-      0,
-      parser_flags,
-      enter_block_callback,
-      leave_block_callback,
-      enter_span_callback,
-      leave_span_callback,
-      text_callback,
-      debug_log_callback,
-      NULL
-  };
+  const MD_RTF_DATA* w = p;
+  const MD_RTF_DATA* d;
+  unsigned long parm = 0;
+  unsigned len, parm_len, parm_neg;
+
+  while(p < end && (VALID_CC(*p) & VALID_CC_ALPHA))
+    p++;
+
+  len = (unsigned)(p - w);
+  parm_neg = (p < end && *p == '-');
+  if(parm_neg)
+    p++;
+
+  d = p;
+  /* digit is not read once saturated, so no side effect in the argument */
+  while(p < end && (VALID_CC(*p) & VALID_CC_DIGIT)) {
+    parm = VALID_PARM_NEXT(parm, *p);
+    p++;
+  }
 
-  /* Build map of characters which need escaping. */
-  for(unsigned i = 0; i < 256; i++) {
+  if(p == end)
+    return NULL;
 
-      unsigned char ch = (unsigned char)i;
+  parm_len = (unsigned)(p - d);
 
-      render.escape_map[i] = 0;
+  if(len > VALID_WORD_MAX)
+    valid_fail(v, MD_RTF_INVALID_WORD, v->off + (MD_SIZE)(w + VALID_WORD_MAX - data));
+  else if(parm_neg && parm_len == 0)
+    valid_fail(v, MD_RTF_INVALID_WORD, v->off + (MD_SIZE)(d - data));
+  else if(parm_len > VALID_PARM_MAX)
+    valid_fail(v, MD_RTF_INVALID_WORD, v->off + (MD_SIZE)(d + VALID_PARM_MAX - data));
+  else
+    valid_check(v, (const char*)w, len, parm, parm_len, parm_neg, v->off + (MD_SIZE)(p - data));
 
-      if(strchr("\\{}\n", ch) != NULL || ch > 0x7F)
-          render.escape_map[i] |= NEED_RTF_ESC_FLAG|NEED_PRE_ESC_FLAG;
+  /* space delimiter is part of control word */
+  return (*p == ' ') ? p + 1 : p;
+}
 
-      if(!ISALNUM(ch)  &&  strchr("~-_.+!*(),%#@?=;:/,+$", ch) == NULL)
-          render.escape_map[i] |= NEED_URL_ESC_FLAG;
+/* Check control words from backslash of \trowd up to the first one which is
+not part of a row definition (or to anything else), returns the position
+after them. The row definition, up to its last \cellx or end of data, is only
+compared if it is the same as the last one, otherwise its words are checked
+then it is kept (also if longer than the last one, which may have been cut by
+end of data). */
+static const MD_RTF_DATA*
+valid_rowd(MD_RTF_VALIDATOR* v, const MD_RTF_DATA* data,
+           const MD_RTF_DATA* p, const MD_RTF_DATA* end)
+{
+  const MD_RTF_DATA* q = p;
+  const MD_RTF_DATA* rowd = NULL;   /* end of last \cellx */
+  const MD_RTF_DATA* w;
+  MD_SIZE len = v->rowd_len;
+
+  if(len && (MD_SIZE)(end - p) >= len + !v->rowd_spc && memcmp(p, v->rowd, len) == 0 &&
+     (v->rowd_spc || p[len] == v->rowd_next)) {
+    v->cellx = v->rowd_cellx;
+    q = p + len;
+    rowd = q;
+  } else {
+    len = 0;
   }
 
-  /* Consider skipping UTF-8 byte order mark (BOM). */
-  if(renderer_flags & MD_RTF_FLAG_SKIP_UTF8_BOM && sizeof(MD_CHAR) == 1) {
+  while(end - q > 1 && *q == '\\' && (VALID_CC(q[1]) & VALID_CC_ALPHA)) {
 
-    static const MD_CHAR bom[3] = { 0xef, 0xbb, 0xbf };
+    unsigned cellx;
+
+    /* words checked for other than syntax end it, but \cellx and the
+    first \trowd */
+    for(w = q + 1; w < end && (VALID_CC(*w) & VALID_CC_ALPHA); w++);
+    cellx = (w - q == 6 && memcmp(q + 1, "cellx", 5) == 0);
+    if(q > p && !cellx && w - q - 1 < (long)(sizeof(g_valid_first) / sizeof(g_valid_first[0])) &&
+       (g_valid_first[w - q - 1] & (1UL << (((unsigned char)q[1] - 'a') & 31))))
+      break;
 
-    if(input_size >= sizeof(bom)  &&  memcmp(input, bom, sizeof(bom)) == 0) {
-      input += sizeof(bom);
-      input_size -= sizeof(bom);
+    /* a word cut by end of data ends it, the row definition may go on */
+    w = valid_word_fast(v, data, q + 1, end);
+    if(!w) {
+      if(q > p)
+        rowd = q;
+      break;
     }
+    if(v->status != 0)
+      return w;
+    q = w;
+    if(cellx)
+      rowd = q;
   }
 
-  /* build preformated strings of control words with space and size
-  values according given font size and document width */
+  if(rowd && (MD_SIZE)(rowd - p) > len && rowd - p <= VALID_ROWD_MAX &&
+     (rowd < end || rowd[-1] == ' ')) {
+    memcpy(v->rowd, p, (size_t)(rowd - p));
+    v->rowd_len = (unsigned)(rowd - p);
+    v->rowd_cellx = v->cellx;
+    v->rowd_spc = (rowd[-1] == ' ');
+    v->rowd_next = v->rowd_spc ? 0 : (char)*rowd;
+  }
 
-  /* we clamp size in order to prevent buffer overflow due to large numbers
-  printed in template strings */
-  if(render.font_base > 98)
-    render.font_base = 98;
+  return q;
+}
 
-  /* general font sizes */
-  sprintf(render.cw_fs[0], "\\fs%u ", render.font_base );
-  sprintf(render.cw_fs[1], "\\fs%u ", (unsigned)(0.9f*render.font_base) );
+MD_RTF_VALIDATOR*
+md_rtf_validator_new(void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
+                     void* userdata)
+{
+  MD_RTF_VALIDATOR* v = (MD_RTF_VALIDATOR*)malloc(sizeof(MD_RTF_VALIDATOR));
+  if(!v)
+    return NULL;
 
-  /* titles styles per level with font size and space-after values */
-  sprintf(render.cw_hf[0], "\\fs%u\\sa%u\\b ", (unsigned)(2.2f*render.font_base), 8*render.font_base);
-  sprintf(render.cw_hf[1], "\\fs%u\\sa%u\\b ", (unsigned)(1.7f*render.font_base), 8*render.font_base);
-  sprintf(render.cw_hf[2], "\\fs%u\\sa%u\\b ", (unsigned)(1.4f*render.font_base), 8*render.font_base);
-  sprintf(render.cw_hf[3], "\\fs%u\\sa%u\\b\\i ", (unsigned)(1.2f*render.font_base), 6*render.font_base);
-  sprintf(render.cw_hf[4], "\\fs%u\\sa%u\\b\\i ", (unsigned)(1.1f*render.font_base), 6*render.font_base);
-  sprintf(render.cw_hf[5], "\\fs%u\\sa%u\\b\\i ", (unsigned)(render.font_base), 6*render.font_base);
+  memset(v, 0, sizeof(MD_RTF_VALIDATOR));
+  v->process_output = process_output;
+  v->userdata = userdata;
+  v->state = VALID_TEXT;
 
-  /* space-before values */
-  sprintf(render.cw_sb[0], "\\sb%u ", 0*render.font_base);
-  sprintf(render.cw_sb[1], "\\sb%u ", 2*render.font_base);
+  return v;
+}
 
-  /* space-after values */
-  sprintf(render.cw_sa[0], "\\sa%u ", 2*render.font_base);
-  sprintf(render.cw_sa[1], "\\sa%u ", 2*render.font_base);
+void
+md_rtf_validator_free(MD_RTF_VALIDATOR* validator)
+{
+  free(validator);
+}
 
-  /* left-ident values , up to 8 level */
-  sprintf(render.cw_li[0], "\\li%u ",  20*render.font_base);
-  sprintf(render.cw_li[1], "\\li%u ",  40*render.font_base);
-  sprintf(render.cw_li[2], "\\li%u ",  60*render.font_base);
-  sprintf(render.cw_li[3], "\\li%u ",  80*render.font_base);
-  sprintf(render.cw_li[4], "\\li%u ", 100*render.font_base);
-  sprintf(render.cw_li[5], "\\li%u ", 120*render.font_base);
-  sprintf(render.cw_li[6], "\\li%u ", 140*render.font_base);
-  sprintf(render.cw_li[7], "\\li%u ", 160*render.font_base);
+void
+md_rtf_validate(const MD_RTF_DATA* data, MD_SIZE size, void* validator)
+{
+  MD_RTF_VALIDATOR* v = (MD_RTF_VALIDATOR*)validator;
+  const MD_RTF_DATA* p = data;
+  const MD_RTF_DATA* end = data + size;
 
-  /* tables basic parameter and left margin */
-  unsigned g = 8*render.font_base;
-  if(g > 255) g = 255; //< \\tgrah value must be 0 to 255
-  sprintf(render.cw_tr[0], "\\trgaph%u\\trftsWidth2\\trwWidth4500\\trautofit1 ", g);
-  sprintf(render.cw_tr[1], "\\trgaph%u\\trrh%u\\trftsWidth2\\trwWidth4500\\trautofit1 ", 3*render.font_base, 16*render.font_base);
+  if(v->process_output)
+    v->process_output(data, size, v->userdata);
 
-  /* frist-line indent values, used for bulleted and numbered lists */
-  sprintf(render.cw_fi[0], "\\fi%i ", -10*render.font_base);
-  sprintf(render.cw_fi[1], "\\fi%i ", -12*render.font_base);
+  /* nothing more to learn once invalid */
+  if(v->status != 0) {
+    v->off += size;
+    return;
+  }
 
-  /* table cell width adjusted to given page width */
-  sprintf(render.cw_cx[0], "\\cellx%u ", (unsigned)(0.9f * render.page_width));
-  sprintf(render.cw_cx[1], "\\cellx%u ", render.page_width);
+  while(p < end) {
+
+    MD_RTF_DATA ch = *p;
+
+    switch(v->state) {
+
+      case VALID_TEXT:
+        /* stay here while in text, groups and whole control words */
+        for(;;) {
+          p = valid_skip(p, end);
+          if(p == end)
+            break;
+          ch = *p;
+          if(ch == '\\') {
+            /* most control words are whole in data */
+            if(p + 1 < end && (VALID_CC(p[1]) & VALID_CC_ALPHA)) {
+              const MD_RTF_DATA* q;
+              if(p[1] == 't' && end - p > 6 && memcmp(p + 2, "rowd", 4) == 0 &&
+                 !(VALID_CC(p[6]) & VALID_CC_ALPHA) && v->started) {
+                q = valid_rowd(v, data, p, end);
+                if(q != p) {
+                  p = q;
+                  if(v->status == 0)
+                    continue;
+                  break;
+                }
+              }
+              q = valid_word_fast(v, data, p + 1, end);
+              if(q) {
+                p = q;
+                if(v->bin == 0 && v->status == 0)
+                  continue;
+                if(v->bin)
+                  v->state = VALID_BIN;
+                p--;  /* stepped again below */
+                break;
+              }
+            }
+            v->state = VALID_ESC;
+            break;
+          }
+          if(ch == '{') {
+            v->depth++;
+          } else if(v->depth == 0) {
+            valid_fail(v, MD_RTF_INVALID_GROUP, v->off + (MD_SIZE)(p - data));
+            break;
+          } else if(--v->depth == 0) {
+            v->state = VALID_DONE;
+            break;
+          }
+          p++;
+        }
+        if(p == end)
+          continue;
+        break;
 
-  int result = md_parse(input, input_size, &parser, (void*)&render);
+      case VALID_ESC:
+        if(VALID_CC(ch) & VALID_CC_ALPHA) {
+          v->word[0] = (char)ch;
+          v->word_len = 1;
+          v->parm_len = 0;
+          v->parm_neg = 0;
+          v->parm = 0;
+          v->state = VALID_WORD;
+        } else if(ch == '\'') {
+          v->state = VALID_HEX1;
+        } else if((VALID_CC(ch) & VALID_CC_DIGIT) || (ch < 0x20 && ch != '\r' && ch != '\n') || ch > 0x7E) {
+          valid_fail(v, MD_RTF_INVALID_WORD, v->off + (MD_SIZE)(p - data));
+        } else {
+          v->state = VALID_TEXT;
+        }
+        break;
 
-  return result;
+      case VALID_WORD:
+        if(VALID_CC(ch) & VALID_CC_ALPHA) {
+          if(v->word_len < sizeof(v->word))
+            v->word[v->word_len] = (char)ch;
+          if(++v->word_len > VALID_WORD_MAX)
+            valid_fail(v, MD_RTF_INVALID_WORD, v->off + (MD_SIZE)(p - data));
+          break;
+        }
+        if(ch == '-') {
+          v->parm_neg = 1;
+          v->state = VALID_SIGN;
+          break;
+        }
+        /* fall through */
+      case VALID_SIGN:
+      case VALID_PARM:
+        if(VALID_CC(ch) & VALID_CC_DIGIT) {
+          if(++v->parm_len > VALID_PARM_MAX)
+            valid_fail(v, MD_RTF_INVALID_WORD, v->off + (MD_SIZE)(p - data));
+          v->parm = VALID_PARM_NEXT(v->parm, ch);
+          v->state = VALID_PARM;
+          break;
+        }
+        if(v->state == VALID_SIGN) {
+          valid_fail(v, MD_RTF_INVALID_WORD, v->off + (MD_SIZE)(p - data));
+          break;
+        }
+        valid_check(v, v->word, v->word_len < sizeof(v->word) ? v->word_len : 0,
+                   v->parm, v->parm_len, v->parm_neg, v->off + (MD_SIZE)(p - data));
+        v->state = v->bin ? VALID_BIN : VALID_TEXT;
+        /* space delimiter is part of control word, anything else is
+        checked again as text */
+        if(ch != ' ')
+          continue;
+        break;
+
+      case VALID_HEX1:
+      case VALID_HEX2:
+        if(!ISXDIGIT(ch))
+          valid_fail(v, MD_RTF_INVALID_WORD, v->off + (MD_SIZE)(p - data));
+        v->state = (v->state == VALID_HEX1) ? VALID_HEX2 : VALID_TEXT;
+        break;
+
+      case VALID_BIN:
+        if((MD_SIZE)(end - p) < v->bin) {
+          v->bin -= (MD_SIZE)(end - p);
+          p = end;
+          continue;
+        }
+        p += v->bin;
+        v->bin = 0;
+        v->state = VALID_TEXT;
+        continue;
+
+      default: /* VALID_DONE */
+        if(ch != '\r' && ch != '\n' && ch != ' ' && ch != '\0')
+          valid_fail(v, MD_RTF_INVALID_GROUP, v->off + (MD_SIZE)(p - data));
+        break;
+    }
+
+    if(v->status != 0)
+      break;
+
+    p++;
+  }
+
+  v->off += size;
+}
+
+int
+md_rtf_validator_end(MD_RTF_VALIDATOR* validator, MD_SIZE* error_off)
+{
+  MD_RTF_VALIDATOR* v = validator;
+
+  /* a control word may end the data */
+  if(v->state == VALID_WORD || v->state == VALID_PARM) {
+    valid_check(v, v->word, v->word_len < sizeof(v->word) ? v->word_len : 0,
+               v->parm, v->parm_len, v->parm_neg, v->off);
+    v->state = VALID_TEXT;
+  }
+
+  if(v->state != VALID_DONE) {
+    if(v->state != VALID_TEXT)
+      valid_fail(v, MD_RTF_INVALID_WORD, v->off);
+    else
+      valid_fail(v, MD_RTF_INVALID_GROUP, v->off);
+  } else if(v->cell) {
+    valid_fail(v, MD_RTF_INVALID_TABLE, v->off);
+  }
+
+  if(error_off)
+    *error_off = v->error_off;
+
+  return v->status;
 }
@@ -50,12 +50,363 @@ typedef char MD_RTF_CHAR;
 #define MD_RTF_FLAG_DEBUG                   0x0001
 #define MD_RTF_FLAG_VERBATIM_ENTITIES       0x0002
 #define MD_RTF_FLAG_SKIP_UTF8_BOM           0x0004
+/* If set, lists are numbered through a list table written once in document
+header, list paragraphs only refer to it (\lsN) instead of carrying their own
+numbering (\pn). The document is parsed twice, first to find lists, chunks
+cache is not used and md_rtf_update() renders the whole document. */
+#define MD_RTF_FLAG_LIST_TABLE              0x0008
+/* If set, non-ASCII characters of the CP1252 codepage (declared in document
+header) are written in the short \'xx form, other ones as \uN. */
+#define MD_RTF_FLAG_ANSI_CP1252             0x0010
+/* If set, document header only declares fonts and colors used by the body,
+which makes small documents much smaller. The document is parsed twice, first
+to find used fonts and colors, and md_rtf_update() renders the whole document. */
+#define MD_RTF_FLAG_MINIMAL_HEADER          0x0020
+/* If set, fenced code blocks of C/C++, Python, JSON, shell and SQL (named by
+the fence info) are rendered with syntax highlighting: keywords, strings,
+comments and numbers are colored with the syntax colors of theme. */
+#define MD_RTF_FLAG_HIGHLIGHT               0x0040
+/* If set, horizontal rules, quotes and block code are drawn with paragraph
+borders, shading and indents instead of one cell tables, and nested quotes
+are flattened to increasing indents. Output is smaller and much faster to lay
+out by modern viewers, but Rich Edit 4.1 (older WordPad) does not display
+paragraph borders properly. */
+#define MD_RTF_FLAG_PARA_BORDERS            0x0080
+/* If set, a table of contents with links to headings is written at top of
+document, headings are enclosed in bookmarks (_toc1, _toc2, ...). Since
+headings are known at end of document, the body output is held in memory
+until then, chunks cache is not used and md_rtf_update() renders the whole
+document. */
+#define MD_RTF_FLAG_TOC                     0x0100
+
+/* Cache of rendered top-level blocks.
+
+When a cache is given to md_rtf_ex(), the input is cut into independent
+top-level chunks (at blank lines which cannot continue a previous block) and
+each chunk is looked up by a hash of its source text and of the rendering
+profile (parser flags, renderer flags, font size and document width). A chunk
+found in cache is copied as-is to output without being parsed nor rendered.
+
+Memory is bounded by the max_bytes given at creation, least recently used
+chunks are evicted first. A cache is not thread-safe, it must not be shared
+by concurrent renders. */
+typedef struct MD_RTF_cache_tag MD_RTF_CACHE;
+
+typedef struct MD_RTF_cache_stats_tag {
+  unsigned long hits;       /* chunks copied from cache */
+  unsigned long misses;     /* chunks parsed and rendered */
+  unsigned long evictions;  /* chunks evicted to stay within memory bound */
+  unsigned long entries;    /* chunks currently stored */
+  unsigned long bytes;      /* memory currently used by stored chunks */
+} MD_RTF_CACHE_STATS;
+
+MD_RTF_CACHE* md_rtf_cache_new(unsigned long max_bytes);
+void md_rtf_cache_free(MD_RTF_CACHE* cache);
+void md_rtf_cache_stats(const MD_RTF_CACHE* cache, MD_RTF_CACHE_STATS* stats);
+
+/* Map of rendered top-level chunks, from source text ranges to RTF output
+ranges. Chunks are contiguous and cover the whole source text (except the
+skipped BOM), RTF document header and footer are outside of chunks. */
+typedef struct MD_RTF_block_tag {
+  MD_OFFSET       src_off;    /* chunk offset in source text */
+  MD_SIZE         src_size;   /* chunk size in source text */
+  MD_SIZE         out_off;    /* chunk offset in RTF output */
+  MD_SIZE         out_size;   /* chunk size in RTF output */
+} MD_RTF_BLOCK;
+
+typedef struct MD_RTF_block_map_tag {
+  MD_RTF_BLOCK*   blocks;
+  unsigned        count;
+  unsigned        cap;
+  MD_SIZE         out_size;   /* whole RTF output size */
+} MD_RTF_BLOCK_MAP;
+
+void md_rtf_block_map_free(MD_RTF_BLOCK_MAP* map);
+
+/* Result of md_rtf_update(): the previous RTF output data at the given offset
+and of the removed size must be replaced by the inserted data, which was sent
+to process_output. */
+typedef struct MD_RTF_splice_tag {
+  MD_SIZE         offset;
+  MD_SIZE         removed;
+  MD_SIZE         inserted;
+} MD_RTF_SPLICE;
+
+/* Map of source offsets to RTF output offsets.
+
+An entry is appended each time a block (except the document itself) or a span
+is entered or left, with the source offset where it starts (or ends) and the
+RTF output offset where its rendering starts (or ends). Entries are in output
+order. Source offsets are deduced from text given by the parser, so they point
+to the first (or after the last) text of the block or span, not to its
+Markdown markup.
+
+Chunks copied from cache do not produce entries, the cache is therefore not
+used by a render which fills an offset map. */
+#define MD_RTF_OFFSET_BLOCK                 0x00
+#define MD_RTF_OFFSET_SPAN                  0x01
+#define MD_RTF_OFFSET_LEAVE                 0x02
+
+typedef struct MD_RTF_offset_tag {
+  MD_OFFSET       md_off;     /* offset in source text */
+  MD_SIZE         rtf_off;    /* offset in RTF output */
+  unsigned short  type;       /* MD_BLOCKTYPE or MD_SPANTYPE value */
+  unsigned short  kind;       /* MD_RTF_OFFSET_XXX flags */
+} MD_RTF_OFFSET;
+
+typedef struct MD_RTF_offset_map_tag {
+  MD_RTF_OFFSET*  entries;
+  unsigned        count;
+  unsigned        cap;
+} MD_RTF_OFFSET_MAP;
+
+void md_rtf_offset_map_free(MD_RTF_OFFSET_MAP* map);
+
+/* Table columns layout.
+
+With MD_RTF_TABLE_EQUAL (the default) all columns have the same width and the
+viewer is left to fit the table (\trautofit1). With MD_RTF_TABLE_FIT table
+rows are held until the end of table while the width of cells text is
+measured using Calibri and Consolas metrics, then columns widths are computed
+from content and rows are written with fixed cells boundaries, so the viewer
+does not need to lay out the table again.
+
+Since MD_RTF_TABLE_FIT holds the whole table, MD_RTF_TABLE_SAMPLE may be used
+for large tables: only the first table_sample rows (head included) are held
+and measured, columns widths are computed from them and following rows are
+written directly with the same cells boundaries, so memory used by a table is
+bounded by the sample size. */
+#define MD_RTF_TABLE_EQUAL                  0
+#define MD_RTF_TABLE_FIT                    1
+#define MD_RTF_TABLE_SAMPLE                 2
+
+/* Default count of sampled rows if table_sample is zero */
+#define MD_RTF_TABLE_SAMPLE_ROWS            100
+
+/* Output sink with status, which may be given in render options instead of
+process_output (which may then be NULL). It returns zero to go on, or
+non-zero to stop the render at once, md_rtf_ex() then returns this value and
+no more data is sent.
+
+The sink is also called with no data and the MD_RTF_SINK_FLUSH flag at end of
+each top-level block and at end of document, which are natural points to send
+buffered output (e.g. a network chunk). With MD_RTF_FLAG_TOC, the document body
+is held until its end and is then sent at once, without flush hints. */
+#define MD_RTF_SINK_FLUSH                   0x0001
+
+typedef int (*MD_RTF_SINK)(const MD_RTF_DATA* data, MD_SIZE size,
+                           unsigned flags, void* userdata);
+
+/* Render limits, for untrusted input. When a limit given in render options
+is hit, the render is stopped at once and md_rtf_ex() returns the matching
+error code, output is then incomplete. The output size limit applies to the
+whole RTF output, the depth limit to nested lists and quotes, the cells
+limit to the cells count of each table and the steps limit to the count of
+parser callbacks (blocks, spans and texts), which bounds the render time. */
+#define MD_RTF_ERROR_OUTPUT_LIMIT           (-10)
+#define MD_RTF_ERROR_DEPTH_LIMIT            (-11)
+#define MD_RTF_ERROR_CELLS_LIMIT            (-12)
+#define MD_RTF_ERROR_STEPS_LIMIT            (-13)
+
+/* Theme profiles. A theme gives fonts, colors and headings sizes, which are
+compiled once by md_rtf_theme_new() with font size and document width into
+the whole document header and the control words used by the render. A render
+given a theme in its options starts with a copy of the prebuilt header and
+does not format anything, font_size and doc_width of render options are then
+ignored. A theme is not modified by renders, it may be shared by concurrent
+renders and kept as long as needed.
+
+Members of theme definition not used must be zero (or NULL) for defaults:
+Calibri and Consolas fonts, default colors and headings sizes. Colors are
+0xRRGGBB values of, in order: text, background, borders, links, code and
+table head background, quote text. Syntax colors are those of, in order:
+keywords, strings, comments, numbers. Headings sizes are factors of the normal
+font size, from level 1 to 6. Characters which are not allowed in a font name
+are skipped. */
+#define MD_RTF_THEME_COLORS                 6
+#define MD_RTF_THEME_SYNTAX_COLORS          4
+
+typedef struct MD_RTF_theme_def_tag {
+  unsigned        font_size;  /* normal font size (point) */
+  unsigned        doc_width;  /* document width (pixel) */
+  const char*     font_norm;  /* optional normal font name */
+  const char*     font_mono;  /* optional monospace font name */
+  const unsigned long* colors; /* optional MD_RTF_THEME_COLORS colors */
+  const unsigned long* syntax_colors; /* optional MD_RTF_THEME_SYNTAX_COLORS colors */
+  const float*    head_scale; /* optional 6 headings font sizes factors */
+} MD_RTF_THEME_DEF;
+
+typedef struct MD_RTF_theme_tag MD_RTF_THEME;
+
+MD_RTF_THEME* md_rtf_theme_new(const MD_RTF_THEME_DEF* def);
+void md_rtf_theme_free(MD_RTF_THEME* theme);
+
+/* Plain text output. If text_output is given in render options, a plain
+text rendering of the document is sent to it in the same pass, with its own
+userdata: blocks separated by blank lines, list items with their marker and
+indented by depth, table cells separated by tabs, without any formatting.
+Text is UTF-8 with CRLF line feeds. Chunks cache is then not used and
+md_rtf_update() renders the whole document. */
+
+/* Block code tabs. If tab_size is given in render options, tabs of block code
+are expanded to spaces up to the next tab stop, every tab_size characters (at
+most 16), otherwise tabs are written as is.
+
+Block code rows. Block code is written in a single table cell, which viewers
+are slow to lay out when it holds thousands of lines. If code_rows is given
+in render options, block code is split in consecutive table rows of at most
+code_rows lines (paragraphs with MD_RTF_FLAG_PARA_BORDERS), with the same
+formatting and no space between them. */
+
+/* Preview. If preview_blocks or preview_output is given in render options,
+the render ends after that count of top-level blocks, or after the top-level
+block during which output size reaches preview_output, whichever comes first.
+The document is then closed as usual and md_rtf_ex() returns zero: output is
+a valid RTF document of the first blocks. The source is parsed chunk by chunk
+and the rest of it is never parsed, so render time depends on preview size
+(unless the document has link reference definitions, which must be found in
+the whole source). Chunks cache is not used and the block map is left empty.
+With md_rtf_multi(), a target whose preview is complete is ended while others
+go on, the parse stops once all targets are ended. */
+
+/* Render trace. A trace given in render options records timestamped events of
+the render: setup (initialization and source scan), enter and leave of blocks
+and spans, and flush hints sent to the sink. Events are stored in a ring
+buffer of the capacity given to md_rtf_trace_new(), once full the oldest
+events are overwritten. A trace is not cleared by renders, several renders
+given the same trace follow each other on its timeline, it must not be used
+by concurrent renders.
+
+md_rtf_trace_export() writes recorded events as Chrome trace event JSON (to
+be loaded by chrome://tracing or Perfetto), timestamps are microseconds since
+trace creation or clear, each event has the RTF output size as argument.
+Without trace, the render is not slowed down. */
+typedef struct MD_RTF_trace_tag MD_RTF_TRACE;
+
+MD_RTF_TRACE* md_rtf_trace_new(unsigned capacity);
+void md_rtf_trace_free(MD_RTF_TRACE* trace);
+void md_rtf_trace_clear(MD_RTF_TRACE* trace);
+int md_rtf_trace_export(const MD_RTF_TRACE* trace,
+                        void (*process_output)(const MD_RTF_CHAR*, MD_SIZE, void*),
+                        void* userdata);
+
+/* Extended render options for md_rtf_ex(), members not used must be zero. */
+typedef struct MD_RTF_opts_tag {
+  unsigned        font_size;  /* normal font size (point) */
+  unsigned        doc_width;  /* document width (pixel) */
+  MD_RTF_CACHE*   cache;      /* optional rendered chunks cache */
+  MD_RTF_BLOCK_MAP* block_map; /* optional map filled by render */
+  MD_RTF_OFFSET_MAP* offset_map; /* optional map filled by render */
+  unsigned        table_layout; /* MD_RTF_TABLE_XXX columns layout */
+  unsigned        table_sample; /* rows sampled by MD_RTF_TABLE_SAMPLE */
+  MD_RTF_SINK     sink;       /* optional sink, replaces process_output */
+  MD_SIZE         max_output; /* max RTF output size (bytes) */
+  unsigned        max_depth;  /* max depth of nested lists and quotes */
+  unsigned        max_cells;  /* max cells per table */
+  unsigned long   max_steps;  /* max count of parser callbacks */
+  /* optional plain text output, see below */
+  void            (*text_output)(const MD_RTF_CHAR*, MD_SIZE, void*);
+  void*           text_userdata;
+  const MD_RTF_THEME* theme;  /* optional prebuilt theme */
+  unsigned        tab_size;   /* code tab stops, zero to keep tabs */
+  unsigned        code_rows;  /* max lines per code row, zero for no limit */
+  unsigned        preview_blocks; /* top-level blocks of preview, zero for all */
+  MD_SIZE         preview_output; /* output size of preview, zero for all */
+  MD_RTF_TRACE*   trace;      /* optional events trace */
+} MD_RTF_OPTS;
 
 int md_rtf(const MD_CHAR* input, MD_SIZE input_size,
             void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
             void* userdata, unsigned parser_flags, unsigned renderer_flags,
             unsigned font_size, unsigned doc_width);
 
+int md_rtf_ex(const MD_CHAR* input, MD_SIZE input_size,
+              void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
+              void* userdata, unsigned parser_flags, unsigned renderer_flags,
+              const MD_RTF_OPTS* opts);
+
+/* Incremental render after an edit of a source text previously rendered by
+md_rtf_ex() with a block map. The given input is the whole edited text, where
+edit_old characters at edit_off were replaced by edit_new characters. Only the
+chunks affected by the edit are rendered and sent to process_output, splice
+tells how to apply them to the previous output and the block map is updated.
+Render options and flags must be the same as for the previous render. If an
+offset map or a text output is given or with MD_RTF_FLAG_LIST_TABLE,
+MD_RTF_FLAG_MINIMAL_HEADER or MD_RTF_FLAG_TOC, the whole document is rendered
+again. */
+int md_rtf_update(const MD_CHAR* input, MD_SIZE input_size,
+                  MD_OFFSET edit_off, MD_SIZE edit_old, MD_SIZE edit_new,
+                  void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
+                  void* userdata, unsigned parser_flags, unsigned renderer_flags,
+                  const MD_RTF_OPTS* opts, MD_RTF_SPLICE* splice);
+
+/* Pull rendering, RTF data is produced as the consumer reads it.
+
+md_rtf_open() prepares the render of the given source text, which must stay
+valid until md_rtf_close(). Each md_rtf_read() call fills buf with at most cap
+bytes and gives the count of bytes written in size, which is zero once the
+whole document was read. Document is rendered one top-level chunk at a time
+when more data is needed, so the first bytes are available before the whole
+document is parsed and pending data does not exceed the output of one chunk
+(the whole document if it has link reference definitions, or with
+MD_RTF_FLAG_TOC since the body is held until contents is complete).
+md_rtf_read() returns non-zero if render failed, after any data rendered so
+far was read. */
+typedef struct MD_RTF_reader_tag MD_RTF_READER;
+
+MD_RTF_READER* md_rtf_open(const MD_CHAR* input, MD_SIZE input_size,
+                           unsigned parser_flags, unsigned renderer_flags,
+                           const MD_RTF_OPTS* opts);
+
+int md_rtf_read(MD_RTF_READER* reader, MD_RTF_DATA* buf, MD_SIZE cap, MD_SIZE* size);
+
+void md_rtf_close(MD_RTF_READER* reader);
+
+/* Fan-out rendering, the document is parsed once and rendered to several
+targets, each with its own render options and output. Parser and renderer
+flags are the same for all targets. Chunks cache and block map are not used,
+the document being rendered as a whole. A target whose render fails (e.g.
+its sink returned non-zero) is stopped while others go on, the result of each
+render is set in its target and md_rtf_multi() returns the first non-zero
+one, if any. A target with preview options is ended once its preview is
+complete, its result is then zero. */
+typedef struct MD_RTF_target_tag {
+  const MD_RTF_OPTS* opts;
+  void            (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*);
+  void*           userdata;
+  int             result;     /* render result, set by md_rtf_multi() */
+} MD_RTF_TARGET;
+
+int md_rtf_multi(const MD_CHAR* input, MD_SIZE input_size,
+                 unsigned parser_flags, unsigned renderer_flags,
+                 MD_RTF_TARGET* targets, unsigned count);
+
+/* Output validation. A validator checks the structure of RTF data in a single
+pass as it is produced: groups balance, control words syntax, \uN values
+range and table rows, where each \row must end as many \cell as \cellx of
+the last row definition. Data given to md_rtf_validate() is passed through
+to the process_output given at creation (if any), so md_rtf_validate() can be
+given as process_output to md_rtf_ex() with the validator as userdata.
+md_rtf_validator_end() tells whether the whole data was valid and gives the
+output offset of the first error, if any.
+The validator reads every byte, text runs are skipped by words of 8 bytes
+and control words are decoded in place. It validates about 0.5 GB/s of text
+heavy output, so checking it doubles render time, and about 2 GB/s of table
+output, whose repeated row definitions are compared as a whole. It is meant
+for tests and debug builds, not to be left in every render. */
+#define MD_RTF_INVALID_GROUP                (-20)
+#define MD_RTF_INVALID_WORD                 (-21)
+#define MD_RTF_INVALID_UNICODE              (-22)
+#define MD_RTF_INVALID_TABLE                (-23)
+
+typedef struct MD_RTF_validator_tag MD_RTF_VALIDATOR;
+
+MD_RTF_VALIDATOR* md_rtf_validator_new(void (*process_output)(const MD_RTF_DATA*, MD_SIZE, void*),
+                                       void* userdata);
+void md_rtf_validate(const MD_RTF_DATA* data, MD_SIZE size, void* validator);
+int md_rtf_validator_end(MD_RTF_VALIDATOR* validator, MD_SIZE* error_off);
+void md_rtf_validator_free(MD_RTF_VALIDATOR* validator);
+
 #ifdef __cplusplus
     }  /* extern "C" { */
 #endif
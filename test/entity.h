@@ -0,0 +1,17 @@
+/*
+ * Declaration of entity_lookup() from MD4C sources (src/entity.h). It is built
+ * in the md4c-html library, but its header is not installed with it.
+ */
+#ifndef MD4C_ENTITY_H
+#define MD4C_ENTITY_H
+
+#include <stdlib.h>
+
+struct entity {
+    const char* name;
+    unsigned codepoints[2];
+};
+
+const struct entity* entity_lookup(const char* name, size_t name_size);
+
+#endif  /* MD4C_ENTITY_H */
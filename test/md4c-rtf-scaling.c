@@ -0,0 +1,325 @@
+/*
+ * MD4C-RTF: RTF Renderer for MD4C parser
+ *
+ * Scaling test on pathological inputs: families of generated documents are
+ * rendered at sizes n, 2n and 4n, and the test fails if render time grows
+ * faster than input size (beyond timing noise), so quadratic behavior is
+ * found before it ships. The time of a parse with no-op callbacks is taken
+ * off, so only the renderer share is tested, not the parser one.
+ *
+ * Usage: md4c-rtf-scaling [family name]
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "md4c-rtf.h"
+
+#define SCALE_PARSER_FLAGS (MD_FLAG_TABLES | MD_FLAG_STRIKETHROUGH | MD_FLAG_UNDERLINE)
+
+/* Minimal renderer time of the smallest size, so timing noise stays small */
+#define SCALE_MIN_SECONDS   0.02
+/* Maximal render time of the smallest size, if the parse takes most of it */
+#define SCALE_MAX_SECONDS   0.5
+/* Max growth exponent of time over input size, 1 is linear */
+#define SCALE_MAX_EXPONENT  1.4
+/* Repeats of each measure, the fastest is kept */
+#define SCALE_REPEATS       9
+
+typedef struct SCALE_BUF {
+  char*     data;
+  size_t    size;
+  size_t    cap;
+} SCALE_BUF;
+
+static void
+buf_append(SCALE_BUF* buf, const char* data, size_t size)
+{
+  if(buf->size + size > buf->cap) {
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while(cap < buf->size + size)
+      cap *= 2;
+    buf->data = (char*)realloc(buf->data, cap);
+    if(!buf->data) {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+    buf->cap = cap;
+  }
+
+  memcpy(buf->data + buf->size, data, size);
+  buf->size += size;
+}
+
+static void
+buf_puts(SCALE_BUF* buf, const char* str)
+{
+  buf_append(buf, str, strlen(str));
+}
+
+static void
+buf_repeat(SCALE_BUF* buf, const char* str, unsigned count)
+{
+  while(count--)
+    buf_puts(buf, str);
+}
+
+
+/******************************************
+ ***           Input families           ***
+ ******************************************/
+
+/* Lists nested far beyond the 8 rendered levels */
+static void
+gen_deep_lists(SCALE_BUF* md, unsigned n)
+{
+  unsigned i, d;
+
+  for(i = 0; i < n; i++) {
+    for(d = 0; d < 24; d++) {
+      buf_repeat(md, "  ", d);
+      buf_puts(md, "- item *text*\n");
+    }
+    buf_puts(md, "\n");
+  }
+}
+
+/* Long runs of characters which must be escaped */
+static void
+gen_escapes(SCALE_BUF* md, unsigned n)
+{
+  unsigned i;
+
+  for(i = 0; i < n; i++)
+    buf_puts(md, "{}\\\\{{}}\\\\");
+  buf_puts(md, "\n");
+}
+
+/* Table with many columns */
+static void
+gen_wide_table(SCALE_BUF* md, unsigned n)
+{
+  unsigned r;
+
+  for(r = 0; r < 6; r++) {
+    buf_repeat(md, (r == 1) ? "|---" : "| cell ", n);
+    buf_puts(md, "|\n");
+  }
+}
+
+/* Long table, rows held and measured by fitted layouts */
+static void
+gen_long_table(SCALE_BUF* md, unsigned n)
+{
+  buf_puts(md, "| a | b | c |\n|---|---|---|\n");
+  buf_repeat(md, "| some text | `code` | **bold** |\n", n);
+}
+
+/* Thousands of entities */
+static void
+gen_entities(SCALE_BUF* md, unsigned n)
+{
+  unsigned i;
+
+  for(i = 0; i < n; i++)
+    buf_puts(md, "&copy;&eacute;&#8364;&#x1F600;&amp;");
+  buf_puts(md, "\n");
+}
+
+/* Long code lines */
+static void
+gen_code_line(SCALE_BUF* md, unsigned n)
+{
+  buf_puts(md, "```c\n");
+  buf_repeat(md, "if(x) { y = \"\\t\"; } ", n);
+  buf_puts(md, "\n```\n");
+}
+
+/* Code block of many empty lines, each one a new line text event */
+static void
+gen_code_newlines(SCALE_BUF* md, unsigned n)
+{
+  buf_puts(md, "```\n");
+  buf_repeat(md, "x\n\n\n\n", n);
+  buf_puts(md, "```\n");
+}
+
+typedef struct SCALE_FAMILY {
+  const char* name;
+  void        (*gen)(SCALE_BUF*, unsigned);
+  unsigned    flags;
+  unsigned    table_layout;
+  unsigned    code_rows;
+} SCALE_FAMILY;
+
+static const SCALE_FAMILY g_families[] = {
+  { "deep-lists",       gen_deep_lists,     0,                        MD_RTF_TABLE_EQUAL,  0 },
+  { "deep-lists-table", gen_deep_lists,     MD_RTF_FLAG_LIST_TABLE,   MD_RTF_TABLE_EQUAL,  0 },
+  { "escapes",          gen_escapes,        0,                        MD_RTF_TABLE_EQUAL,  0 },
+  { "wide-table",       gen_wide_table,     0,                        MD_RTF_TABLE_EQUAL,  0 },
+  { "wide-table-fit",   gen_wide_table,     0,                        MD_RTF_TABLE_FIT,    0 },
+  { "long-table-fit",   gen_long_table,     0,                        MD_RTF_TABLE_FIT,    0 },
+  { "long-table-sample", gen_long_table,    0,                        MD_RTF_TABLE_SAMPLE, 0 },
+  { "entities",         gen_entities,       MD_RTF_FLAG_ANSI_CP1252,  MD_RTF_TABLE_EQUAL,  0 },
+  { "code-line",        gen_code_line,      MD_RTF_FLAG_HIGHLIGHT,    MD_RTF_TABLE_EQUAL,  0 },
+  { "code-newlines",    gen_code_newlines,  0,                        MD_RTF_TABLE_EQUAL,  0 },
+  { "code-newlines-rows", gen_code_newlines, 0,                       MD_RTF_TABLE_EQUAL,  16 }
+};
+
+
+/******************************************
+ ***              Timing                ***
+ ******************************************/
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void
+null_output(const MD_RTF_DATA* data, MD_SIZE size, void* userdata)
+{
+  (void)data;
+  *(unsigned long*)userdata += size;
+}
+
+static int
+null_block(MD_BLOCKTYPE type, void* detail, void* userdata)
+{
+  (void)type; (void)detail; (void)userdata;
+  return 0;
+}
+
+static int
+null_span(MD_SPANTYPE type, void* detail, void* userdata)
+{
+  (void)type; (void)detail; (void)userdata;
+  return 0;
+}
+
+static int
+null_text(MD_TEXTTYPE type, const MD_CHAR* text, MD_SIZE size, void* userdata)
+{
+  (void)type; (void)text; (void)size; (void)userdata;
+  return 0;
+}
+
+/* Fastest times of a family render and of its parse alone (with no-op
+callbacks) at given size, measured in turn so they share the same noise,
+input size is returned */
+static void
+measure(const SCALE_FAMILY* fam, unsigned n, size_t* md_size,
+        double* render, double* parse)
+{
+  SCALE_BUF md = { 0 };
+  MD_RTF_OPTS opts;
+  MD_PARSER parser;
+  unsigned i;
+
+  fam->gen(&md, n);
+  *md_size = md.size;
+
+  memset(&opts, 0, sizeof(opts));
+  opts.font_size = 11;
+  opts.doc_width = 229;
+  opts.table_layout = fam->table_layout;
+  opts.code_rows = fam->code_rows;
+
+  memset(&parser, 0, sizeof(parser));
+  parser.flags = SCALE_PARSER_FLAGS;
+  parser.enter_block = null_block;
+  parser.leave_block = null_block;
+  parser.enter_span = null_span;
+  parser.leave_span = null_span;
+  parser.text = null_text;
+
+  *render = 1e30;
+  *parse = 1e30;
+
+  for(i = 0; i < SCALE_REPEATS; i++) {
+    unsigned long out = 0;
+    double t = now();
+    md_parse(md.data, (MD_SIZE)md.size, &parser, NULL);
+    t = now() - t;
+    if(t < *parse)
+      *parse = t;
+
+    t = now();
+    int ret = md_rtf_ex(md.data, (MD_SIZE)md.size, null_output, &out,
+                        SCALE_PARSER_FLAGS, fam->flags, &opts);
+    t = now() - t;
+
+    /* a failed render would look fast */
+    if(ret != 0) {
+      fprintf(stderr, "%s: render failed (%d)\n", fam->name, ret);
+      exit(1);
+    }
+    if(t < *render)
+      *render = t;
+  }
+
+  free(md.data);
+}
+
+/* Returns non-zero if renderer time grows faster than input size */
+static int
+test_family(const SCALE_FAMILY* fam)
+{
+  size_t sizes[3];
+  double render[3], parse[3], times[3];
+  double exponent, step;
+  unsigned n = 16;
+  unsigned i;
+
+  /* smallest size long enough to be timed */
+  for(;;) {
+    measure(fam, n, &sizes[0], &render[0], &parse[0]);
+    if(render[0] - parse[0] >= SCALE_MIN_SECONDS || render[0] >= SCALE_MAX_SECONDS ||
+       n >= (1u << 24))
+      break;
+    n *= 2;
+  }
+
+  for(i = 0; i < 3; i++) {
+    measure(fam, n << i, &sizes[i], &render[i], &parse[i]);
+    /* renderer share, parse may be measured slightly above render by noise */
+    times[i] = (render[i] > parse[i]) ? render[i] - parse[i] : 1e-6;
+  }
+
+  /* growth of renderer time relative to input size, the lowest of both
+  steps, so noise (or cache misses) must raise both to give a failure */
+  exponent = log(times[1] / times[0]) / log((double)sizes[1] / (double)sizes[0]);
+  step = log(times[2] / times[1]) / log((double)sizes[2] / (double)sizes[1]);
+  if(step < exponent)
+    exponent = step;
+
+  printf("%-20s %9lu %9lu %9lu bytes %8.2f %8.2f %8.2f ms (parse %8.2f %8.2f %8.2f ms)  exponent %.2f %s\n",
+         fam->name, (unsigned long)sizes[0], (unsigned long)sizes[1],
+         (unsigned long)sizes[2], times[0] * 1e3, times[1] * 1e3, times[2] * 1e3,
+         parse[0] * 1e3, parse[1] * 1e3, parse[2] * 1e3,
+         exponent, (exponent > SCALE_MAX_EXPONENT) ? "SUPERLINEAR" : "ok");
+
+  return exponent > SCALE_MAX_EXPONENT;
+}
+
+int
+main(int argc, char** argv)
+{
+  unsigned failures = 0;
+  unsigned i;
+
+  for(i = 0; i < sizeof(g_families) / sizeof(g_families[0]); i++) {
+    if(argc > 1 && strcmp(argv[1], g_families[i].name) != 0)
+      continue;
+    failures += test_family(&g_families[i]);
+  }
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,886 @@
+/*
+ * MD4C-RTF: RTF Renderer for MD4C parser
+ *
+ * Differential test of render paths: generated (and randomly altered)
+ * Markdown documents are rendered by md_rtf_ex() for several configurations,
+ * then through chunks cache, incremental update, sink, pull reader and
+ * fan-out, whose outputs must be byte identical. Previews are checked the same
+ * way. Every output is checked by the RTF structure validator.
+ *
+ * Usage: md4c-rtf-test [documents count] [seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "md4c-rtf.h"
+
+#define TEST_PARSER_FLAGS (MD_FLAG_TABLES | MD_FLAG_STRIKETHROUGH | MD_FLAG_UNDERLINE)
+
+/******************************************
+ ***            Test helpers            ***
+ ******************************************/
+
+/* Growing buffer of output (or source) data */
+typedef struct TEST_BUF {
+  char*     data;
+  size_t    size;
+  size_t    cap;
+} TEST_BUF;
+
+static void
+buf_append(TEST_BUF* buf, const void* data, size_t size)
+{
+  if(buf->size + size + 1 > buf->cap) {
+    size_t cap = buf->cap ? buf->cap : 256;
+    while(cap < buf->size + size + 1)
+      cap *= 2;
+    buf->data = (char*)realloc(buf->data, cap);
+    if(!buf->data) {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+    buf->cap = cap;
+  }
+
+  if(size)
+    memcpy(buf->data + buf->size, data, size);
+  buf->size += size;
+  buf->data[buf->size] = '\0';
+}
+
+static void
+buf_puts(TEST_BUF* buf, const char* str)
+{
+  buf_append(buf, str, strlen(str));
+}
+
+/* Offset of data in buffer from given offset, buffer size if not found */
+static size_t
+buf_find(const TEST_BUF* buf, size_t from, const char* data, size_t size)
+{
+  for(; from + size <= buf->size; from++) {
+    if(memcmp(buf->data + from, data, size) == 0)
+      return from;
+  }
+
+  return buf->size;
+}
+
+static void
+buf_free(TEST_BUF* buf)
+{
+  free(buf->data);
+  memset(buf, 0, sizeof(TEST_BUF));
+}
+
+static void
+buf_output(const MD_RTF_DATA* data, MD_SIZE size, void* userdata)
+{
+  buf_append((TEST_BUF*)userdata, data, size);
+}
+
+static int
+buf_sink(const MD_RTF_DATA* data, MD_SIZE size, unsigned flags, void* userdata)
+{
+  /* flush hints carry no data */
+  if(flags & MD_RTF_SINK_FLUSH && size != 0)
+    return -1;
+
+  buf_append((TEST_BUF*)userdata, data, size);
+  return 0;
+}
+
+/* Deterministic random numbers (xorshift), same documents on every run */
+static unsigned long g_rand;
+
+static unsigned
+rnd(unsigned n)
+{
+  g_rand ^= (g_rand << 13) & 0xFFFFFFFFUL;
+  g_rand ^= g_rand >> 17;
+  g_rand ^= (g_rand << 5) & 0xFFFFFFFFUL;
+  return (unsigned)(g_rand % n);
+}
+
+/* Current test, for failure reports */
+static unsigned g_doc;
+static unsigned g_conf;
+static unsigned g_checks;
+static unsigned g_failures;
+
+static void
+test_fail(const char* what, const TEST_BUF* ref, const TEST_BUF* out)
+{
+  g_failures++;
+  if(g_failures > 20)
+    return;
+
+  printf("FAIL doc %u conf %u: %s", g_doc, g_conf, what);
+  if(ref && out) {
+    size_t i = 0;
+    while(i < ref->size && i < out->size && ref->data[i] == out->data[i])
+      i++;
+    printf(" (sizes %lu/%lu, differ at %lu)", (unsigned long)ref->size,
+           (unsigned long)out->size, (unsigned long)i);
+  }
+  printf("\n");
+}
+
+/* Check output with validator, and against reference output if any */
+static void
+test_check(const char* what, int ret, const TEST_BUF* ref, const TEST_BUF* out)
+{
+  MD_RTF_VALIDATOR* v;
+  MD_SIZE off;
+  char msg[128];
+  int valid;
+
+  g_checks++;
+
+  if(ret != 0) {
+    snprintf(msg, sizeof(msg), "%s returned %d", what, ret);
+    test_fail(msg, NULL, NULL);
+    return;
+  }
+
+  v = md_rtf_validator_new(NULL, NULL);
+  md_rtf_validate((const MD_RTF_DATA*)out->data, (MD_SIZE)out->size, v);
+  valid = md_rtf_validator_end(v, &off);
+  md_rtf_validator_free(v);
+
+  if(valid != 0) {
+    snprintf(msg, sizeof(msg), "%s output invalid (%d at %lu)", what, valid, (unsigned long)off);
+    test_fail(msg, NULL, NULL);
+    return;
+  }
+
+  if(ref && (ref->size != out->size || memcmp(ref->data, out->data, ref->size) != 0)) {
+    snprintf(msg, sizeof(msg), "%s output differs", what);
+    test_fail(msg, ref, out);
+  }
+}
+
+
+/******************************************
+ ***          Markdown generator        ***
+ ******************************************/
+
+static const char* g_words[] = {
+  "lorem", "ipsum", "dolor", "sit", "amet", "**bold**", "*italic*", "_under_",
+  "~~strike~~", "`code {x}`", "`a\\b`", "[link](http://example.org/a?b=1&c=2)",
+  "[**strong link**](#top)", "&copy;", "&amp;", "&eacute;t&eacute;", "&#8364;",
+  "&bogus;", "{braces}", "back\\slash", "caf\xC3\xA9", "na\xC3\xAFve",
+  "\xE6\x97\xA5\xE6\x9C\xAC", "\xF0\x9F\x98\x80", "\xE2\x80\x94", "tab\there",
+  "x_y_z", "a*b", "<b>html</b>", "1.5", "\\*not em\\*"
+};
+
+static const char* g_code_lines[] = {
+  "int main(int argc, char** argv) {", "  return 0; /* done */", "}",
+  "def f(x):", "    return \"s\" + 'c'  # comment", "{\"key\": [1, 2.5, true, null]}",
+  "echo \"$HOME\" | grep -c x", "SELECT id, name FROM t WHERE x = 'a';",
+  "\tif(a < b) { c = \"\\\\\"; }", "// line comment", "x = 0x1F + 1e-3",
+  "\xC3\xA9t\xC3\xA9 \xF0\x9F\x98\x80", "", "      deep indent", "{}\\{}\\"
+};
+
+static const char* g_langs[] = { "", "c", "cpp", "python", "json", "sh", "sql", "unknown" };
+
+static void
+gen_words(TEST_BUF* md, unsigned count)
+{
+  unsigned i;
+
+  for(i = 0; i < count; i++) {
+    if(i)
+      buf_puts(md, " ");
+    buf_puts(md, g_words[rnd(sizeof(g_words) / sizeof(g_words[0]))]);
+  }
+}
+
+static void
+gen_para(TEST_BUF* md, const char* prefix)
+{
+  unsigned lines = 1 + rnd(3);
+  unsigned i;
+
+  for(i = 0; i < lines; i++) {
+    buf_puts(md, prefix);
+    gen_words(md, 1 + rnd(12));
+    if(i + 1 < lines && rnd(4) == 0)
+      buf_puts(md, "  ");
+    buf_puts(md, "\n");
+  }
+}
+
+static void
+gen_list(TEST_BUF* md, unsigned depth)
+{
+  unsigned items = 1 + rnd(4);
+  unsigned ordered = rnd(2);
+  unsigned start = rnd(3) ? 1 : rnd(1000);
+  unsigned i, j;
+
+  for(i = 0; i < items; i++) {
+    for(j = 0; j < depth; j++)
+      buf_puts(md, ordered ? "   " : "  ");
+    if(ordered) {
+      char num[16];
+      snprintf(num, sizeof(num), "%u. ", start + i);
+      buf_puts(md, num);
+    } else {
+      buf_puts(md, "- ");
+    }
+    gen_words(md, 1 + rnd(8));
+    buf_puts(md, "\n");
+
+    /* nest beyond the renderer levels now and then */
+    if(depth < 11 && rnd(3) == 0)
+      gen_list(md, depth + 1);
+  }
+}
+
+static void
+gen_code(TEST_BUF* md)
+{
+  unsigned lines = rnd(14);
+  unsigned i;
+
+  buf_puts(md, "```");
+  buf_puts(md, g_langs[rnd(sizeof(g_langs) / sizeof(g_langs[0]))]);
+  buf_puts(md, "\n");
+  for(i = 0; i < lines; i++) {
+    buf_puts(md, g_code_lines[rnd(sizeof(g_code_lines) / sizeof(g_code_lines[0]))]);
+    buf_puts(md, "\n");
+  }
+  buf_puts(md, "```\n");
+}
+
+static void
+gen_table(TEST_BUF* md)
+{
+  unsigned cols = 1 + rnd(6);
+  unsigned rows = rnd(9);
+  unsigned i, j;
+
+  for(i = 0; i < rows + 2; i++) {
+    for(j = 0; j < cols; j++) {
+      buf_puts(md, "| ");
+      if(i == 1)
+        buf_puts(md, (j % 3 == 0) ? "---" : (j % 3 == 1) ? ":---:" : "---:");
+      else if(rnd(6))
+        gen_words(md, 1 + rnd(4));
+    }
+    buf_puts(md, " |\n");
+  }
+}
+
+/* Generate a document of random top-level blocks */
+static void
+gen_doc(TEST_BUF* md)
+{
+  unsigned blocks = 1 + rnd(30);
+  unsigned i;
+
+  if(rnd(10) == 0)
+    buf_puts(md, "\xEF\xBB\xBF");
+
+  for(i = 0; i < blocks; i++) {
+    switch(rnd(10)) {
+      case 0: {
+        static const char* hashes[] = { "# ", "## ", "### ", "#### ", "##### ", "###### " };
+        buf_puts(md, hashes[rnd(6)]);
+        gen_words(md, 1 + rnd(6));
+        buf_puts(md, "\n");
+        break;
+      }
+      case 1:
+      case 2:
+        gen_list(md, 0);
+        break;
+      case 3:
+        gen_code(md);
+        break;
+      case 4:
+        gen_table(md);
+        break;
+      case 5:
+        gen_para(md, rnd(3) ? "> " : "> > ");
+        break;
+      case 6:
+        buf_puts(md, "---\n");
+        break;
+      default:
+        gen_para(md, "");
+        break;
+    }
+    buf_puts(md, rnd(5) ? "\n" : "\n\n");
+  }
+}
+
+/* Alter a document at random places, with Markdown and RTF special chars */
+static void
+gen_fuzz(TEST_BUF* md)
+{
+  static const char chars[] = "*_`[]()#>-|{}\\\n &;:!\t\r\0";
+  unsigned count = 1 + rnd(20);
+  unsigned i;
+
+  for(i = 0; i < count && md->size > 0; i++) {
+    size_t off = rnd((unsigned)md->size);
+    md->data[off] = chars[rnd(sizeof(chars) - 1)];
+  }
+}
+
+/* Replace line feeds by CRLF */
+static void
+gen_crlf(TEST_BUF* md)
+{
+  TEST_BUF crlf = { 0 };
+  size_t i;
+
+  for(i = 0; i < md->size; i++) {
+    if(md->data[i] == '\n')
+      buf_append(&crlf, "\r", 1);
+    buf_append(&crlf, md->data + i, 1);
+  }
+
+  buf_free(md);
+  *md = crlf;
+}
+
+
+/******************************************
+ ***         Render configurations      ***
+ ******************************************/
+
+typedef struct TEST_CONF {
+  unsigned  flags;
+  unsigned  font_size;
+  unsigned  doc_width;
+  unsigned  table_layout;
+  unsigned  table_sample;
+  unsigned  code_rows;
+  unsigned  tab_size;
+} TEST_CONF;
+
+static const TEST_CONF g_confs[] = {
+  { 0,                                11, 229, MD_RTF_TABLE_EQUAL,  0, 0, 0 },
+  { MD_RTF_FLAG_ANSI_CP1252,          12, 600, MD_RTF_TABLE_FIT,    0, 0, 4 },
+  { MD_RTF_FLAG_MINIMAL_HEADER,       10, 300, MD_RTF_TABLE_SAMPLE, 2, 0, 0 },
+  { MD_RTF_FLAG_LIST_TABLE,           11, 229, MD_RTF_TABLE_EQUAL,  0, 3, 0 },
+  { MD_RTF_FLAG_HIGHLIGHT,            14, 800, MD_RTF_TABLE_FIT,    0, 2, 8 },
+  { MD_RTF_FLAG_PARA_BORDERS,          9, 150, MD_RTF_TABLE_SAMPLE, 3, 4, 2 },
+  { MD_RTF_FLAG_TOC,                  11, 229, MD_RTF_TABLE_EQUAL,  0, 0, 0 },
+  { MD_RTF_FLAG_VERBATIM_ENTITIES |
+    MD_RTF_FLAG_SKIP_UTF8_BOM,        11, 229, MD_RTF_TABLE_EQUAL,  0, 0, 0 },
+  { MD_RTF_FLAG_HIGHLIGHT |
+    MD_RTF_FLAG_PARA_BORDERS |
+    MD_RTF_FLAG_ANSI_CP1252,          16, 500, MD_RTF_TABLE_SAMPLE, 1, 1, 4 },
+  { MD_RTF_FLAG_LIST_TABLE |
+    MD_RTF_FLAG_MINIMAL_HEADER |
+    MD_RTF_FLAG_TOC |
+    MD_RTF_FLAG_HIGHLIGHT,             8, 900, MD_RTF_TABLE_FIT,    0, 5, 3 },
+  { 0,                                 0, 229, MD_RTF_TABLE_FIT,    0, 0, 0 },
+  { 0,                                 0, 229, MD_RTF_TABLE_SAMPLE, 1, 0, 0 }
+};
+
+#define TEST_CONF_COUNT (sizeof(g_confs) / sizeof(g_confs[0]))
+
+static void
+conf_opts(const TEST_CONF* conf, MD_RTF_OPTS* opts)
+{
+  memset(opts, 0, sizeof(MD_RTF_OPTS));
+  opts->font_size = conf->font_size;
+  opts->doc_width = conf->doc_width;
+  opts->table_layout = conf->table_layout;
+  opts->table_sample = conf->table_sample;
+  opts->code_rows = conf->code_rows;
+  opts->tab_size = conf->tab_size;
+}
+
+static int
+render(const TEST_BUF* md, unsigned flags, const MD_RTF_OPTS* opts, TEST_BUF* out)
+{
+  return md_rtf_ex(md->data, (MD_SIZE)md->size, buf_output, out,
+                   TEST_PARSER_FLAGS, flags, opts);
+}
+
+
+/******************************************
+ ***             Render paths           ***
+ ******************************************/
+
+/* Cache, cold then warm, and a small one which must evict */
+static void
+test_cache(const TEST_BUF* md, const TEST_CONF* conf, const TEST_BUF* ref)
+{
+  static const unsigned long sizes[] = { 1 << 20, 4096 };
+  MD_RTF_OPTS opts;
+  unsigned i, pass;
+
+  conf_opts(conf, &opts);
+
+  for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    opts.cache = md_rtf_cache_new(sizes[i]);
+    for(pass = 0; pass < 2; pass++) {
+      TEST_BUF out = { 0 };
+      int ret = render(md, conf->flags, &opts, &out);
+      test_check(pass ? "cache warm" : "cache cold", ret, ref, &out);
+      buf_free(&out);
+    }
+    md_rtf_cache_free(opts.cache);
+  }
+}
+
+/* Sink, offset map and block map do not change output */
+static void
+test_sink(const TEST_BUF* md, const TEST_CONF* conf, const TEST_BUF* ref)
+{
+  MD_RTF_OFFSET_MAP omap = { 0 };
+  MD_RTF_BLOCK_MAP bmap = { 0 };
+  MD_RTF_OPTS opts;
+  TEST_BUF out = { 0 };
+  int ret;
+
+  conf_opts(conf, &opts);
+  opts.sink = buf_sink;
+  ret = md_rtf_ex(md->data, (MD_SIZE)md->size, NULL, &out,
+                  TEST_PARSER_FLAGS, conf->flags, &opts);
+  test_check("sink", ret, ref, &out);
+  buf_free(&out);
+
+  conf_opts(conf, &opts);
+  opts.offset_map = &omap;
+  opts.block_map = &bmap;
+  ret = render(md, conf->flags, &opts, &out);
+  test_check("offset map", ret, ref, &out);
+  if(ret == 0 && bmap.out_size != out.size)
+    test_fail("block map size", NULL, NULL);
+  buf_free(&out);
+  md_rtf_offset_map_free(&omap);
+  md_rtf_block_map_free(&bmap);
+}
+
+/* Pull reader, with various read sizes */
+static void
+test_reader(const TEST_BUF* md, const TEST_CONF* conf, const TEST_BUF* ref)
+{
+  static const MD_SIZE caps[] = { 1, 13, 4096 };
+  MD_RTF_DATA chunk[4096];
+  MD_RTF_OPTS opts;
+  unsigned i;
+
+  conf_opts(conf, &opts);
+
+  for(i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+    MD_RTF_READER* rd = md_rtf_open(md->data, (MD_SIZE)md->size,
+                                    TEST_PARSER_FLAGS, conf->flags, &opts);
+    TEST_BUF out = { 0 };
+    MD_SIZE size;
+    int ret;
+
+    if(!rd) {
+      test_fail("reader open", NULL, NULL);
+      return;
+    }
+
+    do {
+      ret = md_rtf_read(rd, chunk, caps[i], &size);
+      buf_append(&out, chunk, size);
+    } while(ret == 0 && size != 0);
+
+    md_rtf_close(rd);
+    test_check("reader", ret, ref, &out);
+    buf_free(&out);
+  }
+
+  /* output limit hit by the footer, reader must fail as md_rtf_ex() */
+  if(ref->size > 1) {
+    TEST_BUF out = { 0 };
+    MD_RTF_READER* rd;
+    MD_SIZE size;
+    int ret, ex;
+
+    opts.max_output = (MD_SIZE)ref->size - 1;
+    ex = render(md, conf->flags, &opts, &out);
+    buf_free(&out);
+
+    rd = md_rtf_open(md->data, (MD_SIZE)md->size, TEST_PARSER_FLAGS, conf->flags, &opts);
+    if(!rd) {
+      test_fail("reader open", NULL, NULL);
+      return;
+    }
+    do {
+      ret = md_rtf_read(rd, chunk, sizeof(chunk), &size);
+    } while(ret == 0 && size != 0);
+    md_rtf_close(rd);
+
+    g_checks++;
+    if(ex == 0 || ret != ex)
+      test_fail("reader output limit", NULL, NULL);
+  }
+}
+
+/* Fan-out to targets of other configurations, each must match md_rtf_ex() */
+static void
+test_multi(const TEST_BUF* md, unsigned conf_idx)
+{
+  MD_RTF_TARGET targets[3];
+  MD_RTF_OPTS opts[3];
+  TEST_BUF outs[3];
+  unsigned flags = g_confs[conf_idx].flags;
+  unsigned i;
+  int ret;
+
+  for(i = 0; i < 3; i++) {
+    conf_opts(&g_confs[(conf_idx + i * 3) % TEST_CONF_COUNT], &opts[i]);
+    memset(&outs[i], 0, sizeof(TEST_BUF));
+    targets[i].opts = &opts[i];
+    targets[i].process_output = buf_output;
+    targets[i].userdata = &outs[i];
+    targets[i].result = 0;
+  }
+
+  ret = md_rtf_multi(md->data, (MD_SIZE)md->size, TEST_PARSER_FLAGS, flags,
+                     targets, 3);
+  if(ret != 0)
+    test_fail("multi failed", NULL, NULL);
+
+  for(i = 0; i < 3; i++) {
+    TEST_BUF ref = { 0 };
+    int rret = render(md, flags, &opts[i], &ref);
+    test_check("multi reference", rret, NULL, &ref);
+    test_check("multi", targets[i].result, &ref, &outs[i]);
+    buf_free(&ref);
+    buf_free(&outs[i]);
+  }
+}
+
+/* Preview of first blocks or output bytes, through each render path. Output
+must be the same with an offset map, whose wrappers must keep the preview
+stop, and with md_rtf_multi() beside a whole render target. */
+static void
+test_preview(const TEST_BUF* md, const TEST_CONF* conf, const TEST_BUF* ref)
+{
+  static const unsigned blocks[] = { 1, 3, 0 };
+  static const MD_SIZE outputs[] = { 0, 0, 2048 };
+  MD_RTF_DATA chunk[512];
+  unsigned i, j;
+
+  for(i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+    MD_RTF_OFFSET_MAP omap = { 0 };
+    MD_RTF_TARGET targets[2];
+    MD_RTF_OPTS opts;
+    MD_RTF_OPTS full;
+    MD_RTF_READER* rd;
+    TEST_BUF prev = { 0 };
+    TEST_BUF out = { 0 };
+    TEST_BUF whole = { 0 };
+    MD_SIZE size;
+    int ret;
+
+    conf_opts(conf, &opts);
+    opts.preview_blocks = blocks[i];
+    opts.preview_output = outputs[i];
+
+    ret = render(md, conf->flags, &opts, &prev);
+    test_check("preview", ret, NULL, &prev);
+    if(ret != 0) {
+      buf_free(&prev);
+      continue;
+    }
+    if(prev.size > ref->size)
+      test_fail("preview longer than whole render", ref, &prev);
+
+    /* offset map */
+    opts.offset_map = &omap;
+    ret = render(md, conf->flags, &opts, &out);
+    test_check("preview offset map", ret, &prev, &out);
+    for(j = 0; j < omap.count; j++) {
+      if(omap.entries[j].rtf_off > out.size) {
+        test_fail("preview offset map entry out of output", NULL, NULL);
+        break;
+      }
+    }
+    md_rtf_offset_map_free(&omap);
+    opts.offset_map = NULL;
+    buf_free(&out);
+
+    /* cache is not used */
+    opts.cache = md_rtf_cache_new(1 << 20);
+    ret = render(md, conf->flags, &opts, &out);
+    test_check("preview cache", ret, &prev, &out);
+    md_rtf_cache_free(opts.cache);
+    opts.cache = NULL;
+    buf_free(&out);
+
+    /* pull reader */
+    rd = md_rtf_open(md->data, (MD_SIZE)md->size, TEST_PARSER_FLAGS, conf->flags, &opts);
+    if(rd) {
+      do {
+        ret = md_rtf_read(rd, chunk, sizeof(chunk), &size);
+        buf_append(&out, chunk, size);
+      } while(ret == 0 && size != 0);
+      md_rtf_close(rd);
+      test_check("preview reader", ret, &prev, &out);
+    } else {
+      test_fail("preview reader open", NULL, NULL);
+    }
+    buf_free(&out);
+
+    /* fan-out, preview target ends while the other goes on */
+    conf_opts(conf, &full);
+    targets[0].opts = &opts;
+    targets[0].process_output = buf_output;
+    targets[0].userdata = &out;
+    targets[0].result = 0;
+    targets[1].opts = &full;
+    targets[1].process_output = buf_output;
+    targets[1].userdata = &whole;
+    targets[1].result = 0;
+    ret = md_rtf_multi(md->data, (MD_SIZE)md->size, TEST_PARSER_FLAGS, conf->flags,
+                       targets, 2);
+    if(ret != 0)
+      test_fail("preview multi failed", NULL, NULL);
+    test_check("preview multi", targets[0].result, &prev, &out);
+    test_check("preview multi whole", targets[1].result, ref, &whole);
+
+    buf_free(&prev);
+    buf_free(&out);
+    buf_free(&whole);
+  }
+}
+
+/* Incremental update after random edits, spliced output must match a whole
+render of edited text */
+static void
+test_update(const TEST_BUF* md, const TEST_CONF* conf)
+{
+  static const char* inserts[] = {
+    "", "x", "\n", "\n\n", "- ", "# ", "> ", "```\n", "| a | b |\n|---|---|\n",
+    "**b**", "  ", "{\\}", "\n\n```c\nint x;\n"
+  };
+  MD_RTF_BLOCK_MAP bmap = { 0 };
+  MD_RTF_OPTS opts;
+  TEST_BUF src = { 0 };
+  TEST_BUF cur = { 0 };
+  unsigned edit;
+  int ret;
+
+  buf_append(&src, md->data, md->size);
+
+  conf_opts(conf, &opts);
+  opts.block_map = &bmap;
+  ret = render(&src, conf->flags, &opts, &cur);
+  test_check("update base", ret, NULL, &cur);
+
+  for(edit = 0; edit < 8 && ret == 0; edit++) {
+    const char* ins = inserts[rnd(sizeof(inserts) / sizeof(inserts[0]))];
+    size_t ins_size = strlen(ins);
+    size_t off = rnd((unsigned)src.size + 1);
+    size_t del = rnd(6);
+    TEST_BUF edited = { 0 };
+    TEST_BUF part = { 0 };
+    TEST_BUF spliced = { 0 };
+    TEST_BUF ref = { 0 };
+    MD_RTF_OPTS ref_opts;
+    MD_RTF_SPLICE splice;
+
+    if(off + del > src.size)
+      del = src.size - off;
+
+    buf_append(&edited, src.data, off);
+    buf_append(&edited, ins, ins_size);
+    buf_append(&edited, src.data + off + del, src.size - off - del);
+
+    ret = md_rtf_update(edited.data, (MD_SIZE)edited.size, (MD_OFFSET)off,
+                        (MD_SIZE)del, (MD_SIZE)ins_size, buf_output, &part,
+                        TEST_PARSER_FLAGS, conf->flags, &opts, &splice);
+
+    if(ret == 0 && splice.offset + splice.removed <= cur.size) {
+      buf_append(&spliced, cur.data, splice.offset);
+      buf_append(&spliced, part.data, part.size);
+      buf_append(&spliced, cur.data + splice.offset + splice.removed,
+                 cur.size - splice.offset - splice.removed);
+    } else if(ret == 0) {
+      test_fail("update splice out of output", NULL, NULL);
+      ret = -1;
+    }
+
+    conf_opts(conf, &ref_opts);
+    render(&edited, conf->flags, &ref_opts, &ref);
+    test_check("update", ret, &ref, &spliced);
+    if(ret == 0 && bmap.out_size != spliced.size)
+      test_fail("update block map size", NULL, NULL);
+
+    buf_free(&src);
+    buf_free(&cur);
+    src = edited;
+    cur = spliced;
+    buf_free(&part);
+    buf_free(&ref);
+  }
+
+  buf_free(&src);
+  buf_free(&cur);
+  md_rtf_block_map_free(&bmap);
+}
+
+static void
+test_doc(const TEST_BUF* md)
+{
+  unsigned i;
+
+  for(i = 0; i < TEST_CONF_COUNT; i++) {
+    const TEST_CONF* conf = &g_confs[i];
+    MD_RTF_VALIDATOR* v;
+    MD_RTF_OPTS opts;
+    TEST_BUF ref = { 0 };
+    int ret, valid;
+
+    g_conf = i;
+
+    /* reference render, checked while it is produced */
+    v = md_rtf_validator_new(buf_output, &ref);
+    conf_opts(conf, &opts);
+    ret = md_rtf_ex(md->data, (MD_SIZE)md->size, md_rtf_validate, v,
+                    TEST_PARSER_FLAGS, conf->flags, &opts);
+    valid = md_rtf_validator_end(v, NULL);
+    md_rtf_validator_free(v);
+    g_checks++;
+    if(ret != 0 || valid != 0) {
+      test_fail(ret ? "render failed" : "render output invalid", NULL, NULL);
+      buf_free(&ref);
+      continue;
+    }
+
+    test_cache(md, conf, &ref);
+    test_sink(md, conf, &ref);
+    test_reader(md, conf, &ref);
+    test_multi(md, i);
+    test_preview(md, conf, &ref);
+    test_update(md, conf);
+
+    buf_free(&ref);
+  }
+}
+
+/* Code lines with null characters, given by the parser as separate text, must
+be rendered in source order, whatever the path */
+static void
+test_code_nul(void)
+{
+  static const struct { const char* data; size_t size; } docs[] = {
+    { "```\nab\0cd\n```\n", 14 },
+    { "```c\nab\0cd\n    \0ef\n```\n", 23 },
+    { "```\n  ab\0cd\n\n\0\0ef\n```\n", 22 }
+  };
+  unsigned i, j;
+
+  for(i = 0; i < sizeof(docs) / sizeof(docs[0]); i++) {
+    TEST_BUF md = { 0 };
+    buf_append(&md, docs[i].data, docs[i].size);
+
+    for(j = 0; j < TEST_CONF_COUNT; j++) {
+      MD_RTF_OPTS opts;
+      TEST_BUF out = { 0 };
+      size_t ab, ef;
+      int ret;
+
+      g_conf = j;
+      conf_opts(&g_confs[j], &opts);
+      ret = render(&md, g_confs[j].flags, &opts, &out);
+      test_check("code null char", ret, NULL, &out);
+
+      /* lines of code in order, whatever the line feeds in between */
+      ab = buf_find(&out, 0, "ab\0cd", 5);
+      ef = (i > 0) ? buf_find(&out, ab, "\0ef", 3) : 0;
+      if(ab == out.size || ef == out.size)
+        test_fail("code null char out of order", NULL, NULL);
+
+      buf_free(&out);
+    }
+
+    buf_free(&md);
+  }
+}
+
+/* Validator on handmade data, whole and cut in chunks, which must give the
+same result at the same offset */
+static void
+test_validator(void)
+{
+  static const struct { const char* data; int result; } docs[] = {
+    { "{\\rtf1 \\trowd\\cellx100\\cellx200 a\\cell b\\cell\\row\\trowd\\cellx100\\cellx200 c\\cell d\\cell\\row}", 0 },
+    { "{\\rtf1 \\trowd\\cellx100\\cellx200 a\\cell b\\cell\\row\\trowd\\cellx100\\cellx200 c\\cell d\\cell e\\cell\\row}", MD_RTF_INVALID_TABLE },
+    { "{\\rtf1 \\trowd\\cellx100\\cellx200 a\\cell b\\cell\\row\\trowd\\cellx100 c\\cell d\\cell\\row}", MD_RTF_INVALID_TABLE },
+    { "{\\rtf1 \\trowd\\cellx12345678901234 a\\cell\\row}", MD_RTF_INVALID_WORD },
+    { "{\\rtf1 \\fs123456789012345678901234567890 a}", MD_RTF_INVALID_WORD },
+    { "{\\rtf1 \\u-40000 a}", MD_RTF_INVALID_UNICODE },
+    { "{\\rtf1 a}}", MD_RTF_INVALID_GROUP }
+  };
+  static const MD_SIZE chunks[] = { 1, 7, 64 };
+  unsigned i, j;
+
+  for(i = 0; i < sizeof(docs) / sizeof(docs[0]); i++) {
+    const char* data = docs[i].data;
+    MD_SIZE size = (MD_SIZE)strlen(data);
+    MD_RTF_VALIDATOR* v;
+    MD_SIZE off, chunk_off, k;
+    char msg[128];
+    int result;
+
+    g_checks++;
+    v = md_rtf_validator_new(NULL, NULL);
+    md_rtf_validate((const MD_RTF_DATA*)data, size, v);
+    result = md_rtf_validator_end(v, &off);
+    md_rtf_validator_free(v);
+    if(result != docs[i].result) {
+      snprintf(msg, sizeof(msg), "validator doc %u result %d, expected %d", i, result, docs[i].result);
+      test_fail(msg, NULL, NULL);
+      continue;
+    }
+
+    for(j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+      g_checks++;
+      v = md_rtf_validator_new(NULL, NULL);
+      for(k = 0; k < size; k += chunks[j])
+        md_rtf_validate((const MD_RTF_DATA*)data + k, (size - k < chunks[j]) ? size - k : chunks[j], v);
+      if(md_rtf_validator_end(v, &chunk_off) != result || (result != 0 && chunk_off != off)) {
+        snprintf(msg, sizeof(msg), "validator doc %u in chunks of %u differs", i, (unsigned)chunks[j]);
+        test_fail(msg, NULL, NULL);
+      }
+      md_rtf_validator_free(v);
+    }
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  unsigned count = (argc > 1) ? (unsigned)strtoul(argv[1], NULL, 10) : 200;
+  unsigned long seed = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+
+  test_code_nul();
+  test_validator();
+
+  for(g_doc = 0; g_doc < count; g_doc++) {
+    TEST_BUF md = { 0 };
+
+    g_rand = (seed * 2654435761UL + g_doc + 1) & 0xFFFFFFFFUL;
+    if(g_rand == 0)
+      g_rand = 1;
+
+    gen_doc(&md);
+    if(g_doc % 3 == 1)
+      gen_fuzz(&md);
+    if(g_doc % 7 == 3)
+      gen_crlf(&md);
+
+    test_doc(&md);
+    buf_free(&md);
+  }
+
+  printf("%u documents, %u checks, %u failures\n", count, g_checks, g_failures);
+  return g_failures ? 1 : 0;
+}